@@ -0,0 +1,112 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk {
+	size_t size; // bytes of data
+	struct arena_chunk* next;
+	char   data[];
+} arena_chunk;
+
+// the chunks, in the order they're filled; they stay across resets
+static __thread arena_chunk* arena_head = NULL;
+static __thread arena_chunk* arena_cur = NULL;
+static __thread size_t       arena_used = 0; // of arena_cur's data
+
+// holds each thread's first chunk, so its arena goes when it does
+static pthread_key_t  arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void
+arena_free_chunks(void* head)
+{
+	arena_chunk* chunk = head;
+	while (chunk) {
+		arena_chunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+static void
+arena_make_key()
+{
+	pthread_key_create(&arena_key, arena_free_chunks);
+}
+
+void*
+arena_alloc(size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	while (arena_cur == NULL || arena_used + size > arena_cur->size) {
+		arena_chunk* next = arena_cur ? arena_cur->next : arena_head;
+
+		// the next one along if it's big enough; a new one if not, or
+		// at the end
+		if (next == NULL || next->size < size) {
+			size_t bytes = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+			arena_chunk* fresh = malloc(sizeof(arena_chunk) + bytes);
+			fresh->size = bytes;
+			fresh->next = next;
+
+			if (arena_cur)
+				arena_cur->next = fresh;
+			else {
+				arena_head = fresh;
+				pthread_once(&arena_key_once, arena_make_key);
+				pthread_setspecific(arena_key, fresh);
+			}
+			next = fresh;
+		}
+
+		arena_cur = next;
+		arena_used = 0;
+	}
+
+	void* ptr = arena_cur->data + arena_used;
+	arena_used += size;
+	return ptr;
+}
+
+char*
+arena_strndup(const char* text, size_t len)
+{
+	char* copy = arena_alloc(len + 1);
+	memcpy(copy, text, len);
+	copy[len] = 0;
+	return copy;
+}
+
+char*
+arena_strdup(const char* text)
+{
+	return arena_strndup(text, strlen(text));
+}
+
+void
+arena_reset()
+{
+	// back to the start of the first chunk
+	arena_cur = NULL;
+	arena_used = 0;
+}
+
+void
+arena_free()
+{
+	arena_free_chunks(arena_head);
+	if (arena_head)
+		pthread_setspecific(arena_key, NULL);
+
+	arena_head = NULL;
+	arena_cur = NULL;
+	arena_used = 0;
+}
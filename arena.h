@@ -0,0 +1,17 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Per-request temporaries: path components, directory listings and the
+// like. Allocation bumps a pointer through chunks that are kept from
+// one request to the next; nothing is freed on its own, the whole lot is
+// let go at once by arena_reset when the request is done. Each thread
+// has its own arena, freed by arena_free or when the thread exits.
+void* arena_alloc(size_t size);
+char* arena_strdup(const char* text);
+char* arena_strndup(const char* text, size_t len);
+void  arena_reset();
+void  arena_free();
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+// A block backend moves whole pages between the disk image and memory.
+// pages.c picks one at mount time (-o backend=NAME).
+typedef struct backend {
+	const char* name;
+	int   (*open)(const char* path, int pages);
+	int   (*resize)(int pages); // grow the image; mapped pages must not move
+	void  (*close)();
+	void* (*map)(int pnum); // direct pointer into the image, NULL if unmapped
+	void  (*unmap)(int pnum); // drop one map of pnum, NULL if maps never go away
+	void  (*release)(); // drop every map taken during the op
+	int   (*read)(int pnum, void* buf);
+	int   (*write)(int pnum, const void* buf);
+	int   (*write_batch)(int count, const int* pnums, void* const* bufs);
+	int   (*sync)();
+	int   (*sync_range)(int pnum, int count); // at least these pages are durable
+	int   (*writeback)(int pnum, int count); // start writing these out; runs unlocked
+	void  (*advise)(int pnum, int count, int advice); // advice is a MADV_* value
+} backend;
+
+extern backend mmap_backend;
+extern backend pread_backend;
+extern backend direct_backend;
+extern backend uring_backend;
+extern backend window_backend;
+
+backend* backend_lookup(const char* name);
+
+#endif
@@ -0,0 +1,177 @@
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "backend.h"
+#include "copy.h"
+
+#include "globals.h"
+
+extern const int PAGE_SIZE;
+
+extern int   pages_fd;
+extern void* pages_base;
+
+extern nufs_opts mount_opts;
+
+static size_t mmap_size = 0;
+static size_t mmap_reserved = 0;
+
+int
+mmap_open(const char* path, int pages)
+{
+    pages_fd = open(path, O_CREAT | O_RDWR, 0644);
+	if (pages_fd == -1)
+		return -errno;
+
+	size_t size = (size_t)pages * PAGE_SIZE;
+
+	struct stat st;
+	fstat(pages_fd, &st);
+	if (st.st_size < size && ftruncate(pages_fd, size) == -1)
+		return -errno;
+
+	// reserve address space for the largest image up front, so growing
+	// never moves pages_base out from under pointers we've handed out
+	int max_pages = mount_opts.max_pages > pages ? mount_opts.max_pages : pages;
+	mmap_reserved = (size_t)max_pages * PAGE_SIZE;
+
+    pages_base = mmap(0, mmap_reserved, PROT_NONE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (pages_base == MAP_FAILED) {
+		pages_base = NULL;
+		return -errno;
+	}
+
+	// get start of memory region
+    void* base = mmap(pages_base, size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_FIXED, pages_fd, 0);
+	if (base == MAP_FAILED)
+		return -errno;
+
+	mmap_size = size;
+	return 0;
+}
+
+int
+mmap_resize(int pages)
+{
+	size_t size = (size_t)pages * PAGE_SIZE;
+	if (size > mmap_reserved)
+		return -ENOSPC;
+
+	if (ftruncate(pages_fd, size) == -1)
+		return -errno;
+
+	// map just the new tail at its fixed place in the reservation
+	void* tail = mmap(pages_base + mmap_size, size - mmap_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_FIXED, pages_fd, mmap_size);
+	if (tail == MAP_FAILED)
+		return -errno;
+
+	mmap_size = size;
+	return 0;
+}
+
+void
+mmap_close()
+{
+    int rv = munmap(pages_base, mmap_reserved);
+    assert(rv == 0);
+
+	close(pages_fd);
+}
+
+void*
+mmap_map(int pnum)
+{
+    return pages_base + (size_t)PAGE_SIZE * pnum;
+}
+
+int
+mmap_read(int pnum, void* buf)
+{
+	copy_page(buf, mmap_map(pnum));
+	return 0;
+}
+
+int
+mmap_write(int pnum, const void* buf)
+{
+	copy_page(mmap_map(pnum), buf);
+	return 0;
+}
+
+int
+mmap_write_batch(int count, const int* pnums, void* const* bufs)
+{
+	for (int ii = 0; ii < count; ++ii)
+		mmap_write(pnums[ii], bufs[ii]);
+
+	return 0;
+}
+
+int
+mmap_sync()
+{
+	if (msync(pages_base, mmap_size, MS_SYNC) == -1)
+		return -errno;
+
+	return 0;
+}
+
+int
+mmap_sync_range(int pnum, int count)
+{
+	if (msync(mmap_map(pnum), (size_t)count * PAGE_SIZE, MS_SYNC) == -1)
+		return -errno;
+
+	return 0;
+}
+
+int
+mmap_writeback(int pnum, int count)
+{
+	// msync(MS_ASYNC) doesn't start anything on Linux; this does, and it
+	// sees pages dirtied through the mapping
+	int rv = sync_file_range(pages_fd, (off_t)pnum * PAGE_SIZE, (off_t)count * PAGE_SIZE,
+	                         SYNC_FILE_RANGE_WRITE);
+	if (rv == -1)
+		return -errno;
+
+	return 0;
+}
+
+void
+mmap_advise(int pnum, int count, int advice)
+{
+	int rv = madvise(mmap_map(pnum), (size_t)count * PAGE_SIZE, advice);
+	if (rv == -1)
+		printf("mmap_advise: madvise(%d) failed: %s\n", advice, strerror(errno));
+}
+
+backend mmap_backend = {
+	.name        = "mmap",
+	.open        = mmap_open,
+	.resize      = mmap_resize,
+	.close       = mmap_close,
+	.map         = mmap_map,
+	.unmap       = NULL,
+	.release     = NULL,
+	.read        = mmap_read,
+	.write       = mmap_write,
+	.write_batch = mmap_write_batch,
+	.sync        = mmap_sync,
+	.sync_range  = mmap_sync_range,
+	.writeback   = mmap_writeback,
+	.advise      = mmap_advise,
+};
@@ -0,0 +1,195 @@
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <alloca.h>
+#include <limits.h>
+
+#include "backend.h"
+
+#include "globals.h"
+
+extern const int PAGE_SIZE;
+
+extern int pages_fd;
+
+int pread_resize(int pages);
+
+int
+pread_open_flags(const char* path, int pages, int flags)
+{
+    pages_fd = open(path, O_CREAT | O_RDWR | flags, 0644);
+	if (pages_fd == -1)
+		return -errno;
+
+	return pread_resize(pages);
+}
+
+int
+pread_open(const char* path, int pages)
+{
+	return pread_open_flags(path, pages, 0);
+}
+
+int
+direct_open(const char* path, int pages)
+{
+	// O_DIRECT needs PAGE_SIZE aligned buffers; the page cache pool is
+	int rv = pread_open_flags(path, pages, O_DIRECT);
+	if (rv == -EINVAL) {
+		printf("direct_open: %s does not support O_DIRECT\n", path);
+	}
+
+	return rv;
+}
+
+int
+pread_resize(int pages)
+{
+	off_t size = (off_t)pages * PAGE_SIZE;
+
+	struct stat st;
+	fstat(pages_fd, &st);
+	if (st.st_size < size && ftruncate(pages_fd, size) == -1)
+		return -errno;
+
+	return 0;
+}
+
+void
+pread_close()
+{
+	fsync(pages_fd);
+	close(pages_fd);
+}
+
+int
+pread_read(int pnum, void* buf)
+{
+	ssize_t rv = pread(pages_fd, buf, PAGE_SIZE, (off_t)pnum * PAGE_SIZE);
+	if (rv != PAGE_SIZE)
+		return rv == -1 ? -errno : -EIO;
+
+	return 0;
+}
+
+int
+pread_write(int pnum, const void* buf)
+{
+	ssize_t rv = pwrite(pages_fd, buf, PAGE_SIZE, (off_t)pnum * PAGE_SIZE);
+	if (rv != PAGE_SIZE)
+		return rv == -1 ? -errno : -EIO;
+
+	return 0;
+}
+
+int
+pread_write_batch(int count, const int* pnums, void* const* bufs)
+{
+	struct iovec* iov = alloca(count * sizeof(struct iovec));
+
+	// pnums are sorted; each run of consecutive pages is one pwritev
+	int ii = 0;
+	while (ii < count) {
+		int run = 0;
+		do {
+			iov[run].iov_base = bufs[ii + run];
+			iov[run].iov_len = PAGE_SIZE;
+			run += 1;
+		} while (ii + run < count && run < IOV_MAX &&
+		         pnums[ii + run] == pnums[ii] + run);
+
+		ssize_t rv = pwritev(pages_fd, iov, run, (off_t)pnums[ii] * PAGE_SIZE);
+		if (rv != (ssize_t)run * PAGE_SIZE)
+			return rv == -1 ? -errno : -EIO;
+
+		ii += run;
+	}
+
+	return 0;
+}
+
+int
+pread_sync()
+{
+	if (fdatasync(pages_fd) == -1)
+		return -errno;
+
+	return 0;
+}
+
+int
+pread_sync_range(int pnum, int count)
+{
+	// the writes are already in the kernel; there's no cheaper durable sync
+	return pread_sync();
+}
+
+int
+pread_writeback(int pnum, int count)
+{
+	// kicks off the write and returns; a no-op for O_DIRECT
+	int rv = sync_file_range(pages_fd, (off_t)pnum * PAGE_SIZE, (off_t)count * PAGE_SIZE,
+	                         SYNC_FILE_RANGE_WRITE);
+	if (rv == -1)
+		return -errno;
+
+	return 0;
+}
+
+void
+pread_advise(int pnum, int count, int advice)
+{
+	int fadv = POSIX_FADV_NORMAL;
+
+	if (advice == MADV_SEQUENTIAL)
+		fadv = POSIX_FADV_SEQUENTIAL;
+	else if (advice == MADV_RANDOM)
+		fadv = POSIX_FADV_RANDOM;
+	else if (advice == MADV_WILLNEED)
+		fadv = POSIX_FADV_WILLNEED;
+
+	posix_fadvise(pages_fd, (off_t)pnum * PAGE_SIZE, (off_t)count * PAGE_SIZE, fadv);
+}
+
+backend pread_backend = {
+	.name        = "pread",
+	.open        = pread_open,
+	.resize      = pread_resize,
+	.close       = pread_close,
+	.map         = NULL,
+	.unmap       = NULL,
+	.release     = NULL,
+	.read        = pread_read,
+	.write       = pread_write,
+	.write_batch = pread_write_batch,
+	.sync        = pread_sync,
+	.sync_range  = pread_sync_range,
+	.writeback   = pread_writeback,
+	.advise      = pread_advise,
+};
+
+backend direct_backend = {
+	.name        = "direct",
+	.open        = direct_open,
+	.resize      = pread_resize,
+	.close       = pread_close,
+	.map         = NULL,
+	.unmap       = NULL,
+	.release     = NULL,
+	.read        = pread_read,
+	.write       = pread_write,
+	.write_batch = pread_write_batch,
+	.sync        = pread_sync,
+	.sync_range  = pread_sync_range,
+	.writeback   = pread_writeback,
+	.advise      = pread_advise,
+};
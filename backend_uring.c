@@ -0,0 +1,262 @@
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "backend.h"
+
+#include "globals.h"
+
+extern const int PAGE_SIZE;
+
+extern int pages_fd;
+
+// io_uring through the raw syscalls, so we don't depend on liburing
+#define URING_ENTRIES 64
+
+static int uring_fd = -1;
+
+// the three regions the rings are mapped in, and how big they are
+static void*  sq_ring = MAP_FAILED;
+static size_t sq_size;
+static void*  cq_ring = MAP_FAILED;
+static size_t cq_size;
+static size_t sqes_size;
+
+static unsigned* sq_head;
+static unsigned* sq_tail;
+static unsigned* sq_mask;
+static unsigned* sq_array;
+static struct io_uring_sqe* sqes = MAP_FAILED;
+
+static unsigned* cq_head;
+static unsigned* cq_tail;
+static unsigned* cq_mask;
+static struct io_uring_cqe* cqes;
+
+int
+uring_open(const char* path, int pages)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+    pages_fd = open(path, O_CREAT | O_RDWR, 0644);
+	if (pages_fd == -1)
+		return -errno;
+
+    int rv = pread_backend.resize(pages);
+	if (rv < 0)
+		return rv;
+
+	uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (uring_fd == -1)
+		return -errno;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	sq_ring = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               uring_fd, IORING_OFF_SQ_RING);
+
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	cq_ring = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               uring_fd, IORING_OFF_CQ_RING);
+
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	            uring_fd, IORING_OFF_SQES);
+
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+		return -errno;
+
+	void* sq = sq_ring;
+	void* cq = cq_ring;
+
+	sq_head  = sq + params.sq_off.head;
+	sq_tail  = sq + params.sq_off.tail;
+	sq_mask  = sq + params.sq_off.ring_mask;
+	sq_array = sq + params.sq_off.array;
+
+	cq_head  = cq + params.cq_off.head;
+	cq_tail  = cq + params.cq_off.tail;
+	cq_mask  = cq + params.cq_off.ring_mask;
+	cqes     = cq + params.cq_off.cqes;
+
+	return 0;
+}
+
+void
+uring_close()
+{
+	// the mappings hold the ring open after the fd is closed
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	if (cq_ring != MAP_FAILED)
+		munmap(cq_ring, cq_size);
+	if (sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_size);
+	sqes = MAP_FAILED;
+	cq_ring = MAP_FAILED;
+	sq_ring = MAP_FAILED;
+
+	close(uring_fd);
+	uring_fd = -1;
+	fsync(pages_fd);
+	close(pages_fd);
+}
+
+int
+uring_submit(int op, int count, const int* pnums, void* const* bufs)
+{
+	int done = 0;
+
+	while (done < count) {
+		int batch = count - done;
+		if (batch > URING_ENTRIES)
+			batch = URING_ENTRIES;
+
+		unsigned tail = *sq_tail;
+		for (int ii = 0; ii < batch; ++ii) {
+			unsigned idx = tail & *sq_mask;
+			struct io_uring_sqe* sqe = &sqes[idx];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = op;
+			sqe->fd = pages_fd;
+			sqe->addr = (unsigned long)bufs[done + ii];
+			sqe->len = PAGE_SIZE;
+			sqe->off = (off_t)pnums[done + ii] * PAGE_SIZE;
+			sqe->user_data = pnums[done + ii];
+
+			sq_array[idx] = idx;
+			tail += 1;
+		}
+		__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+		// one syscall usually submits the whole batch and waits for all
+		// of it; the kernel can take fewer than it's given, or be
+		// interrupted, and is asked again for the rest
+		int err = 0;
+		int submitted = 0;
+		while (submitted < batch) {
+			int want = batch - submitted;
+			int rv = syscall(__NR_io_uring_enter, uring_fd, want, want,
+			                 IORING_ENTER_GETEVENTS, NULL, 0);
+			if (rv == -1 && errno == EINTR)
+				continue;
+			if (rv <= 0) {
+				err = rv == -1 ? -errno : -EIO;
+				break;
+			}
+			submitted += rv;
+		}
+
+		// what it didn't take comes back off the ring, and only what it
+		// did is waited for
+		if (submitted < batch)
+			__atomic_store_n(sq_tail, tail - (batch - submitted), __ATOMIC_RELEASE);
+
+		unsigned head = *cq_head;
+		for (int ii = 0; ii < submitted; ++ii) {
+			while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+				int rv = syscall(__NR_io_uring_enter, uring_fd, 0, 1,
+				                 IORING_ENTER_GETEVENTS, NULL, 0);
+				if (rv == -1 && errno != EINTR) {
+					__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+					return -errno;
+				}
+			}
+
+			struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+			if (cqe->res != PAGE_SIZE) {
+				printf("uring_submit: page %llu -> %d\n", cqe->user_data, cqe->res);
+				err = cqe->res < 0 ? cqe->res : -EIO;
+			}
+			head += 1;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		if (err)
+			return err;
+
+		done += batch;
+	}
+
+	return 0;
+}
+
+int
+uring_read(int pnum, void* buf)
+{
+	return uring_submit(IORING_OP_READ, 1, &pnum, &buf);
+}
+
+int
+uring_write(int pnum, const void* buf)
+{
+	void* bufs[1] = { (void*)buf };
+	return uring_submit(IORING_OP_WRITE, 1, &pnum, bufs);
+}
+
+int
+uring_write_batch(int count, const int* pnums, void* const* bufs)
+{
+	return uring_submit(IORING_OP_WRITE, count, pnums, bufs);
+}
+
+int
+uring_sync()
+{
+	if (fdatasync(pages_fd) == -1)
+		return -errno;
+
+	return 0;
+}
+
+int
+uring_sync_range(int pnum, int count)
+{
+	return uring_sync();
+}
+
+int
+uring_writeback(int pnum, int count)
+{
+	return pread_backend.writeback(pnum, count);
+}
+
+void
+uring_advise(int pnum, int count, int advice)
+{
+	pread_backend.advise(pnum, count, advice);
+}
+
+int
+uring_resize(int pages)
+{
+	return pread_backend.resize(pages);
+}
+
+backend uring_backend = {
+	.name        = "uring",
+	.open        = uring_open,
+	.resize      = uring_resize,
+	.close       = uring_close,
+	.map         = NULL,
+	.unmap       = NULL,
+	.release     = NULL,
+	.read        = uring_read,
+	.write       = uring_write,
+	.write_batch = uring_write_batch,
+	.sync        = uring_sync,
+	.sync_range  = uring_sync_range,
+	.writeback   = uring_writeback,
+	.advise      = uring_advise,
+};
@@ -0,0 +1,378 @@
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "backend.h"
+#include "copy.h"
+
+#include "globals.h"
+
+extern const int PAGE_SIZE;
+
+extern int   pages_fd;
+extern void* pages_base;
+
+extern nufs_opts mount_opts;
+
+// Maps the image a window of mount_opts.window pages at a time, keeping
+// at most mount_opts.windows of them mapped. A window stays mapped while
+// any page in it is held (pages_get_page until pages_put_page or the end
+// of the op); the least recently used unheld window is unmapped to make
+// room. Window 0 holds page 0 and is never unmapped.
+typedef struct window {
+	int   idx;  // window number, -1 if the slot is free
+	void* base;
+	int   refs;
+	long  used; // window_tick when last mapped or hit
+} window;
+
+static window* windows = NULL;
+static int     window_slots = 0; // can go past window_max while all are held
+static int     window_max = 0;
+static int     window_pages = 0;
+static int     window_last = 0;  // slot of the last hit
+static long    window_tick = 0;
+static int     window_advice = MADV_NORMAL;
+
+static long window_hits = 0;
+static long window_maps = 0;
+static long window_unmaps = 0;
+static long window_overcommits = 0;
+
+int pread_resize(int pages);
+int pread_writeback(int pnum, int count);
+void pread_advise(int pnum, int count, int advice);
+
+static void
+window_unmap_slot(window* ww)
+{
+	munmap(ww->base, (size_t)window_pages * PAGE_SIZE);
+	ww->idx = -1;
+	ww->base = NULL;
+	ww->refs = 0;
+	window_unmaps += 1;
+}
+
+static window*
+window_find(int idx)
+{
+	if (windows[window_last].idx == idx)
+		return &windows[window_last];
+
+	for (int ii = 0; ii < window_slots; ++ii) {
+		if (windows[ii].idx == idx) {
+			window_last = ii;
+			return &windows[ii];
+		}
+	}
+
+	return NULL;
+}
+
+static window*
+window_slot()
+{
+	window* lru = NULL;
+
+	for (int ii = 0; ii < window_slots; ++ii) {
+		window* ww = &windows[ii];
+		if (ww->idx == -1)
+			return ww;
+
+		if (ww->refs == 0 && ww->idx != 0 && (!lru || ww->used < lru->used))
+			lru = ww;
+	}
+
+	if (lru) {
+		window_unmap_slot(lru);
+		return lru;
+	}
+
+	// every window is held by the current op; go over budget until it's done
+	windows = realloc(windows, (window_slots + 1) * sizeof(window));
+	window* ww = &windows[window_slots++];
+	ww->idx = -1;
+	ww->base = NULL;
+	ww->refs = 0;
+
+	window_overcommits += 1;
+	return ww;
+}
+
+static window*
+window_get(int idx)
+{
+	window* ww = window_find(idx);
+	if (ww) {
+		window_hits += 1;
+		ww->used = ++window_tick;
+		return ww;
+	}
+
+	ww = window_slot();
+
+	// the last window may run past the end of the file; those pages are
+	// past PAGE_COUNT and only get touched once resize has extended it
+	size_t len = (size_t)window_pages * PAGE_SIZE;
+	void* base = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                  pages_fd, (off_t)idx * len);
+	if (base == MAP_FAILED) {
+		printf("window_get(%d): mmap failed: %s\n", idx, strerror(errno));
+		return NULL;
+	}
+
+	if (window_advice != MADV_NORMAL)
+		madvise(base, len, window_advice);
+
+	ww->idx = idx;
+	ww->base = base;
+	ww->refs = 0;
+	ww->used = ++window_tick;
+
+	window_last = ww - windows;
+	window_maps += 1;
+	return ww;
+}
+
+int
+window_open(const char* path, int pages)
+{
+	window_pages = mount_opts.window;
+	if (window_pages < 1)
+		window_pages = 1;
+
+	window_max = mount_opts.windows;
+	if (window_max < 2)
+		window_max = 2;
+
+	window_slots = window_max;
+
+    pages_fd = open(path, O_CREAT | O_RDWR, 0644);
+	if (pages_fd == -1)
+		return -errno;
+
+	int rv = pread_resize(pages);
+	if (rv < 0)
+		return rv;
+
+	windows = malloc(window_slots * sizeof(window));
+	for (int ii = 0; ii < window_slots; ++ii) {
+		windows[ii].idx = -1;
+		windows[ii].base = NULL;
+		windows[ii].refs = 0;
+	}
+
+	// window 0 has the bitmap, inode table and superblock
+	window* ww = window_get(0);
+	if (!ww)
+		return -ENOMEM;
+
+	pages_base = ww->base;
+	return 0;
+}
+
+int
+window_resize(int pages)
+{
+	// mapped windows already cover their whole range of the file
+	return pread_resize(pages);
+}
+
+void
+window_close()
+{
+	printf("=======WINDOW STATS======\n");
+	printf("windows    : %d x %d pages (%d slots)\n", window_max, window_pages, window_slots);
+	printf("hits       : %ld\n", window_hits);
+	printf("maps       : %ld\n", window_maps);
+	printf("unmaps     : %ld\n", window_unmaps);
+	printf("overcommits: %ld\n", window_overcommits);
+	printf("\n");
+
+	for (int ii = 0; ii < window_slots; ++ii) {
+		if (windows[ii].idx != -1)
+			window_unmap_slot(&windows[ii]);
+	}
+
+	free(windows);
+	windows = NULL;
+	window_slots = 0;
+	window_last = 0;
+	pages_base = NULL;
+
+	close(pages_fd);
+}
+
+void*
+window_map(int pnum)
+{
+	window* ww = window_get(pnum / window_pages);
+	if (!ww)
+		return NULL;
+
+	ww->refs += 1;
+	return ww->base + (size_t)(pnum % window_pages) * PAGE_SIZE;
+}
+
+void
+window_unmap(int pnum)
+{
+	window* ww = window_find(pnum / window_pages);
+	if (ww && ww->refs > 0)
+		ww->refs -= 1;
+}
+
+void
+window_release()
+{
+	for (int ii = 0; ii < window_slots; ++ii)
+		windows[ii].refs = 0;
+
+	// give back what we went over budget by, free slots then the coldest
+	while (window_slots > window_max) {
+		window* victim = NULL;
+		for (int ii = 0; ii < window_slots; ++ii) {
+			window* ww = &windows[ii];
+			if (ww->idx == -1) {
+				victim = ww;
+				break;
+			}
+
+			if (ww->idx != 0 && (!victim || ww->used < victim->used))
+				victim = ww;
+		}
+
+		if (victim->idx != -1)
+			window_unmap_slot(victim);
+
+		*victim = windows[--window_slots];
+		window_last = 0;
+	}
+}
+
+int
+window_read(int pnum, void* buf)
+{
+	void* page = window_map(pnum);
+	if (!page)
+		return -ENOMEM;
+
+	copy_page(buf, page);
+	window_unmap(pnum);
+	return 0;
+}
+
+int
+window_write(int pnum, const void* buf)
+{
+	void* page = window_map(pnum);
+	if (!page)
+		return -ENOMEM;
+
+	copy_page(page, buf);
+	window_unmap(pnum);
+	return 0;
+}
+
+int
+window_write_batch(int count, const int* pnums, void* const* bufs)
+{
+	for (int ii = 0; ii < count; ++ii) {
+		int rv = window_write(pnums[ii], bufs[ii]);
+		if (rv < 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+int
+window_sync()
+{
+	// the windows are MAP_SHARED views of the file, so syncing it covers them
+	if (fdatasync(pages_fd) == -1)
+		return -errno;
+
+	return 0;
+}
+
+int
+window_sync_range(int pnum, int count)
+{
+	// msync writes back the file range, including pages dirtied through
+	// a window that has since been unmapped
+	while (count > 0) {
+		int idx = pnum / window_pages;
+		int off = pnum % window_pages;
+		int len = window_pages - off < count ? window_pages - off : count;
+
+		window* ww = window_get(idx);
+		if (!ww)
+			return -ENOMEM;
+
+		if (msync(ww->base + (size_t)off * PAGE_SIZE, (size_t)len * PAGE_SIZE, MS_SYNC) == -1)
+			return -errno;
+
+		pnum += len;
+		count -= len;
+	}
+
+	return 0;
+}
+
+int
+window_writeback(int pnum, int count)
+{
+	// works on the file, so it doesn't matter which windows are mapped
+	return pread_writeback(pnum, count);
+}
+
+void
+window_advise(int pnum, int count, int advice)
+{
+	// range hints carry over to windows mapped later
+	if (advice != MADV_WILLNEED && advice != MADV_DONTNEED)
+		window_advice = advice;
+
+	for (int ii = 0; ii < window_slots; ++ii) {
+		window* ww = &windows[ii];
+		if (ww->idx == -1)
+			continue;
+
+		int first = ww->idx * window_pages;
+		int lo = pnum > first ? pnum : first;
+		int hi = pnum + count < first + window_pages ? pnum + count : first + window_pages;
+		if (lo < hi)
+			madvise(ww->base + (size_t)(lo - first) * PAGE_SIZE, (size_t)(hi - lo) * PAGE_SIZE, advice);
+	}
+
+	// and the kernel can read ahead into windows that aren't mapped yet
+	pread_advise(pnum, count, advice);
+}
+
+backend window_backend = {
+	.name        = "window",
+	.open        = window_open,
+	.resize      = window_resize,
+	.close       = window_close,
+	.map         = window_map,
+	.unmap       = window_unmap,
+	.release     = window_release,
+	.read        = window_read,
+	.write       = window_write,
+	.write_batch = window_write_batch,
+	.sync        = window_sync,
+	.sync_range  = window_sync_range,
+	.writeback   = window_writeback,
+	.advise      = window_advise,
+};
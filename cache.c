@@ -0,0 +1,512 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <alloca.h>
+
+#include "cache.h"
+#include "backend.h"
+#include "csum.h"
+
+#include "globals.h"
+
+extern const int PAGE_SIZE;
+extern backend* pages_backend;
+
+// 2Q: new pages enter the A1in fifo; a page referenced again after it
+// fell out of A1in (it is still remembered in the A1out ghost queue)
+// is hot and goes to the Am lru.
+#define CACHE_A1IN 1
+#define CACHE_AM   2
+
+typedef struct cache_list {
+	centry* head; // most recent
+	centry* tail; // least recent
+	int     count;
+} cache_list;
+
+typedef struct ghost {
+	int pnum;
+	struct ghost* hnext;
+} ghost;
+
+static int   cache_slots = 0;
+static int   cache_used = 0;     // pool entries handed out
+static int   cache_overflow = 0; // entries past cache_slots, all pinned
+static void* cache_pool = NULL;
+
+static centry**   cache_table = NULL;
+static int        cache_buckets = 0;
+static cache_list cache_a1in;
+static cache_list cache_am;
+static int        cache_dirty = 0;
+
+static ghost*  cache_ghosts = NULL;
+static ghost** cache_ghost_table = NULL;
+static int     cache_ghost_slots = 0;
+static int     cache_ghost_next = 0;
+
+static centry** cache_pinned = NULL;
+static int      cache_pinned_count = 0;
+static int      cache_pinned_cap = 0;
+
+static long cache_hits = 0;
+static long cache_misses = 0;
+static long cache_ghost_hits = 0;
+static long cache_evictions = 0;
+static long cache_writebacks = 0;
+static long cache_overcommits = 0;
+
+static void
+list_remove(cache_list* ll, centry* ee)
+{
+	if (ee->prev)
+		ee->prev->next = ee->next;
+	else
+		ll->head = ee->next;
+
+	if (ee->next)
+		ee->next->prev = ee->prev;
+	else
+		ll->tail = ee->prev;
+
+	ee->prev = NULL;
+	ee->next = NULL;
+	ll->count -= 1;
+}
+
+static void
+list_push(cache_list* ll, centry* ee)
+{
+	ee->prev = NULL;
+	ee->next = ll->head;
+
+	if (ll->head)
+		ll->head->prev = ee;
+	else
+		ll->tail = ee;
+
+	ll->head = ee;
+	ll->count += 1;
+}
+
+static cache_list*
+cache_queue(centry* ee)
+{
+	return ee->queue == CACHE_AM ? &cache_am : &cache_a1in;
+}
+
+static centry*
+table_find(int pnum)
+{
+	centry* ee = cache_table[pnum % cache_buckets];
+	while (ee && ee->pnum != pnum)
+		ee = ee->hnext;
+
+	return ee;
+}
+
+static void
+table_insert(centry* ee)
+{
+	int bb = ee->pnum % cache_buckets;
+	ee->hnext = cache_table[bb];
+	cache_table[bb] = ee;
+}
+
+static void
+table_remove(centry* ee)
+{
+	centry** pp = &cache_table[ee->pnum % cache_buckets];
+	while (*pp != ee)
+		pp = &(*pp)->hnext;
+
+	*pp = ee->hnext;
+	ee->hnext = NULL;
+}
+
+static ghost*
+ghost_find(int pnum)
+{
+	ghost* gg = cache_ghost_table[pnum % cache_buckets];
+	while (gg && gg->pnum != pnum)
+		gg = gg->hnext;
+
+	return gg;
+}
+
+static void
+ghost_remove(ghost* gg)
+{
+	ghost** pp = &cache_ghost_table[gg->pnum % cache_buckets];
+	while (*pp != gg)
+		pp = &(*pp)->hnext;
+
+	*pp = gg->hnext;
+	gg->hnext = NULL;
+	gg->pnum = -1;
+}
+
+static void
+ghost_add(int pnum)
+{
+	ghost* gg = &cache_ghosts[cache_ghost_next];
+	cache_ghost_next = (cache_ghost_next + 1) % cache_ghost_slots;
+
+	if (gg->pnum != -1)
+		ghost_remove(gg);
+
+	gg->pnum = pnum;
+	int bb = pnum % cache_buckets;
+	gg->hnext = cache_ghost_table[bb];
+	cache_ghost_table[bb] = gg;
+}
+
+void
+cache_init(int slots)
+{
+	if (slots < 8)
+		slots = 8;
+
+	cache_slots = slots;
+	cache_buckets = 2 * slots;
+
+	// one PAGE_SIZE aligned pool, as O_DIRECT wants
+	int rv = posix_memalign(&cache_pool, PAGE_SIZE, (size_t)slots * PAGE_SIZE);
+	assert(rv == 0);
+
+	cache_table = calloc(cache_buckets, sizeof(centry*));
+
+	cache_ghost_slots = slots / 2;
+	cache_ghosts = calloc(cache_ghost_slots, sizeof(ghost));
+	cache_ghost_table = calloc(cache_buckets, sizeof(ghost*));
+	for (int ii = 0; ii < cache_ghost_slots; ++ii)
+		cache_ghosts[ii].pnum = -1;
+
+	memset(&cache_a1in, 0, sizeof(cache_list));
+	memset(&cache_am, 0, sizeof(cache_list));
+}
+
+static int
+cache_is_pool(centry* ee)
+{
+	return ee->buf >= cache_pool && ee->buf < cache_pool + (size_t)cache_slots * PAGE_SIZE;
+}
+
+static centry*
+cache_victim()
+{
+	// keep A1in at a quarter of the cache, take the rest from the Am tail
+	cache_list* first = &cache_am;
+	cache_list* second = &cache_a1in;
+	if (cache_a1in.count > cache_slots / 4 || cache_am.count == 0) {
+		first = &cache_a1in;
+		second = &cache_am;
+	}
+
+	for (centry* ee = first->tail; ee; ee = ee->prev) {
+		if (ee->pins == 0 && !ee->sticky && !ee->held)
+			return ee;
+	}
+
+	for (centry* ee = second->tail; ee; ee = ee->prev) {
+		if (ee->pins == 0 && !ee->sticky && !ee->held)
+			return ee;
+	}
+
+	return NULL;
+}
+
+static void
+cache_evict(centry* ee)
+{
+	if (ee->dirty) {
+		int rv = pages_backend->write(ee->pnum, ee->buf);
+		if (rv < 0)
+			printf("cache_evict(%d): write back failed: %s\n", ee->pnum, strerror(-rv));
+		else
+			csum_update(ee->pnum, ee->buf);
+
+		ee->dirty = 0;
+		cache_dirty -= 1;
+		cache_writebacks += 1;
+	}
+
+	if (ee->queue == CACHE_A1IN)
+		ghost_add(ee->pnum);
+
+	list_remove(cache_queue(ee), ee);
+	table_remove(ee);
+	cache_evictions += 1;
+}
+
+static centry*
+cache_alloc_entry()
+{
+	centry* ee = NULL;
+
+	if (cache_used < cache_slots) {
+		ee = calloc(1, sizeof(centry));
+		ee->buf = cache_pool + (size_t)cache_used * PAGE_SIZE;
+		cache_used += 1;
+		return ee;
+	}
+
+	ee = cache_victim();
+	if (ee) {
+		cache_evict(ee);
+		return ee;
+	}
+
+	// every page is pinned by the current op; go over budget until it's done
+	ee = calloc(1, sizeof(centry));
+	int rv = posix_memalign(&ee->buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+
+	cache_overflow += 1;
+	cache_overcommits += 1;
+	return ee;
+}
+
+void*
+cache_get(int pnum, int* loaded)
+{
+	// loaded is set if the page had to be read in
+	centry* ee = table_find(pnum);
+
+	if (ee) {
+		cache_hits += 1;
+
+		// hits in A1in are correlated references and don't promote
+		if (ee->queue == CACHE_AM) {
+			list_remove(&cache_am, ee);
+			list_push(&cache_am, ee);
+		}
+	}
+	else {
+		cache_misses += 1;
+
+		ee = cache_alloc_entry();
+		ee->pnum = pnum;
+		ee->pins = 0;
+		ee->dirty = 0;
+		ee->sticky = 0;
+		ee->listed = 0;
+		ee->held = 0;
+
+		int rv = pages_backend->read(pnum, ee->buf);
+		if (rv < 0) {
+			printf("cache_get(%d): read failed: %s\n", pnum, strerror(-rv));
+			memset(ee->buf, 0, PAGE_SIZE);
+		}
+		else if (loaded) {
+			*loaded = 1;
+		}
+
+		ghost* gg = ghost_find(pnum);
+		if (gg) {
+			ghost_remove(gg);
+			cache_ghost_hits += 1;
+			ee->queue = CACHE_AM;
+		}
+		else {
+			ee->queue = CACHE_A1IN;
+		}
+
+		list_push(cache_queue(ee), ee);
+		table_insert(ee);
+	}
+
+	if (cache_pinned_count == cache_pinned_cap) {
+		cache_pinned_cap = cache_pinned_cap ? 2 * cache_pinned_cap : 64;
+		cache_pinned = realloc(cache_pinned, cache_pinned_cap * sizeof(centry*));
+	}
+
+	ee->pins += 1;
+	if (!ee->listed) {
+		ee->listed = 1;
+		cache_pinned[cache_pinned_count++] = ee;
+	}
+
+	return ee->buf;
+}
+
+void
+cache_put(int pnum)
+{
+	centry* ee = table_find(pnum);
+	if (ee && ee->pins > 0)
+		ee->pins -= 1;
+}
+
+void
+cache_mark_dirty(int pnum)
+{
+	centry* ee = table_find(pnum);
+	if (ee && !ee->dirty) {
+		ee->dirty = 1;
+		cache_dirty += 1;
+	}
+}
+
+void
+cache_set_sticky(int pnum)
+{
+	cache_get(pnum, NULL);
+
+	centry* ee = table_find(pnum);
+	ee->sticky = 1;
+}
+
+void
+cache_hold(int pnum)
+{
+	centry* ee = table_find(pnum);
+	if (ee)
+		ee->held = 1;
+}
+
+void
+cache_unhold()
+{
+	cache_list* queues[] = { &cache_a1in, &cache_am };
+	for (int qq = 0; qq < 2; ++qq) {
+		for (centry* ee = queues[qq]->head; ee; ee = ee->next)
+			ee->held = 0;
+	}
+}
+
+int
+cache_is_dirty(int pnum)
+{
+	centry* ee = table_find(pnum);
+	return ee && ee->dirty;
+}
+
+static int
+centry_cmp(const void* aa, const void* bb)
+{
+	return (*(centry**)aa)->pnum - (*(centry**)bb)->pnum;
+}
+
+int
+cache_flush()
+{
+	if (cache_dirty == 0)
+		return 0;
+
+	centry** ents = malloc(cache_dirty * sizeof(centry*));
+	int count = 0;
+
+	cache_list* queues[] = { &cache_a1in, &cache_am };
+	for (int qq = 0; qq < 2; ++qq) {
+		for (centry* ee = queues[qq]->head; ee; ee = ee->next) {
+			if (ee->dirty && !ee->held)
+				ents[count++] = ee;
+		}
+	}
+
+	// sorted so the backend can coalesce neighbouring pages
+	qsort(ents, count, sizeof(centry*), centry_cmp);
+
+	int* pnums = malloc(count * sizeof(int));
+	void** bufs = malloc(count * sizeof(void*));
+	for (int ii = 0; ii < count; ++ii) {
+		pnums[ii] = ents[ii]->pnum;
+		bufs[ii] = ents[ii]->buf;
+		ents[ii]->dirty = 0;
+	}
+
+	int rv = pages_backend->write_batch(count, pnums, bufs);
+	if (rv < 0)
+		printf("cache_flush: write back failed: %s\n", strerror(-rv));
+
+	for (int ii = 0; ii < count && rv == 0; ++ii)
+		csum_update(pnums[ii], bufs[ii]);
+
+	cache_dirty -= count;
+	cache_writebacks += count;
+
+	free(ents);
+	free(pnums);
+	free(bufs);
+	return rv;
+}
+
+void
+cache_release()
+{
+	for (int ii = 0; ii < cache_pinned_count; ++ii) {
+		cache_pinned[ii]->pins = 0;
+		cache_pinned[ii]->listed = 0;
+	}
+
+	cache_pinned_count = 0;
+
+	// give back what we went over budget by
+	cache_list* queues[] = { &cache_a1in, &cache_am };
+	for (int qq = 0; qq < 2 && cache_overflow > 0; ++qq) {
+		centry* ee = queues[qq]->tail;
+		while (ee && cache_overflow > 0) {
+			centry* prev = ee->prev;
+
+			if (!cache_is_pool(ee) && !ee->sticky && !ee->held) {
+				cache_evict(ee);
+				free(ee->buf);
+				free(ee);
+				cache_overflow -= 1;
+			}
+
+			ee = prev;
+		}
+	}
+}
+
+void
+cache_print_stats()
+{
+	printf("========CACHE STATS======\n");
+	printf("slots      : %d (%d in use, %d over)\n", cache_slots, cache_used, cache_overflow);
+	printf("a1in / am  : %d / %d\n", cache_a1in.count, cache_am.count);
+	printf("hits       : %ld\n", cache_hits);
+	printf("misses     : %ld\n", cache_misses);
+	printf("ghost hits : %ld\n", cache_ghost_hits);
+	printf("evictions  : %ld\n", cache_evictions);
+	printf("writebacks : %ld\n", cache_writebacks);
+	printf("overcommits: %ld\n", cache_overcommits);
+	printf("\n");
+}
+
+void
+cache_free()
+{
+	cache_flush();
+	cache_print_stats();
+
+	cache_list* queues[] = { &cache_a1in, &cache_am };
+	for (int qq = 0; qq < 2; ++qq) {
+		centry* ee = queues[qq]->head;
+		while (ee) {
+			centry* next = ee->next;
+			if (!cache_is_pool(ee))
+				free(ee->buf);
+			free(ee);
+			ee = next;
+		}
+	}
+
+	free(cache_pool);
+	free(cache_table);
+	free(cache_ghosts);
+	free(cache_ghost_table);
+	free(cache_pinned);
+
+	cache_pool = NULL;
+	cache_pinned = NULL;
+	cache_pinned_count = 0;
+	cache_pinned_cap = 0;
+	cache_used = 0;
+	cache_overflow = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+// Fixed-size page cache in front of the unmapped backends, with 2Q
+// eviction so one large scan can't flush out the metadata pages.
+typedef struct centry {
+	int   pnum;
+	void* buf;
+	int   pins;   // pages_get_page pins until the op is done
+	char  dirty;
+	char  sticky; // never evicted (page 0, prefaulted pages)
+	char  queue;  // CACHE_A1IN or CACHE_AM
+	char  listed; // on the pinned list until cache_release
+	char  held;   // in an uncommitted journal transaction; not written home
+	struct centry* prev;
+	struct centry* next;
+	struct centry* hnext;
+} centry;
+
+void  cache_init(int slots);
+void  cache_free();
+void* cache_get(int pnum, int* loaded);
+void  cache_put(int pnum);
+void  cache_mark_dirty(int pnum);
+void  cache_set_sticky(int pnum);
+void  cache_hold(int pnum);
+void  cache_unhold();
+int   cache_is_dirty(int pnum);
+int   cache_flush();
+void  cache_release();
+void  cache_print_stats();
+
+#endif
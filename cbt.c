@@ -0,0 +1,526 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "cbt.h"
+#include "pages.h"
+#include "backend.h"
+#include "bitmap.h"
+#include "csum.h"
+#include "journal.h"
+#include "snap.h"
+#include "util.h"
+
+#include "globals.h"
+
+extern int PAGE_COUNT;
+extern const int PAGE_SIZE;
+extern const int BITMAP_SIZE;
+extern backend* pages_backend;
+
+extern nufs_opts mount_opts;
+
+// stamps in one page of the table
+#define CBT_PER_PAGE ((int)(PAGE_SIZE / sizeof(int)))
+
+static int*  cbt_gens = NULL;    // by page number, the generation it changed in
+static int   cbt_bits = 0;
+static int   cbt_table_pages = 0; // cbt_gens is this many pages long
+static void* cbt_own_bm = NULL;  // pages holding the table itself
+static int   cbt_gen = 0;        // this mount's, or since the last snapshot
+static int   cbt_saved = 0;      // what the header on disk says
+static int   cbt_head = -1;      // page list: the header, then the table
+static int   cbt_count = 0;      // pages in that list
+static void* cbt_buf = NULL;
+
+static long cbt_marked = 0;
+static long cbt_saves = 0;
+
+static int
+cbt_write_header(int clean)
+{
+	memset(cbt_buf, 0, PAGE_SIZE);
+
+	cbt_header* hdr = (cbt_header*)cbt_buf;
+	hdr->magic = CBT_MAGIC;
+	hdr->clean = clean;
+	hdr->saved = cbt_saved;
+	hdr->pages = PAGE_COUNT;
+
+	int pnum = pages_list_get(cbt_head, 0);
+	int rv = pages_backend->write(pnum, cbt_buf);
+	if (rv == 0)
+		rv = pages_backend->sync();
+
+	csum_update(pnum, cbt_buf);
+	return rv;
+}
+
+static int
+cbt_load(int gen)
+{
+	// 1 if the saved table is of the mount that ended at gen
+	int hpnum = pages_list_get(cbt_head, 0);
+	if (hpnum <= 0 || pages_backend->read(hpnum, cbt_buf) < 0)
+		return 0;
+
+	cbt_header* hdr = (cbt_header*)cbt_buf;
+	if (hdr->magic != CBT_MAGIC || !hdr->clean || hdr->saved != gen || hdr->pages != PAGE_COUNT)
+		return 0;
+
+	int need = (PAGE_COUNT + CBT_PER_PAGE - 1) / CBT_PER_PAGE;
+	if (cbt_count - 1 < need)
+		return 0;
+
+	for (int ii = 0; ii < need; ++ii) {
+		if (pages_backend->read(pages_list_get(cbt_head, 1 + ii), cbt_buf) < 0)
+			return 0;
+
+		memcpy(cbt_gens + (size_t)ii * CBT_PER_PAGE, cbt_buf, PAGE_SIZE);
+	}
+
+	return 1;
+}
+
+void
+cbt_init()
+{
+	// a snapshot mount changes nothing
+	if (mount_opts.snapshot)
+		return;
+
+	int rv = posix_memalign(&cbt_buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+
+	// sized for the largest the image can grow to
+	cbt_bits = PAGE_COUNT > mount_opts.max_pages ? PAGE_COUNT : mount_opts.max_pages;
+	cbt_table_pages = (cbt_bits + CBT_PER_PAGE - 1) / CBT_PER_PAGE;
+	cbt_gens = calloc(cbt_table_pages, PAGE_SIZE);
+	cbt_own_bm = calloc(cbt_bits / 8 + 2, 1);
+
+	superblock* sb = get_superblock();
+	cbt_head = sb->cbt > 0 ? sb->cbt : -1;
+	cbt_count = 0;
+	while (cbt_head != -1 && pages_list_get(cbt_head, cbt_count) > 0) {
+		int pnum = pages_list_get(cbt_head, cbt_count);
+		if (pnum < cbt_bits)
+			bitmap_put(cbt_own_bm, pnum, 1);
+
+		cbt_count += 1;
+	}
+
+	// if we went down without saving it, any page may have changed
+	int loaded = cbt_load(sb->gen);
+	cbt_saved = loaded ? sb->gen : 0;
+	if (!loaded) {
+		for (int pnum = 0; pnum < cbt_bits; ++pnum)
+			cbt_gens[pnum] = sb->gen;
+	}
+
+	sb->gen += 1;
+	cbt_gen = sb->gen;
+	pages_mark_dirty(0);
+
+	// and from here on, the saved table is missing this mount's changes
+	if (cbt_count > 0)
+		cbt_write_header(0);
+
+	printf("+ cbt_init() -> generation %d, table %s\n", cbt_gen, loaded ? "loaded" : "reset");
+}
+
+void
+cbt_mark(int pnum)
+{
+	if (!cbt_gens || pnum < 0 || pnum >= cbt_bits || cbt_gens[pnum] == cbt_gen ||
+	    bitmap_get(cbt_own_bm, pnum))
+		return;
+
+	cbt_gens[pnum] = cbt_gen;
+	cbt_marked += 1;
+}
+
+int
+cbt_save()
+{
+	if (!cbt_gens)
+		return 0;
+
+	// one page for the header, then the stamps in page order; taking
+	// pages may grow the image, which may need more of them
+	while (cbt_count < 1 + (PAGE_COUNT + CBT_PER_PAGE - 1) / CBT_PER_PAGE) {
+		int pnum = alloc_page();
+		if (pnum == -1)
+			return -ENOSPC;
+
+		bitmap_put(cbt_own_bm, pnum, 1);
+
+		if (pages_list_append(&cbt_head, cbt_count, pnum) < 0)
+			return -ENOSPC;
+
+		cbt_count += 1;
+	}
+
+	get_superblock()->cbt = cbt_head;
+	pages_mark_dirty(0);
+
+	// everything else goes home first, so nothing changed is left out
+	int rv = pages_sync_all();
+
+	for (int ii = 1; ii < cbt_count && ii - 1 < cbt_table_pages && rv == 0; ++ii) {
+		int pnum = pages_list_get(cbt_head, ii);
+		memcpy(cbt_buf, cbt_gens + (size_t)(ii - 1) * CBT_PER_PAGE, PAGE_SIZE);
+		rv = pages_backend->write(pnum, cbt_buf);
+		csum_update(pnum, cbt_buf);
+	}
+
+	if (rv == 0)
+		rv = pages_backend->sync();
+
+	if (rv == 0) {
+		cbt_saved = cbt_gen;
+		rv = cbt_write_header(1);
+	}
+
+	cbt_saves += 1;
+	return rv;
+}
+
+void
+cbt_next()
+{
+	// a snapshot was just taken of generation cbt_gen; what changes
+	// after it is the next one's
+	if (!cbt_gens)
+		return;
+
+	superblock* sb = get_superblock();
+	sb->gen += 1;
+	cbt_gen = sb->gen;
+	pages_mark_dirty(0);
+
+	if (cbt_count > 0)
+		cbt_write_header(0);
+}
+
+void
+cbt_free()
+{
+	if (!cbt_gens) {
+		free(cbt_buf);
+		cbt_buf = NULL;
+		return;
+	}
+
+	int rv = cbt_save();
+	if (rv < 0)
+		printf("cbt_free: table not saved: %s\n", strerror(-rv));
+
+	printf("=======CBT STATS=========\n");
+	printf("gen     : %d\n", cbt_gen);
+	printf("marked  : %ld\n", cbt_marked);
+	printf("saves   : %ld\n", cbt_saves);
+	printf("table   : %d pages\n", cbt_count);
+	printf("\n");
+
+	free(cbt_gens);
+	free(cbt_own_bm);
+	free(cbt_buf);
+
+	cbt_gens = NULL;
+	cbt_own_bm = NULL;
+	cbt_buf = NULL;
+	cbt_head = -1;
+	cbt_count = 0;
+}
+
+static int
+cbt_table(backend* disk, int head, int* saved, int* clean, int* gens, int count)
+{
+	// the stamps of count pages as saved in an image; returns -1 if it
+	// has no table
+	int* list = malloc((1 + (count + CBT_PER_PAGE - 1) / CBT_PER_PAGE) * sizeof(int));
+	int have = pages_list_load(disk, head, list, 1 + (count + CBT_PER_PAGE - 1) / CBT_PER_PAGE);
+
+	void* buf = NULL;
+	int rv = posix_memalign(&buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+
+	cbt_header* hdr = buf;
+	rv = -1;
+	if (have > 0 && disk->read(list[0], buf) == 0 && hdr->magic == CBT_MAGIC &&
+	    hdr->pages >= count && have - 1 >= (count + CBT_PER_PAGE - 1) / CBT_PER_PAGE) {
+		*saved = hdr->saved;
+		*clean = hdr->clean;
+
+		for (int ii = 1; ii < have; ++ii) {
+			if (disk->read(list[ii], buf) < 0)
+				break;
+
+			int nn = min(CBT_PER_PAGE, count - (ii - 1) * CBT_PER_PAGE);
+			memcpy(gens + (size_t)(ii - 1) * CBT_PER_PAGE, buf, nn * sizeof(int));
+		}
+
+		rv = 0;
+	}
+
+	free(buf);
+	free(list);
+	return rv;
+}
+
+static void
+cbt_index_pages(backend* disk, int head, char* always, int count)
+{
+	void* buf = NULL;
+	int rv = posix_memalign(&buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+
+	int ipnum = head;
+	while (ipnum > 0 && ipnum < count && !always[ipnum]) {
+		always[ipnum] = 1;
+		if (disk->read(ipnum, buf) < 0)
+			break;
+
+		ipnum = ((int*)buf)[PAGE_SIZE / sizeof(int) - 1];
+	}
+
+	free(buf);
+}
+
+static int
+cbt_put(int fd, const void* buf, size_t len)
+{
+	ssize_t rv = write(fd, buf, len);
+	return rv == (ssize_t)len ? 0 : -EIO;
+}
+
+static int
+cbt_get(int fd, void* buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t rv = read(fd, buf + done, len - done);
+		if (rv <= 0)
+			return -EIO;
+
+		done += rv;
+	}
+
+	return 0;
+}
+
+int
+cbt_export(const char* path, int since, int snapshot, int fd)
+{
+	// of an image nothing has mounted, or of the snapshot of one that's
+	// mounted. Returns the generation it's through.
+	struct stat st;
+	if (stat(path, &st) == -1)
+		return -errno;
+
+	PAGE_COUNT = st.st_size / PAGE_SIZE;
+
+	backend* disk = &pread_backend;
+	int rv = disk->open(path, PAGE_COUNT);
+	if (rv < 0)
+		return rv;
+
+	if (snapshot && !(disk = snap_view(&pread_backend))) {
+		pread_backend.close();
+		snap_free();
+		return -ENOENT;
+	}
+
+	// the journal is left out of the export, so what's committed in it
+	// goes home first, as the next mount would do; a snapshot's image is
+	// mounted, and the live mount has the journal
+	if (!snapshot) {
+		backend* live = pages_backend;
+		pages_backend = disk;
+		journal_replay();
+		pages_backend = live;
+	}
+
+	void* buf = NULL;
+	rv = posix_memalign(&buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+
+	superblock sb;
+	rv = disk->read(0, buf);
+	memcpy(&sb, buf + PAGE_SIZE - sizeof(superblock), sizeof(superblock));
+	if (rv < 0 || sb.magic != NUFS_MAGIC) {
+		printf("cbt_export: %s isn't an image\n", path);
+		rv = -EINVAL;
+		goto export_out;
+	}
+
+	int pages = min(sb.page_count, PAGE_COUNT);
+	int* gens = calloc(pages, sizeof(int));
+	int saved = 0;
+	int clean = 0;
+	int known = sb.cbt > 0 && cbt_table(disk, sb.cbt, &saved, &clean, gens, pages) == 0;
+
+	// the table is good for a snapshot if it was saved at or after the
+	// snapshot was taken: a later stamp only makes a page look changed
+	// when it isn't. Otherwise it has to be from the last unmount.
+	if (snapshot)
+		known = known && saved >= sb.gen;
+	else
+		known = known && clean && saved == sb.gen;
+
+	if (!known && since > 0) {
+		printf("cbt_export: %s can't say what changed since %d; export from 0\n", path, since);
+		free(gens);
+		rv = -ESTALE;
+		goto export_out;
+	}
+
+	// the bitmap and the checksum table's list can change as we unmount,
+	// after this table's been saved, so their pages always go
+	char* always = calloc(pages, 1);
+	always[0] = 1;
+	for (int pnum = BITMAP_SIZE * 8; pnum < pages; pnum += PAGE_SIZE * 8)
+		always[pnum] = 1;
+
+	cbt_index_pages(disk, sb.csum, always, pages);
+	cbt_index_pages(disk, sb.cbt, always, pages);
+
+	cbt_stream hdr = { CBT_EXPORT_MAGIC, since, sb.gen, pages };
+	rv = cbt_put(fd, &hdr, sizeof(hdr));
+
+	// the journal is left out; applying the export empties it
+	int sent = 0;
+	for (int pnum = 0; pnum < pages && rv == 0; ++pnum) {
+		if (!always[pnum] && since > 0 && gens[pnum] <= since)
+			continue;
+
+		if (sb.journal > 0 && pnum >= sb.journal && pnum < sb.journal + sb.journal_pages)
+			continue;
+
+		rv = disk->read(pnum, buf);
+		if (rv == 0)
+			rv = cbt_put(fd, &pnum, sizeof(int));
+		if (rv == 0)
+			rv = cbt_put(fd, buf, PAGE_SIZE);
+
+		sent += 1;
+	}
+
+	int end = -1;
+	if (rv == 0)
+		rv = cbt_put(fd, &end, sizeof(int));
+
+	printf("+ cbt_export(%s, %d) -> %d of %d pages, through generation %d\n",
+	       path, since, sent, pages, sb.gen);
+
+	free(always);
+	free(gens);
+	if (rv == 0)
+		rv = sb.gen;
+
+export_out:
+	free(buf);
+	disk->close();
+	if (snapshot)
+		snap_free();
+
+	return rv;
+}
+
+int
+cbt_apply(const char* path, int fd)
+{
+	// returns the generation the image is at now
+	cbt_stream hdr;
+	if (cbt_get(fd, &hdr, sizeof(hdr)) < 0 || hdr.magic != CBT_EXPORT_MAGIC)
+		return -EINVAL;
+
+	void* buf = NULL;
+	int rv = posix_memalign(&buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+
+	struct stat st;
+	int have = stat(path, &st) == 0 ? st.st_size / PAGE_SIZE : 0;
+	PAGE_COUNT = max(have, hdr.pages);
+
+	backend* disk = &pread_backend;
+	rv = disk->open(path, PAGE_COUNT);
+	if (rv < 0) {
+		free(buf);
+		return rv;
+	}
+
+	// an incremental export only goes on top of the generation it's
+	// from; a later one has changes of its own the export wouldn't undo
+	superblock* sb = (superblock*)(buf + PAGE_SIZE - sizeof(superblock));
+	int at = have > 0 && disk->read(0, buf) == 0 && sb->magic == NUFS_MAGIC ? sb->gen : 0;
+	if (hdr.since > 0 && at != hdr.since) {
+		printf("cbt_apply: %s is at generation %d, the export is from %d\n", path, at, hdr.since);
+		rv = -ESTALE;
+		goto apply_out;
+	}
+
+	int pnum;
+	int count = 0;
+	while ((rv = cbt_get(fd, &pnum, sizeof(int))) == 0 && pnum != -1) {
+		if (pnum < 0 || pnum >= PAGE_COUNT || cbt_get(fd, buf, PAGE_SIZE) < 0) {
+			rv = -EIO;
+			break;
+		}
+
+		rv = disk->write(pnum, buf);
+		if (rv < 0)
+			break;
+
+		count += 1;
+	}
+
+	if (rv < 0)
+		goto apply_out;
+
+	// the journal, checksums and changed page table of the source are of
+	// pages the export may not have had; the next mount starts them over
+	disk->read(0, buf);
+	superblock nsb = *sb;
+
+	if (nsb.journal > 0) {
+		memset(buf, 0, PAGE_SIZE);
+		for (int ii = 1; ii < nsb.journal_pages; ++ii)
+			disk->write(nsb.journal + ii, buf);
+
+		journal_header* jh = buf;
+		jh->magic = JOURNAL_MAGIC;
+		jh->seq = 1;
+		disk->write(nsb.journal, buf);
+	}
+
+	int list;
+	if (nsb.csum > 0 && pages_list_load(disk, nsb.csum, &list, 1) == 1 && list > 0) {
+		memset(buf, 0, PAGE_SIZE);
+		csum_header* ch = buf;
+		ch->magic = CSUM_MAGIC;
+		disk->write(list, buf);
+	}
+
+	if (nsb.cbt > 0 && pages_list_load(disk, nsb.cbt, &list, 1) == 1 && list > 0) {
+		memset(buf, 0, PAGE_SIZE);
+		cbt_header* th = buf;
+		th->magic = CBT_MAGIC;
+		disk->write(list, buf);
+	}
+
+	rv = disk->sync();
+	printf("+ cbt_apply(%s) -> %d pages, generation %d to %d\n", path, count, at, nsb.gen);
+	if (rv == 0)
+		rv = nsb.gen;
+
+apply_out:
+	free(buf);
+	disk->close();
+	return rv;
+}
@@ -0,0 +1,38 @@
+#ifndef CBT_H
+#define CBT_H
+
+#define CBT_MAGIC 0x42544243 // "CBTB", the changed page table's first page
+#define CBT_EXPORT_MAGIC 0x5846554e // "NUFX", starts an export
+
+// Changed block tracking. Every page is stamped with the generation it
+// last changed in; the generation goes up at each mount and each time a
+// snapshot is taken. The pages changed since generation G are the ones
+// stamped past G, so an incremental backup reads only those. The table
+// is kept like the checksum table: in memory, and saved to a page list
+// at unmount and when a snapshot is taken.
+typedef struct cbt_header {
+	int magic;
+	int clean; // saved at unmount; cleared as soon as we're mounted
+	int saved; // the generation it's complete through, 0 if it isn't
+	int pages; // pages the table covers
+} cbt_header;
+
+// An export is this, then (page number, page) records up to a page
+// number of -1. Applying it brings a copy of the image at generation
+// since (or an empty file, if since is 0) up to generation gen.
+typedef struct cbt_stream {
+	int magic;
+	int since; // pages changed after this generation
+	int gen;   // up to and including this one
+	int pages; // pages in the image
+} cbt_stream;
+
+void cbt_init();
+void cbt_free();
+void cbt_mark(int pnum);
+int  cbt_save();
+void cbt_next();
+int  cbt_export(const char* path, int since, int snapshot, int fd);
+int  cbt_apply(const char* path, int fd);
+
+#endif
@@ -0,0 +1,578 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "compress.h"
+#include "pages.h"
+#include "inode.h"
+#include "delalloc.h"
+#include "copy.h"
+#include "csum.h"
+#include "journal.h"
+#include "util.h"
+
+#include "globals.h"
+
+extern const int PAGE_SIZE;
+
+extern nufs_opts mount_opts;
+
+// An LZ77 block codec in the style of LZ4: each sequence is a token (the
+// literal count in the high nibble, the match length less LZ_MIN_MATCH in
+// the low one, 15 meaning more bytes follow), the literals, then a two
+// byte offset back into the output. The last sequence is literals only.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 13
+#define LZ_MAX_OFFSET 65535
+
+// decompressed clusters kept for reads
+#define COMPRESS_CACHE 8
+
+typedef struct compress_entry {
+	int   inum; // -1 if empty
+	int   cluster;
+	long  used;
+	char* buf;
+} compress_entry;
+
+static compress_entry compress_cache[COMPRESS_CACHE];
+static long compress_tick = 0;
+
+// one cluster, and its stream on the way in or out; we're always under
+// storage_lock
+static char* compress_raw = NULL;
+static char* compress_stream = NULL;
+
+static long compress_packs = 0;
+static long compress_pages_in = 0;
+static long compress_pages_out = 0;
+static long compress_incompressible = 0;
+static long compress_unpacks = 0;
+static long compress_hits = 0;
+static long compress_misses = 0;
+static long compress_bad = 0;
+
+static unsigned
+lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static int
+lz_put_length(unsigned char** opp, unsigned char* oend, int len)
+{
+	// whatever didn't fit in the token's nibble
+	unsigned char* op = *opp;
+	for (len -= 15; len >= 255; len -= 255) {
+		if (op >= oend)
+			return -1;
+		*op++ = 255;
+	}
+
+	if (op >= oend)
+		return -1;
+	*op++ = len;
+
+	*opp = op;
+	return 0;
+}
+
+static int
+lz_emit(unsigned char** opp, unsigned char* oend, const unsigned char* lit, int llen,
+        int off, int mlen)
+{
+	// one sequence; mlen is 0 for the last
+	unsigned char* op = *opp;
+	int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+	if (op >= oend)
+		return -1;
+
+	unsigned char* token = op++;
+	*token = (llen >= 15 ? 15 : llen) << 4 | (ml >= 15 ? 15 : ml);
+
+	if (llen >= 15 && lz_put_length(&op, oend, llen) < 0)
+		return -1;
+
+	if (oend - op < llen)
+		return -1;
+	memcpy(op, lit, llen);
+	op += llen;
+
+	if (mlen) {
+		if (oend - op < 2)
+			return -1;
+		*op++ = off & 0xff;
+		*op++ = off >> 8;
+
+		if (ml >= 15 && lz_put_length(&op, oend, ml) < 0)
+			return -1;
+	}
+
+	*opp = op;
+	return 0;
+}
+
+int
+lz_compress(const void* src, int slen, void* dst, int dcap)
+{
+	// returns the compressed size, or 0 if it doesn't fit in dcap
+	const unsigned char* base = src;
+	const unsigned char* iend = base + slen;
+	const unsigned char* ip = base;
+	const unsigned char* anchor = base;
+	unsigned char* op = dst;
+	unsigned char* oend = op + dcap;
+
+	int table[1 << LZ_HASH_BITS];
+	memset(table, 0xff, sizeof(table));
+
+	while (iend - ip >= LZ_MIN_MATCH) {
+		uint32_t seq;
+		memcpy(&seq, ip, 4);
+
+		unsigned hh = lz_hash(seq);
+		int cand = table[hh];
+		table[hh] = ip - base;
+
+		uint32_t cseq;
+		if (cand >= 0)
+			memcpy(&cseq, base + cand, 4);
+
+		if (cand < 0 || ip - base - cand > LZ_MAX_OFFSET || cseq != seq) {
+			// skip ahead faster the longer nothing has matched, so data
+			// that doesn't compress costs little
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		const unsigned char* mp = base + cand + LZ_MIN_MATCH;
+		const unsigned char* mm = ip + LZ_MIN_MATCH;
+
+		while (iend - mm >= 8) {
+			uint64_t xx, yy;
+			memcpy(&xx, mm, 8);
+			memcpy(&yy, mp, 8);
+			if (xx != yy) {
+				mm += __builtin_ctzll(xx ^ yy) / 8;
+				goto extended;
+			}
+
+			mm += 8;
+			mp += 8;
+		}
+
+		while (mm < iend && *mm == *mp) {
+			mm++;
+			mp++;
+		}
+
+	extended:
+		if (lz_emit(&op, oend, anchor, ip - anchor, ip - (base + cand), mm - ip) < 0)
+			return 0;
+
+		ip = mm;
+		anchor = ip;
+	}
+
+	if (lz_emit(&op, oend, anchor, iend - anchor, 0, 0) < 0)
+		return 0;
+
+	return op - (unsigned char*)dst;
+}
+
+int
+lz_decompress(const void* src, int slen, void* dst, int dcap)
+{
+	// returns the decompressed size, or -1 if the stream is corrupt
+	const unsigned char* ip = src;
+	const unsigned char* iend = ip + slen;
+	unsigned char* obase = dst;
+	unsigned char* op = obase;
+	unsigned char* oend = op + dcap;
+
+	while (ip < iend) {
+		int token = *ip++;
+
+		int llen = token >> 4;
+		if (llen == 15) {
+			int bb;
+			do {
+				if (ip >= iend)
+					return -1;
+				bb = *ip++;
+				llen += bb;
+			} while (bb == 255);
+		}
+
+		if (llen > iend - ip || llen > oend - op)
+			return -1;
+		memcpy(op, ip, llen);
+		op += llen;
+		ip += llen;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		int off = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		int mlen = token & 15;
+		if (mlen == 15) {
+			int bb;
+			do {
+				if (ip >= iend)
+					return -1;
+				bb = *ip++;
+				mlen += bb;
+			} while (bb == 255);
+		}
+		mlen += LZ_MIN_MATCH;
+
+		if (off == 0 || off > op - obase || mlen > oend - op)
+			return -1;
+
+		// an overlapping match repeats its start, a byte at a time
+		const unsigned char* mp = op - off;
+		if (off >= mlen)
+			memcpy(op, mp, mlen);
+		else
+			for (int ii = 0; ii < mlen; ++ii)
+				op[ii] = mp[ii];
+		op += mlen;
+	}
+
+	return op - obase;
+}
+
+void
+compress_init()
+{
+	int bytes = COMPRESS_CLUSTER * PAGE_SIZE;
+
+	compress_raw = malloc(bytes);
+	compress_stream = malloc(bytes);
+
+	for (int ii = 0; ii < COMPRESS_CACHE; ++ii) {
+		compress_cache[ii].inum = -1;
+		compress_cache[ii].buf = malloc(bytes);
+	}
+}
+
+void
+compress_free()
+{
+	printf("=====COMPRESS STATS======\n");
+	printf("mode        : %s\n", mount_opts.compress);
+	printf("clusters    : %ld, %ld pages in %ld\n", compress_packs, compress_pages_in,
+	       compress_pages_out);
+	printf("stored raw  : %ld\n", compress_incompressible);
+	printf("unpacked    : %ld\n", compress_unpacks);
+	printf("cache       : %ld hits, %ld misses\n", compress_hits, compress_misses);
+	printf("bad         : %ld\n", compress_bad);
+	printf("\n");
+
+	for (int ii = 0; ii < COMPRESS_CACHE; ++ii) {
+		free(compress_cache[ii].buf);
+		compress_cache[ii].buf = NULL;
+	}
+
+	free(compress_raw);
+	free(compress_stream);
+	compress_raw = NULL;
+	compress_stream = NULL;
+}
+
+int
+compress_wanted(inode* node)
+{
+	if (!S_ISREG(node->mode) || streq(mount_opts.compress, "off"))
+		return 0;
+
+	return streq(mount_opts.compress, "all") || (node->flags & INODE_COMPRESS);
+}
+
+int
+compress_packed(inode* node, int fpn)
+{
+	int first = fpn - fpn % COMPRESS_CLUSTER;
+	return inode_get_pnum(node, first) == COMPRESSED_PNUM;
+}
+
+void
+compress_drop(int inum, int from)
+{
+	// the clusters changed or went away (every file's if inum is -1)
+	for (int ii = 0; ii < COMPRESS_CACHE; ++ii) {
+		compress_entry* ee = &compress_cache[ii];
+		if (ee->inum != -1 && (inum == -1 || ee->inum == inum) && ee->cluster >= from)
+			ee->inum = -1;
+	}
+}
+
+static void
+compress_forget(int inum, int cluster)
+{
+	for (int ii = 0; ii < COMPRESS_CACHE; ++ii) {
+		if (compress_cache[ii].inum == inum && compress_cache[ii].cluster == cluster)
+			compress_cache[ii].inum = -1;
+	}
+}
+
+static int
+compress_read_page(int pnum, void* dst)
+{
+	void* data = pages_get_data(pnum);
+	if (csum_bad(pnum)) {
+		pages_put_page(pnum);
+		return -1;
+	}
+
+	copy_page(dst, data);
+	pages_put_page(pnum);
+	return 0;
+}
+
+int
+compress_cluster(inode* node, int inum, int cluster, void* const* bufs)
+{
+	// bufs has the cluster's delayed pages, NULL for the others; returns
+	// 0 if the cluster was stored compressed, -1 if it should go in as is
+	int first = cluster * COMPRESS_CLUSTER;
+
+	// only whole clusters; the tail of a file stays as it is
+	if (first + COMPRESS_CLUSTER > bytes_to_pages(node->size))
+		return -1;
+
+	for (int ii = 0; ii < COMPRESS_CLUSTER; ++ii) {
+		void* dst = compress_raw + ii * PAGE_SIZE;
+		int pnum = inode_get_pnum(node, first + ii);
+
+		if (bufs[ii])
+			copy_page(dst, bufs[ii]);
+		else if (pnum == -1)
+			memset(dst, 0, PAGE_SIZE);
+		else if (pnum < 0 || compress_read_page(pnum, dst) < 0)
+			return -1;
+	}
+
+	// it has to save at least a page
+	int cap = (COMPRESS_CLUSTER - 1) * PAGE_SIZE - sizeof(compress_header);
+	int clen = lz_compress(compress_raw, COMPRESS_CLUSTER * PAGE_SIZE,
+	                       compress_stream + sizeof(compress_header), cap);
+	if (clen == 0) {
+		compress_incompressible += 1;
+		return -1;
+	}
+
+	compress_header* hdr = (compress_header*)compress_stream;
+	hdr->magic = COMPRESS_MAGIC;
+	hdr->clen = clen;
+
+	int bytes = sizeof(compress_header) + clen;
+	int need = bytes_to_pages(bytes);
+	memset(compress_stream + bytes, 0, need * PAGE_SIZE - bytes);
+
+	// the stream's pages needn't be contiguous, but they're best together
+	int pnums[COMPRESS_CLUSTER];
+	int have = 0;
+	while (have < need) {
+		int got = 0;
+		int pnum = pages_alloc_extent(need - have, &got);
+		if (pnum == -1) {
+			printf("compress_cluster(%d, %d): out of pages\n", inum, cluster);
+			for (int ii = 0; ii < have; ++ii)
+				free_page(pnums[ii]);
+			return -1;
+		}
+
+		for (int ii = 0; ii < got; ++ii)
+			pnums[have++] = pnum + ii;
+	}
+
+	for (int ii = 0; ii < need; ++ii) {
+		copy_page(pages_get_data(pnums[ii]), compress_stream + ii * PAGE_SIZE);
+		pages_mark_data(pnums[ii]);
+		pages_put_page(pnums[ii]);
+	}
+
+	int placed = 0;
+	for (int ii = 0; ii < COMPRESS_CLUSTER; ++ii)
+		placed += inode_get_pnum(node, first + ii) > 0;
+
+	// pages of the cluster that are already on disk are replaced by the
+	// stream, so it has to be there before the journal commits the
+	// pointers to it; the stream's list is sorted by the sync
+	if (placed > 0) {
+		int sorted[COMPRESS_CLUSTER];
+		memcpy(sorted, pnums, need * sizeof(int));
+		if (pages_sync_list(sorted, need) < 0) {
+			printf("compress_cluster(%d, %d): stream didn't sync\n", inum, cluster);
+			for (int ii = 0; ii < need; ++ii)
+				free_page(pnums[ii]);
+			return -1;
+		}
+	}
+
+	// and what they were stays out of reuse until then
+	for (int ii = 0; ii < COMPRESS_CLUSTER; ++ii) {
+		int pnum = inode_get_pnum(node, first + ii);
+		if (pnum > 0) {
+			free_page(pnum);
+			journal_defer(pnum);
+		}
+
+		if (ii == 0)
+			pnum = COMPRESSED_PNUM;
+		else
+			pnum = ii <= need ? pnums[ii - 1] : -1;
+
+		inode_set_pnum(node, first + ii, pnum);
+	}
+
+	compress_forget(inum, cluster);
+
+	compress_packs += 1;
+	compress_pages_in += COMPRESS_CLUSTER;
+	compress_pages_out += need;
+	return 0;
+}
+
+const char*
+compress_get(inode* node, int inum, int cluster)
+{
+	// the cluster's data, decompressed; NULL if it's corrupt
+	compress_entry* victim = &compress_cache[0];
+	for (int ii = 0; ii < COMPRESS_CACHE; ++ii) {
+		compress_entry* ee = &compress_cache[ii];
+		if (ee->inum == inum && ee->cluster == cluster) {
+			ee->used = ++compress_tick;
+			compress_hits += 1;
+			return ee->buf;
+		}
+
+		if (ee->inum == -1 || (victim->inum != -1 && ee->used < victim->used))
+			victim = ee;
+	}
+
+	compress_misses += 1;
+	victim->inum = -1;
+
+	int first = cluster * COMPRESS_CLUSTER;
+	int pnum = inode_get_pnum(node, first + 1);
+	if (pnum <= 0 || compress_read_page(pnum, compress_stream) < 0)
+		goto bad;
+
+	compress_header* hdr = (compress_header*)compress_stream;
+	int bytes = sizeof(compress_header) + hdr->clen;
+	if (hdr->magic != COMPRESS_MAGIC || hdr->clen <= 0 || bytes > (COMPRESS_CLUSTER - 1) * PAGE_SIZE)
+		goto bad;
+
+	for (int ii = 1; ii < bytes_to_pages(bytes); ++ii) {
+		pnum = inode_get_pnum(node, first + 1 + ii);
+		if (pnum <= 0 || compress_read_page(pnum, compress_stream + ii * PAGE_SIZE) < 0)
+			goto bad;
+	}
+
+	int len = lz_decompress(compress_stream + sizeof(compress_header), hdr->clen,
+	                        victim->buf, COMPRESS_CLUSTER * PAGE_SIZE);
+	if (len != COMPRESS_CLUSTER * PAGE_SIZE)
+		goto bad;
+
+	victim->inum = inum;
+	victim->cluster = cluster;
+	victim->used = ++compress_tick;
+	return victim->buf;
+
+bad:
+	printf("compress_get(%d, %d): cluster is corrupt\n", inum, cluster);
+	compress_bad += 1;
+	return NULL;
+}
+
+int
+compress_unpack(inode* node, int inum, int cluster)
+{
+	// back to a page per file page, before part of the cluster changes;
+	// its pages are delayed again if they can be, so it's compressed
+	// again when they're placed
+	const char* data = compress_get(node, inum, cluster);
+	if (!data)
+		return -EIO;
+
+	int first = cluster * COMPRESS_CLUSTER;
+	int pnums[COMPRESS_CLUSTER];
+	int count = 0;
+
+	for (int ii = 0; ii < COMPRESS_CLUSTER; ++ii) {
+		pnums[ii] = page_is_zero(data + ii * PAGE_SIZE) ? -1 : DELALLOC_PNUM;
+		if (pnums[ii] != -1)
+			count += 1;
+	}
+
+	// every page is had before the stream is let go, and the stream isn't
+	// handed out again until the new pointers are committed
+	if (delalloc_enabled()) {
+		if (delalloc_reserve(count) < 0)
+			return -ENOSPC;
+	}
+	else {
+		for (int ii = 0; ii < COMPRESS_CLUSTER; ++ii) {
+			if (pnums[ii] == -1)
+				continue;
+
+			pnums[ii] = alloc_page();
+			if (pnums[ii] == -1) {
+				for (int jj = 0; jj < ii; ++jj)
+					free_page(pnums[jj]);
+				return -ENOSPC;
+			}
+		}
+	}
+
+	for (int ii = 0; ii < COMPRESS_CLUSTER; ++ii) {
+		const char* src = data + ii * PAGE_SIZE;
+
+		if (pnums[ii] == DELALLOC_PNUM)
+			copy_page(delalloc_get(inum, first + ii), src);
+		else if (pnums[ii] != -1) {
+			copy_page(pages_get_data(pnums[ii]), src);
+			pages_mark_data(pnums[ii]);
+			pages_put_page(pnums[ii]);
+		}
+	}
+
+	// pages put in place of the stream are on disk before anything points
+	// at them
+	if (!delalloc_enabled()) {
+		int placed[COMPRESS_CLUSTER];
+		int nplaced = 0;
+		for (int ii = 0; ii < COMPRESS_CLUSTER; ++ii)
+			if (pnums[ii] > 0)
+				placed[nplaced++] = pnums[ii];
+
+		if (nplaced > 0 && pages_sync_list(placed, nplaced) < 0) {
+			for (int ii = 0; ii < nplaced; ++ii)
+				free_page(placed[ii]);
+			return -EIO;
+		}
+	}
+
+	for (int ii = 0; ii < COMPRESS_CLUSTER; ++ii) {
+		int pnum = inode_get_pnum(node, first + ii);
+		free_page(pnum);
+		journal_defer(pnum);
+		inode_set_pnum(node, first + ii, pnums[ii]);
+	}
+
+	compress_forget(inum, cluster);
+
+	compress_unpacks += 1;
+	return 0;
+}
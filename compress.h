@@ -0,0 +1,35 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "inode.h"
+
+// block pointer of the first page of a compressed cluster
+#define COMPRESSED_PNUM -3
+
+#define COMPRESS_CLUSTER 16 // file pages compressed together
+#define COMPRESS_MAGIC 0x5a4c464e // "NFLZ", first bytes of a cluster's pages
+
+// Transparent compression of file data. A file with INODE_COMPRESS (or
+// every file, with -o compress=all) has its whole clusters compressed
+// when their delayed pages are placed. The first pointer of a compressed
+// cluster is COMPRESSED_PNUM and the next ones hold the pages of the
+// stream, in order; a write to the cluster turns it back into one page
+// per file page first. Reads decompress into a small cache of clusters.
+typedef struct compress_header {
+	int magic;
+	int clen; // bytes of compressed stream after the header
+} compress_header;
+
+int  lz_compress(const void* src, int slen, void* dst, int dcap);
+int  lz_decompress(const void* src, int slen, void* dst, int dcap);
+
+void compress_init();
+void compress_free();
+int  compress_wanted(inode* node);
+int  compress_packed(inode* node, int fpn);
+int  compress_cluster(inode* node, int inum, int cluster, void* const* bufs);
+const char* compress_get(inode* node, int inum, int cluster);
+int  compress_unpack(inode* node, int inum, int cluster);
+void compress_drop(int inum, int from);
+
+#endif
@@ -0,0 +1,208 @@
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COPY_X86 1
+#endif
+
+#include "copy.h"
+
+#include "globals.h"
+
+extern const int PAGE_SIZE;
+
+static void
+copy_page_generic(void* dst, const void* src)
+{
+	memcpy(dst, src, PAGE_SIZE);
+}
+
+static int
+page_is_zero_generic(const void* page)
+{
+	const uint64_t* ww = page;
+	uint64_t acc = 0;
+
+	for (int ii = 0; ii < PAGE_SIZE / 8; ++ii)
+		acc |= ww[ii];
+
+	return acc == 0;
+}
+
+static const char* copy_name = "memcpy";
+static void (*copy_fn)(void* dst, const void* src) = copy_page_generic;
+static void (*stream_fn)(void* dst, const void* src) = copy_page_generic;
+static int  (*zero_fn)(const void* page) = page_is_zero_generic;
+
+#ifdef COPY_X86
+
+// src may be anywhere (a FUSE buffer); dst is a page in the image or the
+// cache unless noted
+
+__attribute__((target("sse2"))) static void
+copy_page_sse2(void* dst, const void* src)
+{
+	__m128i* dd = dst;
+	const __m128i* ss = src;
+
+	for (int ii = 0; ii < PAGE_SIZE / 16; ii += 4) {
+		__m128i x0 = _mm_loadu_si128(ss + ii);
+		__m128i x1 = _mm_loadu_si128(ss + ii + 1);
+		__m128i x2 = _mm_loadu_si128(ss + ii + 2);
+		__m128i x3 = _mm_loadu_si128(ss + ii + 3);
+		_mm_storeu_si128(dd + ii, x0);
+		_mm_storeu_si128(dd + ii + 1, x1);
+		_mm_storeu_si128(dd + ii + 2, x2);
+		_mm_storeu_si128(dd + ii + 3, x3);
+	}
+}
+
+__attribute__((target("sse2"))) static void
+stream_page_sse2(void* dst, const void* src)
+{
+	// non-temporal: a large write won't be read back soon, so don't let
+	// it push everything else out of the cpu cache
+	__m128i* dd = dst;
+	const __m128i* ss = src;
+
+	for (int ii = 0; ii < PAGE_SIZE / 16; ii += 4) {
+		__m128i x0 = _mm_loadu_si128(ss + ii);
+		__m128i x1 = _mm_loadu_si128(ss + ii + 1);
+		__m128i x2 = _mm_loadu_si128(ss + ii + 2);
+		__m128i x3 = _mm_loadu_si128(ss + ii + 3);
+		_mm_stream_si128(dd + ii, x0);
+		_mm_stream_si128(dd + ii + 1, x1);
+		_mm_stream_si128(dd + ii + 2, x2);
+		_mm_stream_si128(dd + ii + 3, x3);
+	}
+
+	_mm_sfence();
+}
+
+__attribute__((target("sse2"))) static int
+page_is_zero_sse2(const void* page)
+{
+	const __m128i* pp = page;
+	__m128i acc = _mm_setzero_si128();
+
+	for (int ii = 0; ii < PAGE_SIZE / 16; ii += 4) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128(pp + ii));
+		acc = _mm_or_si128(acc, _mm_loadu_si128(pp + ii + 1));
+		acc = _mm_or_si128(acc, _mm_loadu_si128(pp + ii + 2));
+		acc = _mm_or_si128(acc, _mm_loadu_si128(pp + ii + 3));
+	}
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+}
+
+__attribute__((target("avx2"))) static void
+copy_page_avx2(void* dst, const void* src)
+{
+	__m256i* dd = dst;
+	const __m256i* ss = src;
+
+	for (int ii = 0; ii < PAGE_SIZE / 32; ii += 4) {
+		__m256i y0 = _mm256_loadu_si256(ss + ii);
+		__m256i y1 = _mm256_loadu_si256(ss + ii + 1);
+		__m256i y2 = _mm256_loadu_si256(ss + ii + 2);
+		__m256i y3 = _mm256_loadu_si256(ss + ii + 3);
+		_mm256_storeu_si256(dd + ii, y0);
+		_mm256_storeu_si256(dd + ii + 1, y1);
+		_mm256_storeu_si256(dd + ii + 2, y2);
+		_mm256_storeu_si256(dd + ii + 3, y3);
+	}
+}
+
+__attribute__((target("avx2"))) static void
+stream_page_avx2(void* dst, const void* src)
+{
+	__m256i* dd = dst;
+	const __m256i* ss = src;
+
+	for (int ii = 0; ii < PAGE_SIZE / 32; ii += 4) {
+		__m256i y0 = _mm256_loadu_si256(ss + ii);
+		__m256i y1 = _mm256_loadu_si256(ss + ii + 1);
+		__m256i y2 = _mm256_loadu_si256(ss + ii + 2);
+		__m256i y3 = _mm256_loadu_si256(ss + ii + 3);
+		_mm256_stream_si256(dd + ii, y0);
+		_mm256_stream_si256(dd + ii + 1, y1);
+		_mm256_stream_si256(dd + ii + 2, y2);
+		_mm256_stream_si256(dd + ii + 3, y3);
+	}
+
+	_mm_sfence();
+}
+
+__attribute__((target("avx2"))) static int
+page_is_zero_avx2(const void* page)
+{
+	const __m256i* pp = page;
+	__m256i acc = _mm256_setzero_si256();
+
+	for (int ii = 0; ii < PAGE_SIZE / 32; ii += 4) {
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(pp + ii));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(pp + ii + 1));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(pp + ii + 2));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(pp + ii + 3));
+	}
+
+	return _mm256_testz_si256(acc, acc);
+}
+
+#endif
+
+void
+copy_init()
+{
+#ifdef COPY_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		copy_name = "avx2";
+		copy_fn = copy_page_avx2;
+		stream_fn = stream_page_avx2;
+		zero_fn = page_is_zero_avx2;
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		copy_name = "sse2";
+		copy_fn = copy_page_sse2;
+		stream_fn = stream_page_sse2;
+		zero_fn = page_is_zero_sse2;
+	}
+#endif
+
+	printf("+ copy_init() -> %s\n", copy_name);
+}
+
+const char*
+copy_kernel()
+{
+	return copy_name;
+}
+
+void
+copy_page(void* dst, const void* src)
+{
+	copy_fn(dst, src);
+}
+
+void
+copy_page_stream(void* dst, const void* src)
+{
+	// the streaming stores want an aligned destination
+	if ((uintptr_t)dst % 32 != 0) {
+		copy_fn(dst, src);
+		return;
+	}
+
+	stream_fn(dst, src);
+}
+
+int
+page_is_zero(const void* page)
+{
+	return zero_fn(page);
+}
@@ -0,0 +1,12 @@
+#ifndef COPY_H
+#define COPY_H
+
+// Whole-page copy and zero-check kernels, picked for the cpu at mount
+// time. Partial pages still go through memcpy.
+void copy_init();
+const char* copy_kernel();
+void copy_page(void* dst, const void* src);
+void copy_page_stream(void* dst, const void* src);
+int  page_is_zero(const void* page);
+
+#endif
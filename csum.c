@@ -0,0 +1,493 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CSUM_X86 1
+#endif
+
+#include "csum.h"
+#include "pages.h"
+#include "backend.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "util.h"
+
+#include "globals.h"
+
+extern int PAGE_COUNT;
+extern const int PAGE_SIZE;
+extern backend* pages_backend;
+
+extern nufs_opts mount_opts;
+
+// checksums in one page of the table
+#define CSUM_PER_PAGE ((int)(PAGE_SIZE / sizeof(unsigned)))
+
+// the hardware crc has a latency of three, so it runs three lanes of
+// this many bytes at once; a page is one pass and a 16 byte tail
+#define CSUM_LANE 1360
+
+static unsigned    csum_soft_table[8][256];
+static unsigned    csum_shift_table[4][256]; // crc of CSUM_LANE more zeros
+static const char* csum_kernel = NULL;
+static unsigned  (*csum_fn)(unsigned crc, const void* buf, size_t len) = NULL;
+
+static int       csum_active = 0;
+static int       csum_data = 0;      // check file data too
+static unsigned* csum_crcs = NULL;   // by page number; 0 if not known
+static int       csum_bits = 0;
+static int       csum_table_pages = 0; // csum_crcs is this many pages long
+static void*     csum_own_bm = NULL;   // pages holding the table itself
+static void*     csum_bad_bm = NULL;   // failed their last check
+static void*     csum_seen_bm = NULL;  // checked or summed since mount
+static int       csum_head = -1;     // page list: the header, then the table
+static int       csum_count = 0;     // pages in that list
+static void*     csum_buf = NULL;
+
+static long csum_updates = 0;
+static long csum_checks = 0;
+static long csum_errors = 0;
+
+static unsigned
+csum_soft(unsigned crc, const void* buf, size_t len)
+{
+	// slicing by 8: one table lookup per byte, but eight independent ones
+	const unsigned char* pp = buf;
+	unsigned cc = ~crc;
+
+	while (len >= 8) {
+		uint64_t ww;
+		memcpy(&ww, pp, 8);
+		ww ^= cc;
+
+		cc = csum_soft_table[7][ww & 0xff] ^
+		     csum_soft_table[6][(ww >> 8) & 0xff] ^
+		     csum_soft_table[5][(ww >> 16) & 0xff] ^
+		     csum_soft_table[4][(ww >> 24) & 0xff] ^
+		     csum_soft_table[3][(ww >> 32) & 0xff] ^
+		     csum_soft_table[2][(ww >> 40) & 0xff] ^
+		     csum_soft_table[1][(ww >> 48) & 0xff] ^
+		     csum_soft_table[0][ww >> 56];
+
+		pp += 8;
+		len -= 8;
+	}
+
+	for (; len > 0; --len, ++pp)
+		cc = (cc >> 8) ^ csum_soft_table[0][(cc ^ *pp) & 0xff];
+
+	return ~cc;
+}
+
+static unsigned
+csum_shift(unsigned cc)
+{
+	return csum_shift_table[0][cc & 0xff] ^ csum_shift_table[1][(cc >> 8) & 0xff] ^
+	       csum_shift_table[2][(cc >> 16) & 0xff] ^ csum_shift_table[3][cc >> 24];
+}
+
+#ifdef CSUM_X86
+
+__attribute__((target("sse4.2"))) static unsigned
+csum_sse42(unsigned crc, const void* buf, size_t len)
+{
+	const unsigned char* pp = buf;
+	uint64_t cc = ~crc;
+
+	// the crc is linear, so lanes summed from zero are joined by moving
+	// the earlier one along past the next lane's bytes
+	while (len >= 3 * CSUM_LANE) {
+		uint64_t c1 = 0;
+		uint64_t c2 = 0;
+
+		for (int ii = 0; ii < CSUM_LANE; ii += 8) {
+			uint64_t w0, w1, w2;
+			memcpy(&w0, pp + ii, 8);
+			memcpy(&w1, pp + CSUM_LANE + ii, 8);
+			memcpy(&w2, pp + 2 * CSUM_LANE + ii, 8);
+			cc = _mm_crc32_u64(cc, w0);
+			c1 = _mm_crc32_u64(c1, w1);
+			c2 = _mm_crc32_u64(c2, w2);
+		}
+
+		cc = csum_shift((unsigned)cc) ^ (unsigned)c1;
+		cc = csum_shift((unsigned)cc) ^ (unsigned)c2;
+
+		pp += 3 * CSUM_LANE;
+		len -= 3 * CSUM_LANE;
+	}
+
+	while (len >= 8) {
+		uint64_t ww;
+		memcpy(&ww, pp, 8);
+		cc = _mm_crc32_u64(cc, ww);
+
+		pp += 8;
+		len -= 8;
+	}
+
+	unsigned c32 = (unsigned)cc;
+	for (; len > 0; --len, ++pp)
+		c32 = _mm_crc32_u8(c32, *pp);
+
+	return ~c32;
+}
+
+#endif
+
+static void
+csum_pick()
+{
+	if (csum_fn)
+		return;
+
+	// CRC32C (Castagnoli), bit reflected
+	for (int ii = 0; ii < 256; ++ii) {
+		unsigned cc = ii;
+		for (int kk = 0; kk < 8; ++kk)
+			cc = (cc & 1) ? (cc >> 1) ^ 0x82f63b78 : cc >> 1;
+
+		csum_soft_table[0][ii] = cc;
+	}
+
+	for (int ii = 0; ii < 256; ++ii) {
+		for (int tt = 1; tt < 8; ++tt) {
+			unsigned prev = csum_soft_table[tt - 1][ii];
+			csum_soft_table[tt][ii] = (prev >> 8) ^ csum_soft_table[0][prev & 0xff];
+		}
+	}
+
+	// where each bit of the crc ends up after CSUM_LANE zero bytes
+	unsigned bits[32];
+	for (int bb = 0; bb < 32; ++bb) {
+		unsigned cc = 1u << bb;
+		for (int ii = 0; ii < CSUM_LANE; ++ii)
+			cc = (cc >> 8) ^ csum_soft_table[0][cc & 0xff];
+
+		bits[bb] = cc;
+	}
+
+	for (int kk = 0; kk < 4; ++kk) {
+		for (int vv = 0; vv < 256; ++vv) {
+			unsigned cc = 0;
+			for (int bb = 0; bb < 8; ++bb) {
+				if (vv & (1 << bb))
+					cc ^= bits[8 * kk + bb];
+			}
+
+			csum_shift_table[kk][vv] = cc;
+		}
+	}
+
+	csum_kernel = "soft";
+	csum_fn = csum_soft;
+
+#ifdef CSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		csum_kernel = "sse4.2";
+		csum_fn = csum_sse42;
+	}
+#endif
+}
+
+unsigned
+csum_crc32c(unsigned crc, const void* buf, size_t len)
+{
+	csum_pick();
+	return csum_fn(crc, buf, len);
+}
+
+static unsigned
+csum_page(const void* page)
+{
+	// 0 means not known, so a page that really sums to 0 is kept as 1
+	unsigned cc = csum_fn(0, page, PAGE_SIZE);
+	return cc ? cc : 1;
+}
+
+static int
+csum_skip(int pnum)
+{
+	// the table and the journal are written around the cache and never summed
+	return pnum < 0 || pnum >= csum_bits || bitmap_get(csum_own_bm, pnum) ||
+	       journal_contains(pnum);
+}
+
+static int
+csum_write_header(int clean)
+{
+	memset(csum_buf, 0, PAGE_SIZE);
+
+	csum_header* hdr = (csum_header*)csum_buf;
+	hdr->magic = CSUM_MAGIC;
+	hdr->clean = clean;
+	hdr->pages = PAGE_COUNT;
+
+	int rv = pages_backend->write(pages_list_get(csum_head, 0), csum_buf);
+	if (rv == 0)
+		rv = pages_backend->sync();
+
+	return rv;
+}
+
+static int
+csum_load()
+{
+	// 1 if the saved table still describes the image
+	int hpnum = pages_list_get(csum_head, 0);
+	if (hpnum <= 0 || pages_backend->read(hpnum, csum_buf) < 0)
+		return 0;
+
+	csum_header* hdr = (csum_header*)csum_buf;
+	if (hdr->magic != CSUM_MAGIC || !hdr->clean || hdr->pages != PAGE_COUNT)
+		return 0;
+
+	int need = (PAGE_COUNT + CSUM_PER_PAGE - 1) / CSUM_PER_PAGE;
+	if (csum_count - 1 < need)
+		return 0;
+
+	for (int ii = 0; ii < need; ++ii) {
+		if (pages_backend->read(pages_list_get(csum_head, 1 + ii), csum_buf) < 0)
+			return 0;
+
+		memcpy(csum_crcs + (size_t)ii * CSUM_PER_PAGE, csum_buf, PAGE_SIZE);
+	}
+
+	return 1;
+}
+
+static void
+csum_rebuild()
+{
+	// every page in use, straight from the image; a read of all of it
+	memset(csum_crcs, 0, (size_t)csum_table_pages * PAGE_SIZE);
+
+	for (int pnum = 0; pnum < PAGE_COUNT; ++pnum) {
+		if (csum_skip(pnum) || (pnum > 0 && !pages_bitmap_get(pnum)))
+			continue;
+
+		if (pages_backend->read(pnum, csum_buf) == 0)
+			csum_crcs[pnum] = csum_page(csum_buf);
+	}
+}
+
+void
+csum_init()
+{
+	csum_pick();
+
+	int rv = posix_memalign(&csum_buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+
+	superblock* sb = get_superblock();
+	csum_head = sb->csum > 0 ? sb->csum : -1;
+	csum_count = 0;
+	while (csum_head != -1 && pages_list_get(csum_head, csum_count) > 0)
+		csum_count += 1;
+
+	if (streq(mount_opts.checksum, "off")) {
+		// a table nobody keeps up to date can't be trusted next time
+		if (csum_count > 0)
+			csum_write_header(0);
+
+		free(csum_buf);
+		csum_buf = NULL;
+		return;
+	}
+
+	if (!streq(mount_opts.checksum, "meta") && !streq(mount_opts.checksum, "all"))
+		printf("csum_init: unknown checksum mode '%s', using meta\n", mount_opts.checksum);
+
+	csum_data = streq(mount_opts.checksum, "all");
+
+	// sized for the largest the image can grow to
+	csum_bits = PAGE_COUNT > mount_opts.max_pages ? PAGE_COUNT : mount_opts.max_pages;
+	csum_table_pages = (csum_bits + CSUM_PER_PAGE - 1) / CSUM_PER_PAGE;
+	csum_crcs = calloc(csum_table_pages, PAGE_SIZE);
+	csum_own_bm = calloc(csum_bits / 8 + 2, 1);
+	csum_bad_bm = calloc(csum_bits / 8 + 2, 1);
+	csum_seen_bm = calloc(csum_bits / 8 + 2, 1);
+
+	for (int ii = 0; ii < csum_count; ++ii) {
+		int pnum = pages_list_get(csum_head, ii);
+		if (pnum < csum_bits)
+			bitmap_put(csum_own_bm, pnum, 1);
+	}
+
+	int loaded = csum_count > 1 && csum_load();
+	if (!loaded)
+		csum_rebuild();
+
+	csum_active = 1;
+
+	// page 0 was read in before there was a table to check it against
+	if (loaded && pages_backend->read(0, csum_buf) == 0)
+		csum_check(0, csum_buf);
+
+	// if we go down without csum_free, the next mount rebuilds the table
+	if (csum_count > 0)
+		csum_write_header(0);
+
+	printf("+ csum_init() -> %s, table %s\n", csum_kernel, loaded ? "loaded" : "rebuilt");
+}
+
+static int
+csum_save()
+{
+	// one page for the header, then the checksums in page order; taking
+	// pages may grow the image, which may need more of them
+	while (csum_count < 1 + (PAGE_COUNT + CSUM_PER_PAGE - 1) / CSUM_PER_PAGE) {
+		int pnum = alloc_page();
+		if (pnum == -1)
+			return -ENOSPC;
+
+		bitmap_put(csum_own_bm, pnum, 1);
+		csum_crcs[pnum] = 0;
+
+		if (pages_list_append(&csum_head, csum_count, pnum) < 0)
+			return -ENOSPC;
+
+		csum_count += 1;
+	}
+
+	get_superblock()->csum = csum_head;
+	pages_mark_dirty(0);
+
+	// everything else goes home first, so the table is of what's there
+	int rv = pages_sync_all();
+
+	for (int ii = 1; ii < csum_count && ii - 1 < csum_table_pages && rv == 0; ++ii) {
+		memcpy(csum_buf, csum_crcs + (size_t)(ii - 1) * CSUM_PER_PAGE, PAGE_SIZE);
+		rv = pages_backend->write(pages_list_get(csum_head, ii), csum_buf);
+	}
+
+	if (rv == 0)
+		rv = pages_backend->sync();
+
+	if (rv == 0)
+		rv = csum_write_header(1);
+
+	return rv;
+}
+
+void
+csum_free()
+{
+	if (!csum_active) {
+		free(csum_buf);
+		csum_buf = NULL;
+		return;
+	}
+
+	int rv = csum_save();
+	if (rv < 0)
+		printf("csum_free: table not saved: %s\n", strerror(-rv));
+
+	printf("=====CHECKSUM STATS======\n");
+	printf("kernel  : %s (%s)\n", csum_kernel, csum_data ? "all pages" : "metadata");
+	printf("checked : %ld\n", csum_checks);
+	printf("bad     : %ld\n", csum_errors);
+	printf("summed  : %ld\n", csum_updates);
+	printf("table   : %d pages\n", csum_count);
+	printf("\n");
+
+	free(csum_crcs);
+	free(csum_own_bm);
+	free(csum_bad_bm);
+	free(csum_seen_bm);
+	free(csum_buf);
+
+	csum_crcs = NULL;
+	csum_own_bm = NULL;
+	csum_bad_bm = NULL;
+	csum_seen_bm = NULL;
+	csum_buf = NULL;
+	csum_active = 0;
+}
+
+int
+csum_enabled()
+{
+	return csum_active;
+}
+
+int
+csum_verify_data()
+{
+	return csum_active && csum_data;
+}
+
+void
+csum_update(int pnum, const void* page)
+{
+	// page is what just went home
+	if (!csum_active || csum_skip(pnum))
+		return;
+
+	csum_crcs[pnum] = csum_page(page);
+	bitmap_put(csum_bad_bm, pnum, 0);
+	bitmap_put(csum_seen_bm, pnum, 1);
+	csum_updates += 1;
+}
+
+void
+csum_forget(int pnum)
+{
+	if (!csum_active || pnum < 0 || pnum >= csum_bits)
+		return;
+
+	csum_crcs[pnum] = 0;
+	bitmap_put(csum_bad_bm, pnum, 0);
+}
+
+int
+csum_check(int pnum, const void* page)
+{
+	// page is what was just read in; 0 if it matches or has no checksum
+	if (!csum_active || csum_skip(pnum))
+		return 0;
+
+	bitmap_put(csum_seen_bm, pnum, 1);
+	if (csum_crcs[pnum] == 0)
+		return 0;
+
+	csum_checks += 1;
+
+	unsigned cc = csum_page(page);
+	if (cc == csum_crcs[pnum])
+		return 0;
+
+	if (!bitmap_get(csum_bad_bm, pnum)) {
+		printf("csum_check(%d): checksum %08x, expected %08x\n", pnum, cc, csum_crcs[pnum]);
+		bitmap_put(csum_bad_bm, pnum, 1);
+	}
+
+	csum_errors += 1;
+	return -EIO;
+}
+
+int
+csum_check_once(int pnum, const void* page)
+{
+	// mapped pages are only read in once; after that memory is the truth
+	if (!csum_active || pnum < 0 || pnum >= csum_bits || bitmap_get(csum_seen_bm, pnum))
+		return 0;
+
+	return csum_check(pnum, page);
+}
+
+int
+csum_bad(int pnum)
+{
+	if (!csum_active || pnum < 0 || pnum >= csum_bits)
+		return 0;
+
+	return bitmap_get(csum_bad_bm, pnum);
+}
@@ -0,0 +1,30 @@
+#ifndef CSUM_H
+#define CSUM_H
+
+#include <stddef.h>
+
+#define CSUM_MAGIC 0x4d555343 // "CSUM", the checksum table's first page
+
+// CRC32C of every page in the image. A page's checksum is taken when it
+// goes home and checked when it's read back in: always for metadata,
+// for file data with -o checksum=all. The table lives in memory and is
+// saved to a page list in the image at unmount; if that never happened
+// it's rebuilt from the image at mount.
+typedef struct csum_header {
+	int magic;
+	int clean; // saved at unmount; cleared as soon as we're mounted
+	int pages; // pages the table covers
+} csum_header;
+
+unsigned csum_crc32c(unsigned crc, const void* buf, size_t len);
+void csum_init();
+void csum_free();
+int  csum_enabled();
+int  csum_verify_data();
+void csum_update(int pnum, const void* page);
+void csum_forget(int pnum);
+int  csum_check(int pnum, const void* page);
+int  csum_check_once(int pnum, const void* page);
+int  csum_bad(int pnum);
+
+#endif
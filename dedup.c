@@ -0,0 +1,125 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "dedup.h"
+#include "pages.h"
+#include "refs.h"
+#include "csum.h"
+#include "bitmap.h"
+
+#include "globals.h"
+
+extern int PAGE_COUNT;
+extern const int PAGE_SIZE;
+
+extern nufs_opts mount_opts;
+
+typedef struct dedup_entry {
+	unsigned hash;
+	int      pnum; // 0 if empty
+} dedup_entry;
+
+static dedup_entry* dedup_index = NULL;
+static unsigned     dedup_mask = 0;
+
+// pages the index may point at; a page leaves it when it's freed, so a
+// stale slot can't hand out a page that's been reused for metadata
+static void* dedup_indexed_bm = NULL;
+static int   dedup_bits = 0;
+
+static long dedup_lookups = 0;
+static long dedup_hits = 0;
+static long dedup_collisions = 0;
+
+void
+dedup_init()
+{
+	if (mount_opts.dedup <= 0)
+		return;
+
+	// a power of two, so a slot is the low bits of the hash
+	int slots = 1;
+	while (slots < mount_opts.dedup)
+		slots *= 2;
+
+	dedup_index = calloc(slots, sizeof(dedup_entry));
+	dedup_mask = slots - 1;
+
+	// sized for the largest the image can grow to
+	dedup_bits = PAGE_COUNT > mount_opts.max_pages ? PAGE_COUNT : mount_opts.max_pages;
+	dedup_indexed_bm = calloc(dedup_bits / 8 + 2, 1);
+}
+
+void
+dedup_free()
+{
+	if (!dedup_index)
+		return;
+
+	printf("======DEDUP STATS========\n");
+	printf("index       : %u slots\n", dedup_mask + 1);
+	printf("lookups     : %ld\n", dedup_lookups);
+	printf("duplicates  : %ld\n", dedup_hits);
+	printf("collisions  : %ld\n", dedup_collisions);
+	printf("\n");
+
+	free(dedup_index);
+	free(dedup_indexed_bm);
+	dedup_index = NULL;
+	dedup_indexed_bm = NULL;
+}
+
+int
+dedup_enabled()
+{
+	return dedup_index != NULL;
+}
+
+int
+dedup_find(const void* page, unsigned* hash)
+{
+	// an indexed page with these contents, with a reference taken for
+	// the caller; -1 if there's none. hash is for dedup_insert.
+	*hash = csum_crc32c(0, page, PAGE_SIZE);
+	dedup_lookups += 1;
+
+	dedup_entry* ee = &dedup_index[*hash & dedup_mask];
+	if (ee->pnum <= 0 || ee->hash != *hash || ee->pnum >= dedup_bits
+	    || !bitmap_get(dedup_indexed_bm, ee->pnum))
+		return -1;
+
+	int pnum = ee->pnum;
+	const void* data = pages_get_data(pnum);
+	int same = !csum_bad(pnum) && memcmp(data, page, PAGE_SIZE) == 0;
+	pages_put_page(pnum);
+
+	if (!same) {
+		dedup_collisions += 1;
+		return -1;
+	}
+
+	refs_get(pnum);
+	dedup_hits += 1;
+	return pnum;
+}
+
+void
+dedup_insert(int pnum, unsigned hash)
+{
+	if (pnum >= dedup_bits)
+		return;
+
+	dedup_entry* ee = &dedup_index[hash & dedup_mask];
+	ee->hash = hash;
+	ee->pnum = pnum;
+	bitmap_put(dedup_indexed_bm, pnum, 1);
+}
+
+void
+dedup_forget(int pnum)
+{
+	if (dedup_indexed_bm && pnum < dedup_bits)
+		bitmap_put(dedup_indexed_bm, pnum, 0);
+}
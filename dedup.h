@@ -0,0 +1,17 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+// Inline deduplication of file data. Pages placed from delalloc are
+// indexed by the CRC32C of their contents; a later page with the same
+// contents (compared byte for byte, not just by hash) takes another
+// reference to the indexed page instead of one of its own. The index is
+// direct mapped, so a newer page pushes out an older one with the same
+// slot, and it only knows pages placed since mount.
+void dedup_init();
+void dedup_free();
+int  dedup_enabled();
+int  dedup_find(const void* page, unsigned* hash);
+void dedup_insert(int pnum, unsigned hash);
+void dedup_forget(int pnum);
+
+#endif
@@ -0,0 +1,295 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "defrag.h"
+#include "pages.h"
+#include "inode.h"
+#include "copy.h"
+#include "csum.h"
+#include "refs.h"
+#include "snap.h"
+#include "tail.h"
+#include "journal.h"
+#include "util.h"
+
+#include "globals.h"
+
+extern int PAGE_COUNT;
+extern int INODE_COUNT;
+
+extern nufs_opts mount_opts;
+
+static int defrag_next = -1; // inode the pass looks at next, -1 between passes
+static int defrag_runs = 0;  // free runs when the pass started
+
+static long defrag_passes = 0;
+static long defrag_scored = 0;
+static long defrag_fragmented = 0;
+static long defrag_files = 0;
+static long defrag_compacted = 0;
+static long defrag_pages = 0;
+static long defrag_pinned = 0;
+static long defrag_no_room = 0;
+static long defrag_bad = 0;
+
+static int
+defrag_free_runs(int* singles)
+{
+	// runs of free pages, and how many of them are one page long
+	int runs = 0;
+	int len = 0;
+	*singles = 0;
+
+	for (int pnum = 1; pnum <= PAGE_COUNT; ++pnum) {
+		if (pnum < PAGE_COUNT && !pages_bitmap_get(pnum)) {
+			len += 1;
+			continue;
+		}
+
+		if (len > 0) {
+			runs += 1;
+			*singles += len == 1;
+		}
+		len = 0;
+	}
+
+	return runs;
+}
+
+int
+defrag_score(inode* node)
+{
+	// extents past the first; holes in the file don't count against it
+	int count = bytes_to_pages(node->size);
+	int extents = 0;
+	int prev = -2;
+
+	for (int fpn = 0; fpn < count; ++fpn) {
+		int pnum = inode_get_pnum(node, fpn);
+		if (pnum <= 0)
+			continue;
+
+		if (pnum != prev + 1)
+			extents += 1;
+		prev = pnum;
+	}
+
+	return extents > 0 ? extents - 1 : 0;
+}
+
+static int
+defrag_file(int inum)
+{
+	// pages moved, 0 if it stays where it is. The indirect page moves
+	// with the data, just ahead of it.
+	inode* node = peek_inode(inum);
+	if (node->refs == 0 || !S_ISREG(node->mode) || node->size <= 0 || tail_packed(node))
+		return 0;
+
+	int count = bytes_to_pages(node->size);
+	int* pnums = malloc(count * sizeof(int));
+	int index = node->iptr;
+	int need = index == -1 ? 0 : 1;
+	int lowest = index == -1 ? PAGE_COUNT : index;
+	int highest = index;
+	int moved = 0;
+
+	if (index != -1 && (snap_frozen(index) || csum_bad(index))) {
+		defrag_pinned += 1;
+		goto done;
+	}
+
+	for (int fpn = 0; fpn < count; ++fpn) {
+		pnums[fpn] = inode_get_pnum(node, fpn);
+		if (pnums[fpn] == -1)
+			continue;
+
+		// delayed, compressed, or still another pointer's or the snapshot's
+		if (pnums[fpn] <= 0 || refs_shared(pnums[fpn]) || snap_frozen(pnums[fpn])) {
+			defrag_pinned += 1;
+			goto done;
+		}
+
+		lowest = min(lowest, pnums[fpn]);
+		highest = max(highest, pnums[fpn]);
+		need += 1;
+	}
+
+	if (need == 0 || need == (index != -1))
+		goto done;
+
+	int score = defrag_score(node);
+	defrag_scored += 1;
+	defrag_fragmented += score > 0;
+
+	// into one run in its own group, or anywhere it fits; a file that's
+	// in one run already only moves down its group
+	int size = mount_opts.group > 0 ? mount_opts.group : PAGE_COUNT;
+	int low = (lowest / size) * size;
+	int to;
+
+	if (score > 0) {
+		to = pages_alloc_fit(need, low, low + size);
+		if (to == -1)
+			to = pages_alloc_fit(need, 1, PAGE_COUNT);
+		if (to == -1) {
+			defrag_no_room += 1;
+			goto done;
+		}
+	}
+	else {
+		if (highest - lowest + 1 != need)
+			goto done;
+
+		to = pages_alloc_fit(need, low, lowest);
+		if (to == -1)
+			goto done;
+
+		// only worth it if there are fewer free runs after: one less if
+		// it fills its new hole, one more if the old place is an island
+		int end = lowest + need;
+		int runs = (to + need < PAGE_COUNT && !pages_bitmap_get(to + need)) ? 0 : -1;
+		runs += 1 - !pages_bitmap_get(lowest - 1) - (end < PAGE_COUNT && !pages_bitmap_get(end));
+		if (runs >= 0) {
+			for (int pnum = to; pnum < to + need; ++pnum)
+				free_page(pnum);
+			goto done;
+		}
+	}
+
+	// the data's copied first; nothing points at the new pages until
+	// it's all there, so a bad page leaves the file as it was
+	int dst = index == -1 ? to : to + 1;
+	for (int fpn = 0; fpn < count; ++fpn) {
+		if (pnums[fpn] == -1)
+			continue;
+
+		const void* src = pages_get_data(pnums[fpn]);
+		int bad = csum_bad(pnums[fpn]);
+		if (!bad) {
+			copy_page(pages_get_data(dst), src);
+			pages_mark_data(dst);
+			pages_put_page(dst);
+		}
+		pages_put_page(pnums[fpn]);
+
+		if (bad) {
+			printf("defrag_file(%d): page %d is bad, not moved\n", inum, pnums[fpn]);
+			for (int pnum = to; pnum < to + need; ++pnum)
+				free_page(pnum);
+
+			defrag_bad += 1;
+			goto done;
+		}
+
+		dst += 1;
+	}
+
+	// and on disk before anything points at it: the journal only makes
+	// the remap durable, not the data it points to
+	int first = index == -1 ? to : to + 1;
+	int* run = malloc(need * sizeof(int));
+	for (int ii = 0; ii < to + need - first; ++ii)
+		run[ii] = first + ii;
+	int rv = pages_sync_list(run, to + need - first);
+	free(run);
+	if (rv < 0) {
+		printf("defrag_file(%d): %s, not moved\n", inum, strerror(-rv));
+		for (int pnum = to; pnum < to + need; ++pnum)
+			free_page(pnum);
+		goto done;
+	}
+
+	// then remapped, in the same transaction as the frees; the old pages
+	// aren't handed out again until that's committed, since until then
+	// the file on disk is still in them
+	node = get_inode(inum);
+	dst = to;
+	if (index != -1) {
+		copy_page(pages_get_page(to), pages_get_page(index));
+		pages_put_page(index);
+		pages_mark_dirty(to);
+		pages_put_page(to);
+
+		node->iptr = to;
+		dst += 1;
+	}
+
+	for (int fpn = 0; fpn < count; ++fpn) {
+		if (pnums[fpn] == -1)
+			continue;
+
+		inode_set_pnum(node, fpn, dst++);
+		free_page(pnums[fpn]);
+		journal_defer(pnums[fpn]);
+	}
+
+	if (index != -1) {
+		free_page(index);
+		journal_defer(index);
+	}
+
+	if (score > 0)
+		defrag_files += 1;
+	else
+		defrag_compacted += 1;
+
+	defrag_pages += need;
+	moved = need;
+	printf("+ defrag_file(%d) -> %d pages, %d extents, to %d\n", inum, need, score + 1, to);
+
+done:
+	free(pnums);
+	return moved;
+}
+
+void
+defrag_start()
+{
+	int singles;
+	defrag_next = 1;
+	defrag_runs = defrag_free_runs(&singles);
+	defrag_passes += 1;
+
+	printf("+ defrag_start() -> %d free runs, %d single pages\n", defrag_runs, singles);
+}
+
+int
+defrag_step(int budget)
+{
+	// files until budget pages have moved; -1 once the pass is done
+	if (defrag_next == -1)
+		return -1;
+
+	int moved = 0;
+	while (moved < budget && defrag_next < INODE_COUNT)
+		moved += defrag_file(defrag_next++);
+
+	if (defrag_next < INODE_COUNT)
+		return moved;
+
+	int singles;
+	int runs = defrag_free_runs(&singles);
+	printf("+ defrag_step() -> done; %d free runs, were %d; %d single pages\n", runs, defrag_runs, singles);
+
+	defrag_next = -1;
+	return -1;
+}
+
+void
+defrag_free()
+{
+	printf("=====DEFRAG STATS========\n");
+	printf("passes  : %ld\n", defrag_passes);
+	printf("scored  : %ld files, %ld fragmented\n", defrag_scored, defrag_fragmented);
+	printf("moved   : %ld files, %ld compacted, %ld pages\n", defrag_files, defrag_compacted, defrag_pages);
+	printf("pinned  : %ld\n", defrag_pinned);
+	printf("no room : %ld\n", defrag_no_room);
+	printf("bad     : %ld\n", defrag_bad);
+	printf("\n");
+
+	defrag_next = -1;
+}
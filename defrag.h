@@ -0,0 +1,28 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <sys/ioctl.h>
+
+#include "inode.h"
+
+// ioctl on any file in the mount: start a pass over every file
+#define NUFS_IOC_DEFRAG _IO('N', 3)
+
+// Online defragmentation. A file's score is how many extents its pages
+// are in past the first. A pass walks the inode table: a file in more
+// than one extent is moved whole to the first free run it fits in, in
+// its own group if there's one there; a file already in one extent is
+// moved down into a hole lower in its group, so free space collects at
+// the end of each group instead of in single pages between files. Each
+// file is copied to its new pages and then remapped with its old pages
+// freed, all in one journal transaction, so a crash leaves it where it
+// was or where it went. Pages something else has a hold on (another
+// pointer, the snapshot) and delayed, compressed or packed files stay
+// where they are. The pass runs in the background a batch at a time,
+// at -o defrag pages a second.
+void defrag_start();
+int  defrag_step(int budget);
+void defrag_free();
+int  defrag_score(inode* node);
+
+#endif
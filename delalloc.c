@@ -0,0 +1,473 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "delalloc.h"
+#include "pages.h"
+#include "inode.h"
+#include "copy.h"
+#include "compress.h"
+#include "dedup.h"
+#include "tail.h"
+#include "hot.h"
+
+#include "globals.h"
+
+extern const int PAGE_SIZE;
+
+extern nufs_opts mount_opts;
+
+#define DELALLOC_BUCKETS 1024
+
+// free pages kept on top of the delayed ones for the metadata that comes
+// with them: index and extension pages, tail fragment pages, and the
+// checksum and changed page tables, which take a page for every
+// PAGE_SIZE / sizeof(int) pages they cover
+#define DELALLOC_META_PAGES 8
+
+static dpage** delalloc_table = NULL;
+static int     delalloc_count = 0;
+static int     delalloc_holds = 0; // of delalloc_count, pages held for the hot tier
+
+static long delalloc_flushes = 0;
+static long delalloc_placed = 0;
+static long delalloc_extents = 0;
+static long delalloc_dropped = 0;
+static long delalloc_holes = 0;
+static long delalloc_packed = 0;
+static long delalloc_deduped = 0;
+static long delalloc_tailed = 0;
+static long delalloc_spilled = 0;
+
+static int
+delalloc_bucket(int inum, int fpn)
+{
+	return (unsigned)(inum * 31 + fpn) % DELALLOC_BUCKETS;
+}
+
+static void
+delalloc_insert(dpage* dp)
+{
+	int bb = delalloc_bucket(dp->inum, dp->fpn);
+	dp->hnext = delalloc_table[bb];
+	delalloc_table[bb] = dp;
+	delalloc_count += 1;
+	delalloc_holds += dp->held;
+}
+
+static void
+dpage_free(dpage* dp)
+{
+	free(dp->buf);
+	free(dp);
+}
+
+void
+delalloc_init()
+{
+	delalloc_table = calloc(DELALLOC_BUCKETS, sizeof(dpage*));
+}
+
+void
+delalloc_free()
+{
+	printf("=====DELALLOC STATS======\n");
+	printf("flushes : %ld\n", delalloc_flushes);
+	printf("placed  : %ld pages in %ld extents\n", delalloc_placed, delalloc_extents);
+	printf("dropped : %ld\n", delalloc_dropped);
+	printf("holes   : %ld\n", delalloc_holes);
+	printf("packed  : %ld\n", delalloc_packed);
+	printf("deduped : %ld\n", delalloc_deduped);
+	printf("tails   : %ld\n", delalloc_tailed);
+	printf("spilled : %ld\n", delalloc_spilled);
+	printf("pending : %d, %d held\n", delalloc_count, delalloc_holds);
+	printf("\n");
+
+	delalloc_drop(-1, 0);
+
+	free(delalloc_table);
+	delalloc_table = NULL;
+}
+
+int
+delalloc_enabled()
+{
+	return mount_opts.delalloc > 0;
+}
+
+static int
+delalloc_headroom(int count)
+{
+	int per = PAGE_SIZE / sizeof(int);
+	return DELALLOC_META_PAGES + 3 * ((count + per - 1) / per);
+}
+
+int
+delalloc_reserve(int count)
+{
+	// every buffered page is owed a free page at flush time, and the
+	// metadata around it some room; alloc_page won't take the pages
+	// themselves for anything else
+	int want = delalloc_count + count;
+	while (pages_free_count() - want - delalloc_headroom(want) < 0) {
+		if (pages_grow() == -1)
+			return -ENOSPC;
+	}
+
+	return 0;
+}
+
+static dpage*
+delalloc_find(int inum, int fpn)
+{
+	dpage* dp = delalloc_table[delalloc_bucket(inum, fpn)];
+	while (dp && (dp->inum != inum || dp->fpn != fpn))
+		dp = dp->hnext;
+
+	return dp;
+}
+
+void*
+delalloc_peek(int inum, int fpn)
+{
+	// delalloc_get for a read; NULL if the page isn't buffered
+	dpage* dp = delalloc_find(inum, fpn);
+	return dp ? dp->buf : NULL;
+}
+
+void*
+delalloc_get(int inum, int fpn)
+{
+	dpage* dp = delalloc_find(inum, fpn);
+	if (dp)
+		return dp->buf;
+
+	// a new page of the file, or one that was lost in a crash; both are zeros
+	dp = malloc(sizeof(dpage));
+	dp->inum = inum;
+	dp->fpn = fpn;
+	dp->held = 0;
+	dp->buf = calloc(1, PAGE_SIZE);
+	delalloc_insert(dp);
+
+	return dp->buf;
+}
+
+static int
+delalloc_take(int inum, int from, dpage*** out)
+{
+	// unlinks the matching pages (every page if inum is -1)
+	int count = 0;
+	*out = malloc((delalloc_count + 1) * sizeof(dpage*));
+
+	for (int bb = 0; bb < DELALLOC_BUCKETS; ++bb) {
+		dpage** pp = &delalloc_table[bb];
+		while (*pp) {
+			dpage* dp = *pp;
+			if ((inum == -1 || dp->inum == inum) && dp->fpn >= from) {
+				*pp = dp->hnext;
+				(*out)[count++] = dp;
+				delalloc_count -= 1;
+				delalloc_holds -= dp->held;
+				dp->held = 0;
+			}
+			else {
+				pp = &dp->hnext;
+			}
+		}
+	}
+
+	return count;
+}
+
+void
+delalloc_drop(int inum, int from)
+{
+	// the file was truncated or freed; the pages never need a home
+	dpage** dps;
+	int count = delalloc_take(inum, from, &dps);
+
+	for (int ii = 0; ii < count; ++ii)
+		dpage_free(dps[ii]);
+
+	delalloc_dropped += count;
+	free(dps);
+}
+
+int
+delalloc_pending()
+{
+	return delalloc_count;
+}
+
+int
+delalloc_held()
+{
+	return delalloc_holds;
+}
+
+static int
+dpage_cmp(const void* aa, const void* bb)
+{
+	dpage* xx = *(dpage**)aa;
+	dpage* yy = *(dpage**)bb;
+
+	if (xx->inum != yy->inum)
+		return xx->inum - yy->inum;
+
+	return xx->fpn - yy->fpn;
+}
+
+static int
+delalloc_pack(inode* node, int inum, dpage** dps, int count)
+{
+	// each cluster the pages touch is compressed if it can be; returns
+	// how many pages are left to place as they are
+	int kept = 0;
+	int ii = 0;
+	while (ii < count) {
+		int cluster = dps[ii]->fpn / COMPRESS_CLUSTER;
+		int run = 1;
+		while (ii + run < count && dps[ii + run]->fpn / COMPRESS_CLUSTER == cluster)
+			run += 1;
+
+		void* bufs[COMPRESS_CLUSTER] = { NULL };
+		for (int jj = 0; jj < run; ++jj)
+			bufs[dps[ii + jj]->fpn % COMPRESS_CLUSTER] = dps[ii + jj]->buf;
+
+		if (compress_cluster(node, inum, cluster, bufs) == 0) {
+			for (int jj = 0; jj < run; ++jj)
+				dpage_free(dps[ii + jj]);
+
+			delalloc_packed += run;
+		}
+		else {
+			for (int jj = 0; jj < run; ++jj)
+				dps[kept++] = dps[ii + jj];
+		}
+
+		ii += run;
+	}
+
+	return kept;
+}
+
+static int
+delalloc_place_pages(int inum, dpage** dps, int count)
+{
+	inode* node = get_inode(inum);
+
+	int live = 0;
+	for (int ii = 0; ii < count; ++ii) {
+		if (node->mode == 0 || inode_get_pnum(node, dps[ii]->fpn) != DELALLOC_PNUM) {
+			dpage_free(dps[ii]);
+			delalloc_dropped += 1;
+			continue;
+		}
+
+		// still all zeros; it never needs a page
+		if (page_is_zero(dps[ii]->buf)) {
+			inode_set_pnum(node, dps[ii]->fpn, -1);
+			dpage_free(dps[ii]);
+			delalloc_holes += 1;
+			continue;
+		}
+
+		dps[live++] = dps[ii];
+	}
+
+	if (compress_wanted(node))
+		live = delalloc_pack(node, inum, dps, live);
+
+	// a small file's one page shares a fragment page with others
+	if (live == 1 && tail_wanted(node) && tail_pack(node, inum, dps[0]->buf) == 0) {
+		dpage_free(dps[0]);
+		delalloc_tailed += 1;
+		return 0;
+	}
+
+	// directories change their pages in place, so only file data is
+	// shared
+	int dedup = dedup_enabled() && S_ISREG(node->mode);
+
+	// in file order, as few extents as free space allows; a duplicate
+	// takes a reference instead, and leaves its page of the extent unused
+	int done = 0;
+	while (done < live) {
+		int got = 0;
+		int first = pages_alloc_extent(live - done, &got);
+		if (first == -1) {
+			printf("delalloc_place(%d): out of pages\n", inum);
+			for (int ii = done; ii < live; ++ii)
+				delalloc_insert(dps[ii]);
+
+			return -ENOSPC;
+		}
+
+		int used = 0;
+		while (used < got && done < live) {
+			dpage* dp = dps[done++];
+
+			unsigned hash = 0;
+			int pnum = dedup ? dedup_find(dp->buf, &hash) : -1;
+
+			if (pnum == -1) {
+				pnum = first + used;
+				used += 1;
+
+				copy_page(pages_get_data(pnum), dp->buf);
+				pages_mark_data(pnum);
+				pages_put_page(pnum);
+
+				if (dedup)
+					dedup_insert(pnum, hash);
+			}
+			else {
+				delalloc_deduped += 1;
+			}
+
+			inode_set_pnum(node, dp->fpn, pnum);
+			dpage_free(dp);
+		}
+
+		for (int ii = used; ii < got; ++ii)
+			free_page(first + ii);
+
+		if (used > 0) {
+			delalloc_placed += used;
+			delalloc_extents += 1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+delalloc_place(int inum, dpage** dps, int count)
+{
+	// near the file's other pages, or in its directory's group
+	pages_set_goal(inode_goal(inum));
+	int rv = delalloc_place_pages(inum, dps, count);
+	pages_set_goal(-1);
+	return rv;
+}
+
+static int
+delalloc_flush_pages(int inum)
+{
+	if (delalloc_count == 0)
+		return 0;
+
+	dpage** dps;
+	int count = delalloc_take(inum, 0, &dps);
+
+	// grouped by file, each in page order
+	qsort(dps, count, sizeof(dpage*), dpage_cmp);
+
+	int rv = 0;
+	int ii = 0;
+	while (ii < count) {
+		int run = 1;
+		while (ii + run < count && dps[ii + run]->inum == dps[ii]->inum)
+			run += 1;
+
+		int err = delalloc_place(dps[ii]->inum, dps + ii, run);
+		if (err < 0)
+			rv = err;
+
+		ii += run;
+	}
+
+	delalloc_flushes += 1;
+	free(dps);
+	return rv;
+}
+
+int
+delalloc_flush_inode(int inum)
+{
+	return delalloc_flush_pages(inum);
+}
+
+int
+delalloc_flush_cold()
+{
+	// delalloc_flush, but hot files keep their pages while the hot tier
+	// has room for them; past that the coldest of them spill first
+	if (delalloc_count == 0)
+		return 0;
+
+	if (!hot_enabled())
+		return delalloc_flush();
+
+	dpage** dps;
+	int count = delalloc_take(-1, 0, &dps);
+	qsort(dps, count, sizeof(dpage*), dpage_cmp);
+
+	// where each hot file's pages start, and how many there are
+	int* runs = malloc((count + 1) * sizeof(int));
+	int* lens = malloc((count + 1) * sizeof(int));
+	int nruns = 0;
+	int held = 0;
+
+	int rv = 0;
+	int ii = 0;
+	while (ii < count) {
+		int run = 1;
+		while (ii + run < count && dps[ii + run]->inum == dps[ii]->inum)
+			run += 1;
+
+		inode* node = peek_inode(dps[ii]->inum);
+		if (node->refs > 0 && hot_wanted(node, dps[ii]->inum)) {
+			runs[nruns] = ii;
+			lens[nruns++] = run;
+			held += run;
+		}
+		else {
+			int err = delalloc_place(dps[ii]->inum, dps + ii, run);
+			if (err < 0)
+				rv = err;
+		}
+
+		ii += run;
+	}
+
+	while (held > mount_opts.hot) {
+		int coldest = -1;
+		for (int rr = 0; rr < nruns; ++rr) {
+			if (lens[rr] > 0 && (coldest == -1 ||
+			    hot_heat(dps[runs[rr]]->inum) < hot_heat(dps[runs[coldest]]->inum)))
+				coldest = rr;
+		}
+
+		int err = delalloc_place(dps[runs[coldest]]->inum, dps + runs[coldest], lens[coldest]);
+		if (err < 0)
+			rv = err;
+
+		held -= lens[coldest];
+		delalloc_spilled += lens[coldest];
+		lens[coldest] = 0;
+	}
+
+	for (int rr = 0; rr < nruns; ++rr) {
+		for (int jj = runs[rr]; jj < runs[rr] + lens[rr]; ++jj) {
+			dps[jj]->held = 1;
+			delalloc_insert(dps[jj]);
+		}
+	}
+
+	delalloc_flushes += 1;
+	free(runs);
+	free(lens);
+	free(dps);
+	return rv;
+}
+
+int
+delalloc_flush()
+{
+	return delalloc_flush_pages(-1);
+}
@@ -0,0 +1,33 @@
+#ifndef DELALLOC_H
+#define DELALLOC_H
+
+// block pointer of a file page that has data but no page in the image yet
+#define DELALLOC_PNUM -2
+
+// Delayed allocation. storage_write keeps new file pages in memory, by
+// inode and file page number, and they only get pages in the image when
+// they're flushed; by then a file's whole dirty range is known and can
+// go into one contiguous extent, however its writes were interleaved
+// with other files'.
+typedef struct dpage {
+	int   inum;
+	int   fpn;  // page of the file
+	int   held; // kept back from a flush for the hot tier
+	void* buf;
+	struct dpage* hnext;
+} dpage;
+
+void  delalloc_init();
+void  delalloc_free();
+int   delalloc_enabled();
+int   delalloc_reserve(int count);
+void* delalloc_peek(int inum, int fpn);
+void* delalloc_get(int inum, int fpn);
+void  delalloc_drop(int inum, int from);
+int   delalloc_pending();
+int   delalloc_held();
+int   delalloc_flush_inode(int inum);
+int   delalloc_flush_cold();
+int   delalloc_flush();
+
+#endif
@@ -116,20 +116,18 @@ tree_lookup(const char* path)
 		p_tok = p_tok->next;
 	}
 
-	s_free(p_tok);
-
 	printf("tree_lookup: inum %d\n", inum);
 	return inum;
 }
 
 int
-directory_put(const char* dir_path, const char* name, int inum)
+directory_put(int p_inum, const char* name, int inum)
 {
-	int p_inum = tree_lookup(dir_path);
-	if (p_inum == -ENOENT) {
-		printf("directory_put: Directory not found\n");
-		return -ENOENT;
+	if (strlen(name) >= sizeof(((dirent*)0)->name)) {
+		printf("directory_put: Name too long\n");
+		return -ENAMETOOLONG;
 	}
+
 	inode* node = get_inode(p_inum);
 	node->acc = (long)time(NULL);
 	node->mod = (long)time(NULL);
@@ -138,29 +136,37 @@ directory_put(const char* dir_path, const char* name, int inum)
 	int ents_d = PAGE_SIZE / sizeof(dirent);
 	dirent* ent = NULL;
 
-	grow_inode(node, node->size + sizeof(dirent));
+	// near the directory's other pages, or where it was put to go
+	pages_set_goal(inode_goal(p_inum));
+	int rv = grow_inode(node, node->size + sizeof(dirent));
+	pages_set_goal(-1);
+	if (rv < 0)
+		return rv;
 
-	if (num_entries < ents_d - 1) {
-		ent = (dirent*)pages_get_page(node->ptrs[0]);
+	int pnum = -1;
+
+	if (num_entries < ents_d) {
+		pnum = node->ptrs[0];
+		ent = (dirent*)pages_get_page(pnum);
 		ent += num_entries;
 	}
-	else if (num_entries < 2 * ents_d - 1) {
-		ent = (dirent*)pages_get_page(node->ptrs[1]);
+	else if (num_entries < 2 * ents_d) {
+		pnum = node->ptrs[1];
+		ent = (dirent*)pages_get_page(pnum);
 		ent += num_entries - ents_d;
 	}
 	else {
 		int* ipgs = (int*)pages_get_page(node->iptr);
-		int ents_d = PAGE_SIZE / sizeof(dirent);
-		int ipg = 0;
-		while (num_entries < (ipg + 2) * ents_d - 1)
-			ipg += 1;
+		int ipg = num_entries / ents_d - 2;
 
-		ent = (dirent*)pages_get_page(ipg);
+		pnum = ipgs[ipg];
+		ent = (dirent*)pages_get_page(pnum);
 		ent += num_entries - (ipg + 2) * ents_d;
 	}
 
 	strlcpy(ent->name, name, strlen(name) + 1);
 	ent->inum = inum;
+	pages_mark_dirty(pnum);
 
     return 0;
 }
@@ -171,7 +177,7 @@ shift_back(int num_entries, dirent* ent, int ent_idx, int ptrs[2], int iptr)
 	// ent_idx is zero-indexed
 	int ents_b = PAGE_SIZE / sizeof(dirent);
 	int ent_blk = ent_idx / ents_b;
-	int num_blks = num_entries / ents_b;
+	int num_blks = (num_entries - 1) / ents_b; // index of the last block
 
 	dirent* tmp_ent1 = alloca(sizeof(dirent));
 	dirent* tmp_ent2 = alloca(sizeof(dirent));
@@ -180,73 +186,86 @@ shift_back(int num_entries, dirent* ent, int ent_idx, int ptrs[2], int iptr)
 
 	do {
 		int* ipgs = NULL;
+		int pnum = -1;
 		void* dir_end = NULL;
 		void* dir_start = NULL;
 		size_t size = -1;
 
 		if (blk == num_blks) {
 			if (blk == 0 || blk == 1) {
-				dir_start = pages_get_page(ptrs[blk]);
-				dir_end = dir_start + (num_entries - (num_blks - 1) * ents_b) * sizeof(dirent);
+				pnum = ptrs[blk];
+				dir_start = pages_get_page(pnum);
+				dir_end = dir_start + (num_entries - num_blks * ents_b) * sizeof(dirent);
 			}
 			else {
 				ipgs = pages_get_page(iptr);
-				dir_start = pages_get_page(ipgs[blk - 2]);
-				dir_end = dir_start + (num_entries - (num_blks - 1) * ents_b) * sizeof(dirent);
+				pnum = ipgs[blk - 2];
+				dir_start = pages_get_page(pnum);
+				dir_end = dir_start + (num_entries - num_blks * ents_b) * sizeof(dirent);
 			}
 
 			if (dir_start == (void*)(-1))
 				return -1;
 
+			pages_mark_dirty(pnum);
+
 			if (blk == ent_blk) {
 				size = (intptr_t)dir_end - (intptr_t)(ent + 1);
-				memcpy((void*)ent, (void*)(ent + 1), size);
+				memmove((void*)ent, (void*)(ent + 1), size);
 				memset(dir_end - sizeof(dirent), 0, sizeof(dirent));
 				break;
 			}
 			else {
 				size = (intptr_t)dir_end - (intptr_t)dir_start - sizeof(dirent);
 				memcpy((void*)tmp_ent2, dir_start, sizeof(dirent));
-				memcpy(dir_start, dir_start + sizeof(dirent), size);
+				memmove(dir_start, dir_start + sizeof(dirent), size);
 				memset(dir_end - sizeof(dirent), 0, sizeof(dirent));
+				blk -= 1;
 				continue;
 			}
 		}
 
 		if (blk == ent_blk) {
 			if (blk == 0 || blk == 1) {
-				dir_end = pages_get_page(ptrs[blk]) + PAGE_SIZE;
+				pnum = ptrs[blk];
 			}
 			else {
 				ipgs = pages_get_page(iptr);
-				dir_end = pages_get_page(ipgs[blk - 2]) + PAGE_SIZE;
+				pnum = ipgs[blk - 2];
 			}
 
+			dir_end = pages_get_page(pnum) + PAGE_SIZE;
+			pages_mark_dirty(pnum);
+
 			size = (intptr_t)dir_end - (intptr_t)(ent + 1);
-			memcpy((void*)ent, (void*)(ent + 1), size);
+			memmove((void*)ent, (void*)(ent + 1), size);
 			memcpy(dir_end - sizeof(dirent), tmp_ent2, sizeof(dirent));
 
 			break;
 		}
 
 		if (blk == 0 || blk == 1) {
-			dir_start = pages_get_page(ptrs[blk]);
+			pnum = ptrs[blk];
+			dir_start = pages_get_page(pnum);
 			dir_end = dir_start + PAGE_SIZE;
 		}
 		else {
 			ipgs = pages_get_page(iptr);
-			dir_start = pages_get_page(ipgs[blk - 2]);
+			pnum = ipgs[blk - 2];
+			dir_start = pages_get_page(pnum);
 			dir_end = dir_start + PAGE_SIZE;
 		}
 
 		if (dir_start == (void*)(-1))
 			return -1;
 
+		pages_mark_dirty(pnum);
+
 		memcpy(tmp_ent1, tmp_ent2, sizeof(dirent));
 		memcpy(tmp_ent2, dir_start, sizeof(dirent));
 
 		size = (intptr_t)dir_end - (intptr_t)dir_start - sizeof(dirent);
-		memcpy(dir_start, dir_start + sizeof(dirent), size);
+		memmove(dir_start, dir_start + sizeof(dirent), size);
 		memcpy(dir_end - sizeof(dirent), tmp_ent1, sizeof(dirent));
 
 		blk -= 1;
@@ -256,40 +275,11 @@ shift_back(int num_entries, dirent* ent, int ent_idx, int ptrs[2], int iptr)
 }
 
 int
-directory_delete(const char* path)
+directory_delete(int p_inum, const char* name)
 {
-    printf(" + directory_delete(%s)\n", path);
-
-	// if trying to delete the root
-	if (streq(path, "/")) {
-		printf("directory_delete: Cannot delete root\n");
-		return -EINVAL;
-	}
-
-	int inum = tree_lookup(path);
-	inode* node = get_inode(inum);
-	node->acc = (long)time(NULL);
-	node->mod = (long)time(NULL);
-
-	if (S_ISDIR(node->mode) && node->size > 0) {
-		printf("directory_delete: Cannot delete a nonempty directory\n");
-		return -EINVAL;
-	}
-
-	// Get parent directory path, and deletee's name
-	char* dir_path = alloca(strlen(path) + 1);
-	strlcpy(dir_path, path, strlen(path) + 1);
-
-	char* name = dir_path + strlen(path) + 1;
-
-	while (name[0] != '/')
-		name--;
-	
-	name[0] = '\0';
-	name++;
+    printf(" + directory_delete(%d, %s)\n", p_inum, name);
 
 	// get Parent directory inode
-	int p_inum = tree_lookup(dir_path);
 	inode* p_dir = get_inode(p_inum);
 	p_dir->acc = (long)time(NULL);
 	p_dir->mod = (long)time(NULL);
@@ -17,8 +17,8 @@ void directory_init();
 dirent* directory_get(inode* dd, const char* name);
 int directory_lookup(inode* dd, const char* name);
 int tree_lookup(const char* path);
-int directory_put(const char* dir_path, const char* name, int inum);
-int directory_delete(const char* name);
+int directory_put(int p_inum, const char* name, int inum);
+int directory_delete(int p_inum, const char* name);
 slist* directory_list(inode* dd);
 void print_directory(inode* dd);
 
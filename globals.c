@@ -1,16 +1,20 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>
 
 #include "globals.h"
 #include "inode.h"
+#include "util.h"
 
 // Page
-const int PAGE_COUNT = 256;
+int PAGE_COUNT = 256; // grows with the image
 const int PAGE_SIZE = 4096;
-const int NUFS_SIZE = 256 * 4096; // 1MB
+const int NUFS_SIZE = 256 * 4096; // 1MB, initial image size
+const int BITMAP_SIZE = 256; // bytes of page bitmap in page 0
 int   pages_fd = -1;
 void* pages_base = NULL;
+backend* pages_backend = NULL;
 
 // Inode
 int INODE_COUNT = 0;
@@ -27,11 +31,45 @@ const int default_symlink_mode = S_IFLNK | S_IRWXU | S_IRGRP |
 // Mounting
 int num_mounts = 0;
 
+// Mount Options
+nufs_opts mount_opts = {
+	.image     = NULL,
+	.prefault  = 0,
+	.access    = "normal",
+	.backend   = "mmap",
+	.cache     = 128,
+	.grow      = "double",
+	.max_pages = 262144, // 1GB
+	.window    = 512,    // 2MB
+	.windows   = 64,
+	.journal   = 64,
+	.journal_batch = 16,
+	.durability = "batched",
+	.commit_ms  = 5000,
+	.writeback_ms = 500,
+	.dirty_ratio  = 20,
+	.dirty_expire = 3000,
+	.delalloc     = 1024,   // 4MB
+	.write_buffer = 16,     // 64KB
+	.readahead    = 128,    // 512KB
+	.checksum     = "meta",
+	.scrub        = 256,    // 1MB/s
+	.compress     = "flagged",
+	.dedup        = 0,
+	.snapshot     = 0,
+	.tail         = 2048,
+	.group        = 256,    // 1MB
+	.defrag       = 256,    // 1MB/s
+	.hot          = 0,
+	.ttl          = 60,
+};
+
 void
 globals_reset()
 {
 	pages_fd = -1;
 	pages_base = NULL;
+	pages_backend = NULL;
 
 	INODE_COUNT = 0;
 	inode_base = NULL;
@@ -48,6 +86,7 @@ globals_print()
 	printf("NUFS_SIZE : %d\n", NUFS_SIZE);
 	printf("pages_fd  : %d\n", pages_fd);
 	printf("pages_base: %p\n", pages_base);
+	printf("backend   : %s\n", pages_backend ? pages_backend->name : "(none)");
 	printf("\n");
 
 	printf("========INODE VARS=======\n");
@@ -57,6 +96,30 @@ globals_print()
 
 	printf("========MOUNT VARS=======\n");
 	printf("num_mounts: %d\n", num_mounts);
+	printf("image     : %s\n", mount_opts.image);
+	printf("prefault  : %d\n", mount_opts.prefault);
+	printf("access    : %s\n", mount_opts.access);
+	printf("backend   : %s\n", mount_opts.backend);
+	printf("cache     : %d\n", mount_opts.cache);
+	printf("grow      : %s\n", mount_opts.grow);
+	printf("max_pages : %d\n", mount_opts.max_pages);
+	printf("window    : %d x %d\n", mount_opts.windows, mount_opts.window);
+	printf("journal   : %d pages, %d ops a commit\n", mount_opts.journal, mount_opts.journal_batch);
+	printf("durability: %s, %d ms\n", mount_opts.durability, mount_opts.commit_ms);
+	printf("writeback : every %d ms, past %d%% or %d ms\n", mount_opts.writeback_ms,
+	       mount_opts.dirty_ratio, mount_opts.dirty_expire);
+	printf("delalloc  : %d pages\n", mount_opts.delalloc);
+	printf("write buf : %d pages\n", mount_opts.write_buffer);
+	printf("readahead : %d pages\n", mount_opts.readahead);
+	printf("checksum  : %s, scrub %d pages/s\n", mount_opts.checksum, mount_opts.scrub);
+	printf("compress  : %s\n", mount_opts.compress);
+	printf("dedup     : %d pages\n", mount_opts.dedup);
+	printf("snapshot  : %d\n", mount_opts.snapshot);
+	printf("tail      : %d\n", mount_opts.tail);
+	printf("group     : %d\n", mount_opts.group);
+	printf("defrag    : %d pages/s\n", mount_opts.defrag);
+	printf("hot       : %d\n", mount_opts.hot);
+	printf("ttl       : %d s\n", mount_opts.ttl);
 	printf("\n");
 }
 
@@ -64,7 +127,7 @@ int
 globals_init_check()
 {
 	// return 1 if init, else -1
-	char page_check = pages_fd == -1 || !pages_base;
+	char page_check = pages_fd == -1 || !pages_backend;
 	char inod_check = INODE_COUNT == 0 || !inode_base;
 
 	if (page_check || inod_check) {
@@ -79,7 +142,7 @@ globals_init_check()
 int
 globals_pinit_check()
 {
-	char page_check = pages_fd == -1 || !pages_base;
+	char page_check = pages_fd == -1 || !pages_backend;
 
 	if (page_check) {
 		printf("globals_pinit_check: some page var(s) not set\n\n");
@@ -89,6 +152,7 @@ globals_pinit_check()
 		printf("NUFS_SIZE : %d\n", NUFS_SIZE);
 		printf("pages_fd  : %d\n", pages_fd);
 		printf("pages_base: %p\n", pages_base);
+	printf("backend   : %s\n", pages_backend ? pages_backend->name : "(none)");
 		printf("\n");
 
 		return -1;
@@ -115,3 +179,44 @@ globals_iinit_check()
 	return 1;
 }
 
+
+int
+globals_opts_check()
+{
+	// return 1 if the mount options make sense, else -1
+	char* end = NULL;
+	long grow = strtol(mount_opts.grow, &end, 10);
+	if (!streq(mount_opts.grow, "off") && !streq(mount_opts.grow, "double") &&
+	    (end == mount_opts.grow || *end || grow <= 0)) {
+		printf("globals_opts_check: grow=%s, want off, double or a page count\n", mount_opts.grow);
+		return -1;
+	}
+
+	int counts[] = {
+		mount_opts.journal, mount_opts.journal_batch, mount_opts.commit_ms,
+		mount_opts.writeback_ms, mount_opts.dirty_expire, mount_opts.delalloc,
+		mount_opts.write_buffer, mount_opts.readahead, mount_opts.scrub,
+		mount_opts.dedup, mount_opts.tail, mount_opts.group,
+		mount_opts.defrag, mount_opts.hot, mount_opts.ttl
+	};
+
+	for (int ii = 0; ii < sizeof(counts) / sizeof(int); ++ii) {
+		if (counts[ii] < 0) {
+			printf("globals_opts_check: a count option is negative (%d)\n", counts[ii]);
+			return -1;
+		}
+	}
+
+	if (mount_opts.cache < 1 || mount_opts.max_pages < 1 || mount_opts.window < 1 ||
+	    mount_opts.windows < 1) {
+		printf("globals_opts_check: cache, max_pages, window and windows must be positive\n");
+		return -1;
+	}
+
+	if (mount_opts.dirty_ratio < 0 || mount_opts.dirty_ratio > 100) {
+		printf("globals_opts_check: dirty_ratio=%d, want a percent\n", mount_opts.dirty_ratio);
+		return -1;
+	}
+
+	return 1;
+}
@@ -5,13 +5,16 @@
 #include <time.h>
 
 #include "inode.h"
+#include "backend.h"
 
 // Page
-extern const int PAGE_COUNT;
+extern int PAGE_COUNT;
 extern const int PAGE_SIZE;
 extern const int NUFS_SIZE;
+extern const int BITMAP_SIZE;
 extern int   pages_fd;
 extern void* pages_base;
+extern backend* pages_backend;
 
 // Inode
 extern int INODE_COUNT;
@@ -25,11 +28,47 @@ extern const int default_symlink_mode;
 // Mounting
 extern int num_mounts;
 
+// Mount Options (-o ...)
+typedef struct nufs_opts {
+	char* image;     // path to data.nufs
+	int   prefault;  // prefault and mlock metadata pages
+	char* access;    // data access hint: normal, seq, random, huge (tmpfs only)
+	char* backend;   // block backend: mmap, pread, direct, uring, window
+	int   cache;     // page cache slots for unmapped backends
+	char* grow;      // growth policy: off, double or a page count
+	int   max_pages; // the image never grows past this
+	int   window;    // pages per mapping for the window backend
+	int   windows;   // windows the window backend keeps mapped
+	int   journal;   // metadata journal pages, 0 for none
+	int   journal_batch; // ops grouped into one journal commit
+	char* durability; // strict, batched or unsafe
+	int   commit_ms; // batched: sync at least this often
+	int   writeback_ms; // flusher interval, 0 leaves writeback to each op
+	int   dirty_ratio;  // flusher starts past this percent of pages dirty
+	int   dirty_expire; // or once the oldest dirty page is this many ms old
+	int   delalloc;  // new file pages held before allocation, 0 for none
+	int   write_buffer; // pages of small writes buffered per open file
+	int   readahead; // largest readahead window in pages, 0 for none
+	char* checksum;  // pages checked on read: off, meta or all
+	int   scrub;     // pages a second the scrubber checks, 0 for none
+	char* compress;  // file data compressed: off, flagged (chattr +c) or all
+	int   dedup;     // pages the dedup index holds, 0 for none
+	int   snapshot;  // mount the image's snapshot, read only
+	int   tail;      // files up to this many bytes share pages, 0 for none
+	int   group;     // pages in an allocation group, 0 allocates lowest first
+	int   defrag;    // pages a second the defragmenter moves, 0 for none
+	int   hot;       // delayed pages hot files keep in memory, 0 for none
+	int   ttl;       // seconds the kernel caches attributes, names and data, 0 for none
+} nufs_opts;
+
+extern nufs_opts mount_opts;
+
 // Utility Functions
 void globals_reset();
 void globals_print();
 int globals_init_check();
 int globals_pinit_check();
 int globals_iinit_check();
+int globals_opts_check();
 
 #endif
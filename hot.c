@@ -0,0 +1,151 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "hot.h"
+#include "delalloc.h"
+#include "util.h"
+
+#include "globals.h"
+
+extern nufs_opts mount_opts;
+
+// by inum
+static int*  hot_heats = NULL;
+static long* hot_whens = NULL;  // now_ms() the heat was last brought up to date
+static char* hot_states = NULL; // whether it was hot when last asked
+static int   hot_count = 0;
+
+static long hot_promotions = 0;
+static long hot_demotions = 0;
+
+static void
+hot_slot(int inum)
+{
+	if (inum < hot_count)
+		return;
+
+	int count = max(inum + 1, max(2 * hot_count, 64));
+	hot_heats = realloc(hot_heats, count * sizeof(int));
+	hot_whens = realloc(hot_whens, count * sizeof(long));
+	hot_states = realloc(hot_states, count);
+	for (int ii = hot_count; ii < count; ++ii) {
+		hot_heats[ii] = 0;
+		hot_whens[ii] = 0;
+		hot_states[ii] = 0;
+	}
+
+	hot_count = count;
+}
+
+void
+hot_init()
+{
+	// everything starts cold at mount
+	hot_count = 0;
+}
+
+void
+hot_free()
+{
+	printf("=======HOT STATS=========\n");
+	printf("promoted: %ld\n", hot_promotions);
+	printf("demoted : %ld\n", hot_demotions);
+	printf("\n");
+
+	free(hot_heats);
+	free(hot_whens);
+	free(hot_states);
+	hot_heats = NULL;
+	hot_whens = NULL;
+	hot_states = NULL;
+	hot_count = 0;
+}
+
+int
+hot_enabled()
+{
+	// the tier is delayed pages that aren't placed yet
+	return mount_opts.hot > 0 && delalloc_enabled();
+}
+
+int
+hot_heat(int inum)
+{
+	if (inum < 0 || inum >= hot_count)
+		return 0;
+
+	// halved for every half life since it was last looked at
+	long now = now_ms();
+	long halves = (now - hot_whens[inum]) / HOT_HALF_LIFE;
+	if (halves > 0) {
+		hot_heats[inum] = halves >= 31 ? 0 : hot_heats[inum] >> halves;
+		hot_whens[inum] = halves >= 31 ? now : hot_whens[inum] + halves * HOT_HALF_LIFE;
+	}
+
+	return hot_heats[inum];
+}
+
+void
+hot_touch(int inum)
+{
+	if (!hot_enabled() || inum < 0)
+		return;
+
+	hot_slot(inum);
+	int heat = hot_heat(inum);
+	if (heat == 0)
+		hot_whens[inum] = now_ms();
+
+	if (heat < 4 * HOT_THRESHOLD)
+		hot_heats[inum] = heat + 1;
+}
+
+void
+hot_inherit(int p_inum, int inum)
+{
+	// a new file in a directory that's busy making them is likely another
+	// short-lived one
+	if (!hot_enabled() || inum < 0)
+		return;
+
+	hot_slot(inum);
+	int heat = hot_heat(p_inum);
+	hot_heats[inum] = heat >= HOT_THRESHOLD ? heat : 0;
+	hot_whens[inum] = now_ms();
+	hot_states[inum] = 0;
+}
+
+int
+hot_wanted(inode* node, int inum)
+{
+	if (!hot_enabled() || !S_ISREG(node->mode) || (node->flags & INODE_COLD))
+		return 0;
+
+	int hot = (node->flags & INODE_HOT) || hot_heat(inum) >= HOT_THRESHOLD;
+
+	hot_slot(inum);
+	if (hot != hot_states[inum]) {
+		printf("+ hot_wanted(%d) -> %s\n", inum, hot ? "promoted" : "demoted");
+		if (hot)
+			hot_promotions += 1;
+		else
+			hot_demotions += 1;
+
+		hot_states[inum] = hot;
+	}
+
+	return hot;
+}
+
+void
+hot_forget(int inum)
+{
+	if (inum < 0 || inum >= hot_count)
+		return;
+
+	hot_heats[inum] = 0;
+	hot_whens[inum] = 0;
+	hot_states[inum] = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef HOT_H
+#define HOT_H
+
+#include <sys/ioctl.h>
+
+#include "inode.h"
+
+#define INODE_HOT  0x02 // always in the hot tier; new files in a directory inherit it
+#define INODE_COLD 0x04 // never in it
+
+// ioctls on any file in the mount; the value is one of HOT_
+#define NUFS_IOC_GET_TIER _IOR('N', 4, int)
+#define NUFS_IOC_SET_TIER _IOW('N', 5, int)
+
+#define HOT_AUTO   0 // heat decides
+#define HOT_ALWAYS 1 // INODE_HOT
+#define HOT_NEVER  2 // INODE_COLD
+
+#define HOT_THRESHOLD 16    // heat a file is promoted at
+#define HOT_HALF_LIFE 10000 // ms for heat to halve
+
+// The hot tier. A hot file's delayed pages aren't placed when the
+// flusher or an op writes back; they stay in memory until the file is
+// fsynced, the image is unmounted or snapshotted, or there are more than
+// -o hot pages of them, and a write to one of its pages that's already
+// in the image brings that page back into memory. A temporary that's
+// deleted before then never touches the image. A file is hot if it's
+// flagged so, or while its heat is over HOT_THRESHOLD: every write adds
+// one, every file made in a directory adds one to the directory, and it
+// halves every HOT_HALF_LIFE. A new file in a hot directory starts out
+// hot. Heat is kept in memory only.
+void hot_init();
+void hot_free();
+int  hot_enabled();
+void hot_touch(int inum);
+void hot_inherit(int p_inum, int inum);
+int  hot_heat(int inum);
+int  hot_wanted(inode* node, int inum);
+void hot_forget(int inum);
+
+#endif
@@ -1,17 +1,23 @@
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
 
 #include "pages.h"
 #include "inode.h"
+#include "delalloc.h"
+#include "compress.h"
+#include "tail.h"
+#include "hot.h"
 #include "util.h"
 
 #include "globals.h"
 
-extern const int PAGE_COUNT;
+extern int PAGE_COUNT;
 extern const int PAGE_SIZE;
+extern const int BITMAP_SIZE;
 extern void* pages_base;
 
 extern int INODE_COUNT;
@@ -20,6 +26,19 @@ extern inode* inode_base;
 
 extern const int default_file_mode;
 
+// inodes that fit in page 0; the rest live in extension pages
+static int inode_base_count = 0;
+
+// by inum, where an inode's pages go until it has one to go next to
+static int* inode_goals = NULL;
+static int  inode_ngoals = 0;
+
+// by inum, bumped each time one is freed, so the kernel can tell a reused
+// inode number from the file it used to be; in memory only, as a mount
+// starts with the kernel knowing none of them
+static unsigned int* inode_gens = NULL;
+static int           inode_ngens = 0;
+
 void
 print_inode(inode* node)
 {
@@ -34,6 +53,49 @@ print_inode(inode* node)
         printf("node{null}\n");
 }
 
+static inode* inode_at(int inum, int* pnum);
+
+// Before the superblock, page 0's inode table ran from BITMAP_SIZE to
+// the end of the page and on into page 1. The inodes the superblock now
+// covers go to the first extension page, which is where their numbers
+// live now.
+static void
+inode_migrate(void* page0)
+{
+	int old_count = (8 * PAGE_SIZE - BITMAP_SIZE) / (8 * sizeof(inode));
+	int moved = 0;
+
+	for (int inum = inode_base_count; inum < old_count; ++inum) {
+		int off = BITMAP_SIZE + inum * sizeof(inode);
+		inode* old;
+
+		if (off + sizeof(inode) <= PAGE_SIZE)
+			old = (inode*)(page0 + off);
+		else if (off >= PAGE_SIZE && !pages_bitmap_get(1))
+			old = (inode*)(pages_get_page(1) + off - PAGE_SIZE);
+		else
+			continue; // page 1 was in use, so these bytes are its owner's
+
+		if (old->refs == 0 && old->mode == 0)
+			continue;
+
+		while (inum >= INODE_COUNT) {
+			if (grow_inode_table() == -1) {
+				printf("inode_migrate: no room for inode %d\n", inum);
+				return;
+			}
+		}
+
+		int pnum;
+		inode* node = inode_at(inum, &pnum);
+		memcpy(node, old, sizeof(inode));
+		pages_mark_dirty(pnum);
+		moved += 1;
+	}
+
+	printf("+ inode_migrate() -> %d inodes\n", moved);
+}
+
 void
 init_inode_gvars()
 {
@@ -41,8 +103,43 @@ init_inode_gvars()
 	if (rv == -1)
 		return;
 
-	INODE_COUNT = (8 * PAGE_SIZE - PAGE_COUNT) / (8 * sizeof(inode));
-	inode_base = (inode*)((intptr_t)pages_base + PAGE_COUNT);
+	// page 0: page bitmap, inode table, superblock
+	inode_base_count = (PAGE_SIZE - BITMAP_SIZE - sizeof(superblock)) / sizeof(inode);
+	inode_base = (inode*)((intptr_t)pages_get_page(0) + BITMAP_SIZE);
+
+	superblock* sb = get_superblock();
+	if (sb->inode_count < inode_base_count)
+		sb->inode_count = inode_base_count;
+
+	INODE_COUNT = sb->inode_count;
+
+	void* legacy = pages_get_legacy();
+	if (legacy) {
+		inode_migrate(legacy);
+		pages_drop_legacy();
+	}
+
+	free(inode_goals);
+	inode_goals = NULL;
+	inode_ngoals = 0;
+
+	free(inode_gens);
+	inode_gens = NULL;
+	inode_ngens = 0;
+}
+
+static inode*
+inode_at(int inum, int* pnum)
+{
+	*pnum = 0;
+	if (inum < inode_base_count)
+		return inode_base + inum;
+
+	int per = PAGE_SIZE / sizeof(inode);
+	*pnum = pages_list_get(get_superblock()->ilist, (inum - inode_base_count) / per);
+
+	inode* page = (inode*)pages_get_page(*pnum);
+	return page + (inum - inode_base_count) % per;
 }
 
 inode*
@@ -52,10 +149,54 @@ get_inode(int inum)
 	if (rv == -1)
 		return (inode*)(intptr_t)rv;
 
-	if (inum >= INODE_COUNT)
+	if (inum < 0 || inum >= INODE_COUNT)
 		return (inode*)(-1);
 
-    return inode_base + inum;
+	int pnum;
+	inode* node = inode_at(inum, &pnum);
+
+	// callers update the inode through this pointer
+	if (pnum != 0)
+		pages_mark_dirty(pnum);
+
+    return node;
+}
+
+inode*
+peek_inode(int inum)
+{
+	// get_inode for a look only; the inode's page isn't dirtied
+	if (inum < 0 || inum >= INODE_COUNT)
+		return NULL;
+
+	int pnum;
+	return inode_at(inum, &pnum);
+}
+
+int
+grow_inode_table()
+{
+	int per = PAGE_SIZE / sizeof(inode);
+
+	int pnum = alloc_page();
+	if (pnum == -1)
+		return -1;
+
+	memset(pages_get_page(pnum), 0, PAGE_SIZE);
+	pages_mark_dirty(pnum);
+
+	superblock* sb = get_superblock();
+	int pages = (sb->inode_count - inode_base_count) / per;
+	if (pages_list_append(&sb->ilist, pages, pnum) == -1) {
+		free_page(pnum);
+		return -1;
+	}
+
+	sb->inode_count += per;
+	INODE_COUNT = sb->inode_count;
+
+	printf("+ grow_inode_table() -> %d inodes\n", INODE_COUNT);
+	return 0;
 }
 
 
@@ -66,28 +207,45 @@ alloc_inode()
 	if (rv == -1)
 		return rv;
 
-    for (int ii = 2; ii < INODE_COUNT; ++ii) {
-        inode* node = get_inode(ii);
-        if (node->refs == 0) {
-            memset(node, 0, sizeof(inode));
+	int ii = 2;
+
+	while (1) {
+		for (; ii < INODE_COUNT; ++ii) {
+			int pnum;
+			inode* node = inode_at(ii, &pnum);
+			// an unlinked inode the kernel still knows is kept until
+			// it's forgotten
+			if (node->refs != 0 || node->mode != 0) {
+				pages_put_page(pnum);
+				continue;
+			}
+
+			if (pnum != 0)
+				pages_mark_dirty(pnum);
+
+			memset(node, 0, sizeof(inode));
 			node->refs = 1;
-            node->mode = default_file_mode;
+			node->mode = default_file_mode;
 			node->size = 0;
 			node->ptrs[0] = -1;
 			node->ptrs[1] = -1;
 			node->iptr = -1;
 			node->acc = -1;
 			node->mod = -1;
-            printf("+ alloc_inode() -> %d\n", ii);
-            return ii;
-        }
-    }
+			printf("+ alloc_inode() -> %d\n", ii);
+			return ii;
+		}
 
-    return -1;
+		// table is full; add a page of inodes and keep looking from ii
+		if (grow_inode_table() == -1)
+			return -1;
+	}
 }
 
-int
-grow_inode(inode* node, int size)
+// holes leaves the new pages of the file unallocated; they read as
+// zeros until something is written to them
+static int
+grow_inode_pages(inode* node, int size, int holes)
 {
 	int err = globals_pinit_check();
 	if (err == -1) {
@@ -101,10 +259,7 @@ grow_inode(inode* node, int size)
 	}
 
 	if (size == 0) {
-		node->ptrs[0] = -1;
-		node->ptrs[1] = -1;
-		node->iptr = -1;
-		node->size = 0;
+		inode_free_pages(node);
 		return size;
 	}
 
@@ -118,25 +273,82 @@ grow_inode(inode* node, int size)
 
 	int blks_needed = ((size - 1) / PAGE_SIZE) + 1;
 	int blks_allocd = node->size == 0 ? 0 : ((node->size - 1) / PAGE_SIZE) + 1;
+	int blks_start = blks_allocd;
+
+	if (blks_needed > 2 + PAGE_SIZE / sizeof(int)) {
+		printf("grow_inode: %d bytes is past the largest file\n", size);
+		return -EFBIG;
+	}
 
 	int* ipgs = (int*)pages_get_page(node->iptr);
+	int iptr_start = node->iptr;
 	int pnum = -1;
 
 	while (blks_allocd < blks_needed) {
-		pnum = alloc_page();
-		if (pnum == -1)
-			return -1;
+		if (blks_allocd == 2 && node->iptr == -1) {
+			node->iptr = alloc_page();
+			if (node->iptr == -1)
+				goto grow_fail;
+
+			ipgs = (int*)pages_get_page(node->iptr);
+			memset(ipgs, 0xff, PAGE_SIZE);
+			pages_mark_dirty(node->iptr);
+		}
+
+		if (holes) {
+			pnum = -1;
+		}
+		else {
+			pnum = alloc_page();
+			if (pnum == -1)
+				goto grow_fail;
+		}
 
 		if (blks_allocd == 0 || blks_allocd == 1)
 			node->ptrs[blks_allocd] = pnum;
-		else
+		else {
 			ipgs[blks_allocd - 2] = pnum;
-		
+			pages_mark_dirty(node->iptr);
+		}
+
 		blks_allocd += 1;
 	}
 
 	node->size = size;
 	return size;
+
+grow_fail:
+	// out of space even after trying to grow the image; undo this call
+	while (blks_allocd > blks_start) {
+		blks_allocd -= 1;
+
+		if (blks_allocd == 0 || blks_allocd == 1) {
+			free_page(node->ptrs[blks_allocd]);
+			node->ptrs[blks_allocd] = -1;
+		}
+		else {
+			free_page(ipgs[blks_allocd - 2]);
+		}
+	}
+
+	if (iptr_start == -1 && node->iptr != -1) {
+		free_page(node->iptr);
+		node->iptr = -1;
+	}
+
+	return -ENOSPC;
+}
+
+int
+grow_inode(inode* node, int size)
+{
+	return grow_inode_pages(node, size, 0);
+}
+
+int
+grow_inode_sparse(inode* node, int size)
+{
+	return grow_inode_pages(node, size, 1);
 }
 
 int
@@ -153,10 +365,7 @@ shrink_inode(inode* node, int size)
 		return -EINVAL;
 	}
 	else if (size == 0) {
-		node->ptrs[0] = -1;
-		node->ptrs[1] = -1;
-		node->iptr = -1;
-		node->size = 0;
+		inode_free_pages(node);
 		return size;
 	}
 
@@ -172,23 +381,23 @@ shrink_inode(inode* node, int size)
 	int blks_allocd = node->size == 0 ? 0 : ((node->size - 1) / PAGE_SIZE) + 1;
 
 	int* ipgs = (int*)pages_get_page(node->iptr);
-	int pnum = -1;
 
+	// blks_allocd - 1 is the index of the last page still in the file
 	while (blks_allocd > blks_needed) {
+		blks_allocd -= 1;
 
 		if (blks_allocd == 0 || blks_allocd == 1) {
 			free_page(node->ptrs[blks_allocd]);
-			node->ptrs[blks_allocd] = pnum;
+			node->ptrs[blks_allocd] = -1;
 		}
 		else {
-			pnum = ipgs[blks_allocd - 2];
-			free_page(pnum);
+			free_page(ipgs[blks_allocd - 2]);
+			ipgs[blks_allocd - 2] = -1;
+			pages_mark_dirty(node->iptr);
 		}
-
-		blks_allocd -= 1;
 	}
 
-	if (blks_allocd < 2) {
+	if (blks_allocd <= 2 && node->iptr != -1) {
 		free_page(node->iptr);
 		node->iptr = -1;
 	}
@@ -197,21 +406,121 @@ shrink_inode(inode* node, int size)
 	return size;
 }
 
+void
+inode_free_pages(inode* node)
+{
+	tail_release(node);
+
+	for (int fpn = 0; fpn < bytes_to_pages(node->size); ++fpn)
+		free_page(inode_get_pnum(node, fpn));
+
+	if (node->iptr != -1)
+		free_page(node->iptr);
+
+	node->ptrs[0] = -1;
+	node->ptrs[1] = -1;
+	node->iptr = -1;
+	node->size = 0;
+}
+
+int
+inode_get_pnum(inode* node, int fpn)
+{
+	// fpn is the zero-indexed page of the file
+	if (fpn < 0 || fpn >= bytes_to_pages(node->size))
+		return -1;
+
+	if (fpn == 0 || fpn == 1)
+		return node->ptrs[fpn];
+
+	if (node->iptr == -1)
+		return -1;
+
+	int* ipgs = (int*)pages_get_page(node->iptr);
+	return ipgs[fpn - 2];
+}
+
+int
+inode_set_pnum(inode* node, int fpn, int pnum)
+{
+	if (fpn < 0 || fpn >= bytes_to_pages(node->size))
+		return -1;
+
+	if (fpn == 0 || fpn == 1) {
+		node->ptrs[fpn] = pnum;
+		return 0;
+	}
+
+	if (node->iptr == -1)
+		return -1;
+
+	int* ipgs = (int*)pages_get_page(node->iptr);
+	ipgs[fpn - 2] = pnum;
+	pages_mark_dirty(node->iptr);
+	return 0;
+}
+
+int
+inode_goal(int inum)
+{
+	// a page its new pages should go near, -1 for anywhere
+	inode* node = peek_inode(inum);
+	if (!node)
+		return -1;
+
+	if (node->ptrs[0] > 0)
+		return node->ptrs[0];
+
+	if (node->ptrs[1] > 0)
+		return node->ptrs[1];
+
+	return inum < inode_ngoals ? inode_goals[inum] : -1;
+}
+
+void
+inode_set_goal(int inum, int pnum)
+{
+	if (inum >= inode_ngoals) {
+		int count = max(inum + 1, 2 * inode_ngoals);
+		inode_goals = realloc(inode_goals, count * sizeof(int));
+		for (int ii = inode_ngoals; ii < count; ++ii)
+			inode_goals[ii] = -1;
+
+		inode_ngoals = count;
+	}
+
+	inode_goals[inum] = pnum;
+}
+
+unsigned int
+inode_generation(int inum)
+{
+	return inum < inode_ngens ? inode_gens[inum] : 0;
+}
+
 void
 free_inode(int inum)
 {
     printf("+ free_inode(%d)\n", inum);
 
     inode* node = get_inode(inum);
+	inode_free_pages(node);
+	delalloc_drop(inum, 0);
+	compress_drop(inum, 0);
+	hot_forget(inum);
+	if (inum < inode_ngoals)
+		inode_goals[inum] = -1;
+
+	if (inum >= inode_ngens) {
+		int count = max(inum + 1, 2 * inode_ngens);
+		inode_gens = realloc(inode_gens, count * sizeof(unsigned int));
+		for (int ii = inode_ngens; ii < count; ++ii)
+			inode_gens[ii] = 0;
+
+		inode_ngens = count;
+	}
 
-	if (node->ptrs[0] != -1)
-		free_page(node->ptrs[0]);	
-
-	if (node->ptrs[1] != -1)
-		free_page(node->ptrs[1]);
-
-	if (node->iptr != -1)
-		free_page(node->iptr);
+	inode_gens[inum] += 1;
 
     memset(node, 0, sizeof(inode));
 }
@@ -3,11 +3,15 @@
 
 #include "pages.h"
 
+#define INODE_COMPRESS 0x01 // chattr +c; new files in a directory inherit it
+
 typedef struct inode {
 	char refs;
+	char flags; // INODE_ flags
+	short tail; // tail packed: where the data starts in its fragment page
     int mode; // permission & type; zero for unused
     int size; // bytes
-	int ptrs[2]; // direct pointers
+	int ptrs[2]; // direct pointers; -1 inside the file is a hole
 	int iptr; // single indirect pointer`
 	long acc; // last access time
 	long mod; // last modification time
@@ -16,10 +20,18 @@ typedef struct inode {
 void print_inode(inode* node);
 void init_inode_gvars();
 inode* get_inode(int inum);
+inode* peek_inode(int inum);
 int alloc_inode();
+int grow_inode_table();
 int grow_inode(inode* node, int size);
+int grow_inode_sparse(inode* node, int size);
 int shrink_inode(inode* node, int size);
 void free_inode();
 int inode_get_pnum(inode* node, int fpn);
+int inode_set_pnum(inode* node, int fpn, int pnum);
+int inode_goal(int inum);
+void inode_set_goal(int inum, int pnum);
+unsigned int inode_generation(int inum);
+void inode_free_pages(inode* node);
 
 #endif
@@ -0,0 +1,469 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "journal.h"
+#include "pages.h"
+#include "backend.h"
+#include "cache.h"
+#include "bitmap.h"
+#include "csum.h"
+
+#include "globals.h"
+
+extern int PAGE_COUNT;
+extern const int PAGE_SIZE;
+extern backend* pages_backend;
+
+extern nufs_opts mount_opts;
+
+// page numbers that fit in one descriptor page
+#define JOURNAL_DESC_MAX ((int)((PAGE_SIZE - sizeof(journal_desc)) / sizeof(int)))
+
+static int journal_active = 0;
+static int journal_start = 0; // the header page; transactions follow it
+static int journal_pages = 0;
+static int journal_head = 1;  // next free page, relative to journal_start
+static int journal_seq = 1;
+static int journal_ops = 0;   // ops staged since the last commit
+
+// pages dirtied since the last commit, and pages in transactions since
+// the last checkpoint; neither may be handed out again until it's home
+static int*  journal_staged = NULL;
+static int   journal_staged_count = 0;
+static int   journal_staged_cap = 0;
+static void* journal_staged_bm = NULL;
+static void* journal_logged_bm = NULL;
+static int   journal_bits = 0;
+
+// pages freed by the open transaction whose contents were moved, not
+// dropped; until it's committed, the image on disk still points at them
+static void* journal_deferred_bm = NULL;
+static int   journal_deferred = 0;
+
+static void* journal_buf = NULL;   // descriptor or header being written
+static void* journal_page0 = NULL; // page 0 as of the last commit
+
+static long journal_commits = 0;
+static long journal_checkpoints = 0;
+static long journal_logged = 0;
+static long journal_skipped0 = 0;
+
+static unsigned
+journal_csum(const int* pnums, int count, void* const* images)
+{
+	// FNV-1a
+	unsigned hh = 2166136261u;
+
+	const unsigned char* pp = (const unsigned char*)pnums;
+	for (size_t ii = 0; ii < count * sizeof(int); ++ii)
+		hh = (hh ^ pp[ii]) * 16777619u;
+
+	for (int ii = 0; ii < count; ++ii) {
+		pp = images[ii];
+		for (int jj = 0; jj < PAGE_SIZE; ++jj)
+			hh = (hh ^ pp[jj]) * 16777619u;
+	}
+
+	return hh;
+}
+
+static void*
+journal_alloc_buf(int pages)
+{
+	void* buf = NULL;
+	int rv = posix_memalign(&buf, PAGE_SIZE, (size_t)pages * PAGE_SIZE);
+	assert(rv == 0);
+
+	memset(buf, 0, (size_t)pages * PAGE_SIZE);
+	return buf;
+}
+
+void
+journal_replay()
+{
+	void* page0 = journal_alloc_buf(1);
+	void* hdr_buf = journal_alloc_buf(1);
+	void* desc_buf = journal_alloc_buf(1);
+
+	superblock* sb = (superblock*)(page0 + PAGE_SIZE - sizeof(superblock));
+	journal_header* hdr = (journal_header*)hdr_buf;
+	journal_desc* desc = (journal_desc*)desc_buf;
+
+	int done = 0;
+	if (pages_backend->read(0, page0) < 0 || sb->magic != NUFS_MAGIC || sb->journal <= 0)
+		goto replay_out;
+
+	int start = sb->journal;
+	int pages = sb->journal_pages;
+
+	// the log is written around the cache even if we won't be using it
+	journal_start = start;
+	journal_pages = pages;
+
+	if (pages_backend->read(start, hdr_buf) < 0 || hdr->magic != JOURNAL_MAGIC)
+		goto replay_out;
+
+	int seq = hdr->seq;
+	int head = 1;
+
+	while (head < pages) {
+		if (pages_backend->read(start + head, desc_buf) < 0)
+			break;
+
+		// a transaction from before the last checkpoint, or the end of the log
+		if (desc->magic != JOURNAL_DESC || desc->seq != seq ||
+		    desc->count <= 0 || desc->count > JOURNAL_DESC_MAX ||
+		    head + 1 + desc->count > pages)
+			break;
+
+		void* images = journal_alloc_buf(desc->count);
+		void** bufs = malloc(desc->count * sizeof(void*));
+		int rv = 0;
+		for (int ii = 0; ii < desc->count && rv == 0; ++ii) {
+			bufs[ii] = images + (size_t)ii * PAGE_SIZE;
+			rv = pages_backend->read(start + head + 1 + ii, bufs[ii]);
+		}
+
+		// torn commit: the sync never finished, so nothing of it went home
+		if (rv < 0 || journal_csum(desc->pnums, desc->count, bufs) != desc->csum) {
+			free(images);
+			free(bufs);
+			break;
+		}
+
+		for (int ii = 0; ii < desc->count; ++ii) {
+			int pnum = desc->pnums[ii];
+			if (pnum >= PAGE_COUNT && pages_backend->resize(pnum + 1) == 0)
+				PAGE_COUNT = pnum + 1;
+
+			pages_backend->write(pnum, bufs[ii]);
+		}
+
+		free(images);
+		free(bufs);
+
+		head += 1 + desc->count;
+		seq += 1;
+		done += 1;
+	}
+
+	if (done > 0)
+		pages_backend->sync();
+
+	// everything in the log is home; the next transaction starts at the front
+	hdr->seq = seq;
+	pages_backend->write(start, hdr_buf);
+	pages_backend->sync();
+
+replay_out:
+	printf("+ journal_replay() -> %d transactions\n", done);
+
+	free(page0);
+	free(hdr_buf);
+	free(desc_buf);
+}
+
+void
+journal_init()
+{
+	if (mount_opts.journal <= 0)
+		return;
+
+	journal_buf = journal_alloc_buf(1);
+	journal_header* hdr = (journal_header*)journal_buf;
+
+	superblock* sb = get_superblock();
+	if (sb->journal <= 0) {
+		int start = pages_alloc_run(mount_opts.journal);
+		if (start == -1) {
+			printf("journal_init: no room for a %d page journal\n", mount_opts.journal);
+			return;
+		}
+
+		hdr->magic = JOURNAL_MAGIC;
+		hdr->seq = 1;
+		pages_backend->write(start, journal_buf);
+
+		sb->journal = start;
+		sb->journal_pages = mount_opts.journal;
+
+		// replay finds the log through page 0, so that has to be home first
+		if (!pages_backend->map) {
+			pages_backend->write(0, pages_get_page(0));
+			csum_update(0, pages_get_page(0));
+		}
+		pages_backend->sync();
+	}
+	else {
+		// journal_replay left the header at the next sequence number
+		pages_backend->read(sb->journal, journal_buf);
+		if (hdr->magic != JOURNAL_MAGIC) {
+			printf("journal_init: bad journal header at page %d\n", sb->journal);
+			return;
+		}
+	}
+
+	journal_start = sb->journal;
+	journal_pages = sb->journal_pages;
+	journal_seq = hdr->seq;
+	journal_head = 1;
+
+	// sized for the largest the image can grow to
+	journal_bits = PAGE_COUNT > mount_opts.max_pages ? PAGE_COUNT : mount_opts.max_pages;
+	journal_staged_bm = calloc(journal_bits / 8 + 2, 1);
+	journal_logged_bm = calloc(journal_bits / 8 + 2, 1);
+	journal_deferred_bm = calloc(journal_bits / 8 + 2, 1);
+
+	journal_page0 = journal_alloc_buf(1);
+	memcpy(journal_page0, pages_get_page(0), PAGE_SIZE);
+
+	journal_active = 1;
+	printf("+ journal_init() -> pages %d-%d, seq %d\n",
+	       journal_start, journal_start + journal_pages - 1, journal_seq);
+}
+
+void
+journal_free()
+{
+	if (!journal_active)
+		return;
+
+	journal_commit();
+	journal_checkpoint();
+
+	printf("=======JOURNAL STATS=====\n");
+	printf("pages       : %d at %d\n", journal_pages, journal_start);
+	printf("commits     : %ld\n", journal_commits);
+	printf("checkpoints : %ld\n", journal_checkpoints);
+	printf("pages logged: %ld\n", journal_logged);
+	printf("page 0 kept : %ld\n", journal_skipped0);
+	printf("\n");
+
+	free(journal_staged);
+	free(journal_staged_bm);
+	free(journal_logged_bm);
+	free(journal_deferred_bm);
+	free(journal_buf);
+	free(journal_page0);
+
+	journal_staged = NULL;
+	journal_staged_count = 0;
+	journal_staged_cap = 0;
+	journal_active = 0;
+}
+
+int
+journal_enabled()
+{
+	return journal_active;
+}
+
+void
+journal_touch(int pnum)
+{
+	if (!journal_active || pnum >= journal_bits || bitmap_get(journal_staged_bm, pnum))
+		return;
+
+	if (journal_staged_count == journal_staged_cap) {
+		journal_staged_cap = journal_staged_cap ? 2 * journal_staged_cap : 64;
+		journal_staged = realloc(journal_staged, journal_staged_cap * sizeof(int));
+	}
+
+	journal_staged[journal_staged_count++] = pnum;
+	bitmap_put(journal_staged_bm, pnum, 1);
+
+	// the cache must not write it home before the commit
+	if (!pages_backend->map)
+		cache_hold(pnum);
+}
+
+int
+journal_contains(int pnum)
+{
+	// pages of the log itself, whether or not this mount uses it
+	return journal_pages > 0 && pnum >= journal_start && pnum < journal_start + journal_pages;
+}
+
+int
+journal_pending(int pnum)
+{
+	if (!journal_active || pnum >= journal_bits)
+		return 0;
+
+	return bitmap_get(journal_staged_bm, pnum) || bitmap_get(journal_logged_bm, pnum)
+	    || bitmap_get(journal_deferred_bm, pnum);
+}
+
+void
+journal_defer(int pnum)
+{
+	if (!journal_active || pnum <= 0 || pnum >= journal_bits)
+		return;
+
+	bitmap_put(journal_deferred_bm, pnum, 1);
+	journal_deferred += 1;
+}
+
+static void
+journal_undefer()
+{
+	// what the last commit freed is free on disk too
+	if (journal_deferred == 0)
+		return;
+
+	memset(journal_deferred_bm, 0, journal_bits / 8 + 2);
+	journal_deferred = 0;
+}
+
+void
+journal_op_done()
+{
+	if (!journal_active)
+		return;
+
+	journal_ops += 1;
+	if (journal_ops >= mount_opts.journal_batch)
+		journal_commit();
+}
+
+static void
+journal_unstage(int idx)
+{
+	bitmap_put(journal_staged_bm, journal_staged[idx], 0);
+	journal_staged[idx] = journal_staged[--journal_staged_count];
+}
+
+int
+journal_commit()
+{
+	if (!journal_active)
+		return 0;
+
+	journal_ops = 0;
+
+	// every op stages page 0, but most leave it as it was
+	for (int ii = 0; ii < journal_staged_count; ++ii) {
+		if (journal_staged[ii] == 0) {
+			if (memcmp(pages_get_page(0), journal_page0, PAGE_SIZE) == 0) {
+				journal_unstage(ii);
+				journal_skipped0 += 1;
+			}
+			break;
+		}
+	}
+
+	int count = journal_staged_count;
+	if (count == 0) {
+		if (!pages_backend->map)
+			cache_unhold();
+		journal_undefer();
+		return 0;
+	}
+
+	if (count > JOURNAL_DESC_MAX || 1 + count > journal_pages - 1) {
+		// can't be made atomic; at least get it home
+		printf("journal_commit: %d pages won't fit in the journal\n", count);
+		while (journal_staged_count > 0)
+			journal_unstage(0);
+
+		if (!pages_backend->map)
+			cache_unhold();
+
+		int rv = journal_checkpoint();
+		if (rv == 0)
+			journal_undefer();
+		return rv;
+	}
+
+	if (journal_head + 1 + count > journal_pages)
+		journal_checkpoint();
+
+	journal_desc* desc = (journal_desc*)journal_buf;
+	memset(journal_buf, 0, PAGE_SIZE);
+
+	int* jpnums = malloc((1 + count) * sizeof(int));
+	void** bufs = malloc((1 + count) * sizeof(void*));
+
+	jpnums[0] = journal_start + journal_head;
+	bufs[0] = journal_buf;
+	for (int ii = 0; ii < count; ++ii) {
+		desc->pnums[ii] = journal_staged[ii];
+		jpnums[1 + ii] = journal_start + journal_head + 1 + ii;
+		bufs[1 + ii] = pages_get_page(journal_staged[ii]);
+	}
+
+	desc->magic = JOURNAL_DESC;
+	desc->seq = journal_seq;
+	desc->count = count;
+	desc->csum = journal_csum(desc->pnums, count, bufs + 1);
+
+	// one write for the whole group, then the one sync it's all waiting on
+	int rv = pages_backend->write_batch(1 + count, jpnums, bufs);
+	if (rv == 0)
+		rv = pages_backend->sync_range(jpnums[0], 1 + count);
+
+	free(jpnums);
+	free(bufs);
+
+	if (rv < 0) {
+		printf("journal_commit: %s\n", strerror(-rv));
+		return rv;
+	}
+
+	for (int ii = 0; ii < count; ++ii) {
+		int pnum = journal_staged[ii];
+		bitmap_put(journal_staged_bm, pnum, 0);
+		bitmap_put(journal_logged_bm, pnum, 1);
+
+		if (pnum == 0)
+			memcpy(journal_page0, pages_get_page(0), PAGE_SIZE);
+	}
+
+	journal_staged_count = 0;
+	journal_undefer();
+	journal_head += 1 + count;
+	journal_seq += 1;
+	journal_commits += 1;
+	journal_logged += count;
+
+	if (!pages_backend->map)
+		cache_unhold();
+
+	return 0;
+}
+
+int
+journal_checkpoint()
+{
+	if (!journal_active)
+		return 0;
+
+	// committed pages have to be home before their log space is reused;
+	// staged ones stay held in the cache
+	if (!pages_backend->map)
+		cache_flush();
+
+	int rv = pages_backend->sync();
+	if (rv < 0) {
+		printf("journal_checkpoint: %s\n", strerror(-rv));
+		return rv;
+	}
+
+	journal_header* hdr = (journal_header*)journal_buf;
+	memset(journal_buf, 0, PAGE_SIZE);
+	hdr->magic = JOURNAL_MAGIC;
+	hdr->seq = journal_seq;
+
+	rv = pages_backend->write(journal_start, journal_buf);
+	if (rv == 0)
+		rv = pages_backend->sync();
+
+	journal_head = 1;
+	memset(journal_logged_bm, 0, journal_bits / 8 + 2);
+	journal_checkpoints += 1;
+	return rv;
+}
@@ -0,0 +1,36 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL", the journal's first page
+#define JOURNAL_DESC  0x43534544 // "DESC", starts a transaction
+
+// Redo log of metadata pages. Every page marked dirty during an op is
+// staged; a group of ops commits as one transaction (a descriptor page
+// listing the page numbers, then their images) with a single sync, and
+// only then may the pages go home. Mount replays committed transactions.
+typedef struct journal_header {
+	int magic;
+	int seq; // the first transaction after the last checkpoint
+} journal_header;
+
+typedef struct journal_desc {
+	int magic;
+	int seq;
+	int count;      // page images following this page
+	unsigned csum;  // over pnums and the images
+	int pnums[];
+} journal_desc;
+
+void journal_replay();
+void journal_init();
+void journal_free();
+int  journal_enabled();
+void journal_touch(int pnum);
+int  journal_contains(int pnum);
+int  journal_pending(int pnum);
+void journal_defer(int pnum);
+void journal_op_done();
+int  journal_commit();
+int  journal_checkpoint();
+
+#endif
@@ -7,261 +7,721 @@
 #include <bsd/string.h>
 #include <assert.h>
 #include <alloca.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include "storage.h"
 #include "directory.h"
 #include "slist.h"
 #include "util.h"
 #include "inode.h"
+#include "snap.h"
+#include "cbt.h"
+#include "defrag.h"
+#include "hot.h"
 
 #include "globals.h"
 
 extern int num_mounts;
+extern nufs_opts mount_opts;
 
 extern const int default_symlink_mode;
 
-// implementation for: man 2 access
-// Checks if a file exists.
-int
-nufs_access(const char *path, int mask)
+// the channel to the kernel, for telling it what's changed
+static struct fuse_chan* nufs_chan = NULL;
+
+// what the kernel will write at once; libfuse's buffer holds 32 pages
+#define NUFS_MAX_WRITE (128 * 1024)
+
+// Invalidations on their way to the kernel. They go from a thread of
+// their own: the kernel can be holding locks for the request an op came
+// in with, which an invalidation sent from inside the op would wait on.
+typedef struct nufs_inval {
+    fuse_ino_t ino;  // the inode, or the directory the name is in
+    char*      name; // NULL for the inode itself
+    off_t      off;  // its cached data from here on, -1 for just its attributes
+    struct nufs_inval* next;
+} nufs_inval;
+
+static pthread_mutex_t nufs_inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  nufs_inval_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       nufs_inval_thread;
+static int             nufs_inval_on = 0;
+static nufs_inval*     nufs_invals = NULL;
+
+static void*
+nufs_inval_main(void* arg)
 {
-    int rv = 0;
-/*
-	int inum = tree_lookup(path);
-	if (inum < 0) {
-		rv = -ENOENT;
-		goto access_done;
-	}
+    pthread_mutex_lock(&nufs_inval_lock);
+    while (nufs_inval_on) {
+        if (!nufs_invals) {
+            pthread_cond_wait(&nufs_inval_cond, &nufs_inval_lock);
+            continue;
+        }
+
+        nufs_inval* iv = nufs_invals;
+        nufs_invals = iv->next;
+        pthread_mutex_unlock(&nufs_inval_lock);
+
+        // the kernel may not have it any more, which is fine
+        int rv;
+        if (iv->name)
+            rv = fuse_lowlevel_notify_inval_entry(nufs_chan, iv->ino, iv->name, strlen(iv->name));
+        else
+            rv = fuse_lowlevel_notify_inval_inode(nufs_chan, iv->ino, iv->off, 0);
+        printf("inval(%ld, %s, %ld) -> %d\n", iv->ino, iv->name ? iv->name : "-", iv->off, rv);
+
+        free(iv->name);
+        free(iv);
+        pthread_mutex_lock(&nufs_inval_lock);
+    }
+    pthread_mutex_unlock(&nufs_inval_lock);
+
+    return NULL;
+}
+
+// Tells the kernel to drop what it has cached of an inode, or of a name
+// in a directory, once the op is done. Only needed while it caches, and
+// only for what changed without it: it keeps its cache right through its
+// own writes, renames and setattrs, from what their replies carry.
+static void
+nufs_invalidate(fuse_ino_t ino, const char* name, off_t off)
+{
+    pthread_mutex_lock(&nufs_inval_lock);
+    if (!nufs_inval_on) {
+        pthread_mutex_unlock(&nufs_inval_lock);
+        return;
+    }
+
+    // one's enough of each
+    nufs_inval** pp = &nufs_invals;
+    for (; *pp; pp = &(*pp)->next) {
+        nufs_inval* iv = *pp;
+        if (iv->ino == ino && iv->off == off && (name ? iv->name && streq(iv->name, name) : !iv->name)) {
+            pthread_mutex_unlock(&nufs_inval_lock);
+            return;
+        }
+    }
+
+    nufs_inval* iv = calloc(1, sizeof(nufs_inval));
+    iv->ino = ino;
+    iv->name = name ? strdup(name) : NULL;
+    iv->off = off;
+    *pp = iv;
+
+    pthread_cond_signal(&nufs_inval_cond);
+    pthread_mutex_unlock(&nufs_inval_lock);
+}
+
+static void
+nufs_start_inval()
+{
+    if (mount_opts.ttl <= 0 || !nufs_chan)
+        return;
+
+    nufs_inval_on = 1;
+    pthread_create(&nufs_inval_thread, NULL, nufs_inval_main, NULL);
+}
+
+static void
+nufs_stop_inval()
+{
+    if (!nufs_inval_on)
+        return;
+
+    pthread_mutex_lock(&nufs_inval_lock);
+    nufs_inval_on = 0;
+    pthread_cond_signal(&nufs_inval_cond);
+    pthread_mutex_unlock(&nufs_inval_lock);
+    pthread_join(nufs_inval_thread, NULL);
+
+    // nobody's listening for the rest
+    while (nufs_invals) {
+        nufs_inval* iv = nufs_invals;
+        nufs_invals = iv->next;
+        free(iv->name);
+        free(iv);
+    }
+}
 
-	inode* node = get_inode(inum);
-	int val = node->mode && mask;
+static storage_file*
+nufs_file(struct fuse_file_info* fi)
+{
+    return fi ? (storage_file*)(intptr_t)fi->fh : NULL;
+}
+
+// Fills in the reply for an op that hands the kernel an inode. The kernel
+// counts those, and tells us with forget once it's let go of them; until
+// then an unlinked inode has to stay. Called inside the op.
+static int
+nufs_entry(int inum, struct fuse_entry_param* e)
+{
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    int rv = storage_stat(inum, &e->attr);
+    if (rv < 0)
+        return rv;
+
+    e->ino = inum;
+    e->generation = inode_generation(inum);
+    e->attr_timeout = mount_opts.ttl;
+    e->entry_timeout = mount_opts.ttl;
+    storage_hold(inum);
+    return 0;
+}
+
+static void
+nufs_reply_entry(fuse_req_t req, int rv, struct fuse_entry_param* e)
+{
+    if (rv < 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_entry(req, e);
+}
+
+static void
+nufs_reply_attr(fuse_req_t req, int rv, struct stat* st)
+{
+    if (rv < 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_attr(req, st, mount_opts.ttl);
+}
 
-	if (val == 0)
-		rv = -EACCES;
+// finds a name in a directory; the only time a name is looked at
+void
+nufs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    struct fuse_entry_param e;
+
+    storage_op_begin();
+    int inum = storage_lookup(parent, name);
+    int rv = inum < 0 ? inum : nufs_entry(inum, &e);
+    storage_op_done();
+    printf("lookup(%ld, %s) -> %d\n", parent, name, inum);
+
+    // names are only made through the kernel, so it can remember one
+    // isn't there as long as anything else
+    if (rv == -ENOENT && mount_opts.ttl > 0) {
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = mount_opts.ttl;
+        rv = 0;
+    }
 
-access_done:*/
-    printf("access(%s, %04o) -> %d\n", path, mask, rv);
-    return rv;
+    nufs_reply_entry(req, rv, &e);
+}
+
+// the kernel has dropped nlookup of its references to an inode
+void
+nufs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    storage_op_begin();
+    storage_forget(ino, nlookup);
+    storage_op_done();
+    printf("forget(%ld, %lu)\n", ino, nlookup);
+    fuse_reply_none(req);
 }
 
 // implementation for: man 2 stat
 // gets an object's attributes (type, permissions, size, etc)
-int
-nufs_getattr(const char *path, struct stat *st)
+void
+nufs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    storage_op_begin();
+    int rv = storage_stat(ino, &st);
+    storage_op_done();
+    printf("getattr(%ld) -> (%d) {mode: %04o, size: %ld}\n", ino, rv, st.st_mode, st.st_size);
+    nufs_reply_attr(req, rv, &st);
+}
+
+static struct timespec
+nufs_time(int to_set, int set, int now, struct timespec ts)
 {
-    int rv = storage_stat(path, st);
-    printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);
-    return rv;
+    if (!(to_set & set))
+        ts.tv_nsec = UTIME_OMIT;
+    else if (to_set & now)
+        ts.tv_nsec = UTIME_NOW;
+
+    return ts;
 }
 
-// implementation for: man 2 readdir
-// lists the contents of a directory
-int
-nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-             off_t offset, struct fuse_file_info *fi)
+// implements: man 2 chmod, man 2 truncate, man 2 utimensat
+void
+nufs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi)
 {
     struct stat st;
-    char item_path[256];
-    int rv;
+    int rv = 0;
+
+    storage_op_begin();
+    if (to_set & FUSE_SET_ATTR_MODE)
+        rv = storage_chmod(ino, attr->st_mode);
+
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+        rv = storage_truncate(ino, attr->st_size);
 
-    rv = storage_stat(path, &st);
-    assert(rv == 0);
+    if (rv == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        struct timespec ts[2];
+        ts[0] = nufs_time(to_set, FUSE_SET_ATTR_ATIME, FUSE_SET_ATTR_ATIME_NOW, attr->st_atim);
+        ts[1] = nufs_time(to_set, FUSE_SET_ATTR_MTIME, FUSE_SET_ATTR_MTIME_NOW, attr->st_mtim);
+        rv = storage_set_time(ino, ts);
+    }
 
-    filler(buf, ".", &st, 0);
+    if (rv == 0)
+        rv = storage_stat(ino, &st);
+    storage_op_done();
+    printf("setattr(%ld, %#x) -> %d\n", ino, to_set, rv);
+    nufs_reply_attr(req, rv, &st);
+}
 
-    slist* items = storage_list(path);
+// One directory entry into a readdir reply; 1 once the reply's full.
+// Entries before off went out in an earlier reply.
+static int
+nufs_dirent(fuse_req_t req, char* buf, size_t size, size_t* used,
+            int inum, const char* name, off_t idx, off_t off)
+{
+    struct stat st;
 
-	memset(item_path, 0, 256 * sizeof(char));
-    strlcpy(item_path, path, strlen(path) + 1);
+    if (idx < off || storage_stat(inum, &st) < 0)
+        return 0;
 
-	char* start = item_path + strlen(path) + 1;
-	start[0] = '/';
-	start++;
+    size_t len = fuse_add_direntry(req, buf + *used, size - *used, name, &st, idx + 1);
+    if (len > size - *used)
+        return 1;
 
-	while (items) {
-        printf("+ looking at path: '%s'\n", items->data);
+    *used += len;
+    return 0;
+}
 
-		strlcpy(start, items->data, strlen(items->data) + 1);
-		printf("%s\n", item_path);
+// implementation for: man 2 readdir
+// lists the contents of a directory
+void
+nufs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
+{
+    char* buf = malloc(size);
+    size_t used = 0;
+    off_t idx = 0;
 
-        rv = storage_stat(item_path, &st);
-        assert(rv == 0);
+    storage_op_begin();
 
-        filler(buf, items->data, &st, 0);
-	
-		items = items->next;
-    }
+    // an entry's offset is where the listing picks up after it; the
+    // list is the request's, in its arena
+    int full = nufs_dirent(req, buf, size, &used, ino, ".", idx++, off);
 
-    s_free(items);
+    slist* items = storage_list(ino);
+    while (items && !full) {
+        printf("+ looking at path: '%s'\n", items->data);
+
+        int inum = storage_lookup(ino, items->data);
+        full = nufs_dirent(req, buf, size, &used, inum, items->data, idx++, off);
+
+        items = items->next;
+    }
 
-    printf("readdir(%s) -> %d\n", path, rv);
-    return rv;
+    storage_op_done();
+    printf("readdir(%ld, @%ld) -> %ld bytes\n", ino, off, used);
+    fuse_reply_buf(req, buf, used);
+    free(buf);
 }
 
 // mknod makes a filesystem object like a file or directory
 // called for: man 2 open, man 2 link
-int
-nufs_mknod(const char *path, mode_t mode, dev_t rdev)
+void
+nufs_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev)
 {
-    int rv = storage_mknod(path, mode);
-    printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
-    return rv;
+    struct fuse_entry_param e;
+
+    storage_op_begin();
+    int inum = storage_mknod(parent, name, mode);
+    int rv = inum < 0 ? inum : nufs_entry(inum, &e);
+    storage_op_done();
+    printf("mknod(%ld, %s, %04o) -> %d\n", parent, name, mode, inum);
+    nufs_reply_entry(req, rv, &e);
 }
 
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
-int
-nufs_mkdir(const char *path, mode_t mode)
+void
+nufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
 {
+    struct fuse_entry_param e;
+
 	mode = S_IFDIR | mode;
-    int rv = storage_mknod(path, mode);
-    printf("mkdir(%s) -> %d\n", path, rv);
-    return rv;
+    storage_op_begin();
+    int inum = storage_mknod(parent, name, mode);
+    int rv = inum < 0 ? inum : nufs_entry(inum, &e);
+    storage_op_done();
+    printf("mkdir(%ld, %s) -> %d\n", parent, name, inum);
+    nufs_reply_entry(req, rv, &e);
 }
 
-int
-nufs_unlink(const char *path)
+void
+nufs_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
-    int rv = storage_unlink(path);
-    printf("unlink(%s) -> %d\n", path, rv);
-    return rv;
+    storage_op_begin();
+    int rv = storage_unlink(parent, name);
+    storage_op_done();
+    printf("unlink(%ld, %s) -> %d\n", parent, name, rv);
+    fuse_reply_err(req, -rv);
 }
 
-int
-nufs_link(const char *from, const char *to)
+void
+nufs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname)
 {
-    int rv = storage_link(from, to);
-    printf("link(%s => %s) -> %d\n", from, to, rv);
-	return rv;
+    struct fuse_entry_param e;
+
+    storage_op_begin();
+    int rv = storage_link(ino, newparent, newname);
+    if (rv == 0)
+        rv = nufs_entry(ino, &e);
+    storage_op_done();
+    printf("link(%ld => %ld, %s) -> %d\n", ino, newparent, newname, rv);
+    nufs_reply_entry(req, rv, &e);
 }
 
-int
-nufs_symlink(const char *from, const char *to)
+void
+nufs_symlink(fuse_req_t req, const char* link, fuse_ino_t parent, const char* name)
 {
-	mode_t mode = default_symlink_mode;
-	int rv = storage_mknod(to, mode);
+    struct fuse_entry_param e;
 
-	rv = storage_write(to, from, strlen(from) + 1, 0);
-	if (rv == strlen(from) + 1)
-		rv = 0;
-	else
-		rv = -1;
+	mode_t mode = default_symlink_mode;
+	storage_op_begin();
+	int inum = storage_mknod(parent, name, mode);
+
+	int rv = inum;
+	if (inum > 0) {
+		rv = storage_write(inum, link, strlen(link) + 1, 0);
+		if (rv == strlen(link) + 1)
+			rv = nufs_entry(inum, &e);
+		else
+			rv = -EIO;
+	}
 
-    printf("symlink(%s => %s) -> %d\n", from, to, rv);
-	return rv;
+    storage_op_done();
+    printf("symlink(%s => %ld, %s) -> %d\n", link, parent, name, rv);
+    nufs_reply_entry(req, rv, &e);
 }
 
-int
-nufs_readlink(const char *path, char* buf, size_t size)
+void
+nufs_readlink(fuse_req_t req, fuse_ino_t ino)
 {
-	int rv = storage_read(path, buf, size, 0);
-	int inum = tree_lookup(path);
-	inode* node = get_inode(inum);
+	struct stat st;
+	char* buf = NULL;
+
+	storage_op_begin();
+	int rv = storage_stat(ino, &st);
+	if (rv == 0) {
+		buf = calloc(1, st.st_size + 1);
+		rv = storage_read(ino, buf, st.st_size, 0);
+		rv = rv == st.st_size ? 0 : -EIO;
+	}
 
-	if (rv != node->size)
-		rv = -1;
+    storage_op_done();
+    printf("readlink(%ld) -> %d\n", ino, rv);
+	if (rv < 0)
+		fuse_reply_err(req, -rv);
 	else
-		rv = 0;
+		fuse_reply_readlink(req, buf);
 
-    printf("readlink(%s) -> %d\n", path, rv);
-	return rv;
+	free(buf);
 }
 
-int
-nufs_rmdir(const char *path)
+void
+nufs_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
-    int rv = storage_unlink(path);
-    printf("rmdir(%s) -> %d\n", path, rv);
-    return rv;
+    storage_op_begin();
+    int rv = storage_unlink(parent, name);
+    storage_op_done();
+    printf("rmdir(%ld, %s) -> %d\n", parent, name, rv);
+    fuse_reply_err(req, -rv);
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
-int
-nufs_rename(const char *from, const char *to)
+void
+nufs_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+            fuse_ino_t newparent, const char* newname)
 {
-    int rv = storage_rename(from, to);
-    printf("rename(%s => %s) -> %d\n", from, to, rv);
-    return rv;
+    storage_op_begin();
+    int rv = storage_rename(parent, name, newparent, newname);
+    storage_op_done();
+    printf("rename(%ld, %s => %ld, %s) -> %d\n", parent, name, newparent, newname, rv);
+    fuse_reply_err(req, -rv);
 }
 
-int
-nufs_chmod(const char *path, mode_t mode)
+// this is called on open; the only state kept for an open
+// file is its write buffer
+void
+nufs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    fi->fh = (uint64_t)(intptr_t)storage_open(ino);
+
+    // every change to a file's data comes through the kernel, or is
+    // invalidated, so what it has cached is still good
+    fi->keep_cache = mount_opts.ttl > 0;
+
+    printf("open(%ld) -> %d\n", ino, 0);
+    fuse_reply_open(req, fi);
+}
+
+// called once the last descriptor for an open is closed
+void
+nufs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    storage_file* file = nufs_file(fi);
+
+    storage_op_begin();
+    int rv = file ? storage_release(file) : 0;
+    storage_op_done();
+    printf("release(%ld) -> %d\n", ino, rv);
+    fuse_reply_err(req, -rv);
+}
+
+// Actually read data
+void
+nufs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    storage_file* file = nufs_file(fi);
+    char* buf = malloc(size);
+
+    // reads through an open file drive its readahead
+    storage_op_begin();
+    int rv = file ? storage_file_read(file, buf, size, offset)
+                  : storage_read(ino, buf, size, offset);
+    storage_op_done();
+    printf("read(%ld, %ld bytes, @+%ld) -> %d\n", ino, size, offset, rv);
+
+    if (rv < 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_buf(req, buf, rv);
+
+    free(buf);
+}
+
+// Actually write data
+void
+nufs_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t offset,
+           struct fuse_file_info* fi)
 {
     int rv = 0;
-	int inum = tree_lookup(path);
-	inode* node = get_inode(inum);
-	node->mode = mode;
-    printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
-    return rv;
+    storage_file* file = nufs_file(fi);
+
+    // small appends through an open file are buffered
+    if (file)
+        rv = storage_file_write(file, buf, size, offset);
+    else {
+        storage_op_begin();
+        rv = storage_write(ino, buf, size, offset);
+        storage_op_done();
+    }
+
+    printf("write(%ld, %ld bytes, @+%ld) -> %d\n", ino, size, offset, rv);
+    if (rv < 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_write(req, rv);
 }
 
-int
-nufs_truncate(const char *path, off_t size)
+// implements: man 2 fsync, man 2 fdatasync
+// how much this waits for depends on -o durability
+void
+nufs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
 {
-    int rv = storage_truncate(path, size);
-    printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
-    return rv;
+    storage_file* file = nufs_file(fi);
+
+    // beginning the op commits whatever the file had buffered
+    storage_op_begin();
+    int rv = file ? storage_file_error(file) : 0;
+    if (rv == 0)
+        rv = storage_fsync(ino, datasync);
+    storage_op_done();
+    printf("fsync(%ld, %d) -> %d\n", ino, datasync, rv);
+    fuse_reply_err(req, -rv);
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-int
-nufs_open(const char *path, struct fuse_file_info *fi)
+// called on every close of a file descriptor
+void
+nufs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-    int rv = nufs_access(path, 0);
-    printf("open(%s) -> %d\n", path, rv);
-    return rv;
+    storage_file* file = nufs_file(fi);
+
+    // commits the write buffer, and reports what went wrong with it; close
+    // doesn't imply fsync, so dirty pages stay with the flusher
+    storage_op_begin();
+    int rv = file ? storage_file_error(file) : 0;
+    storage_op_done();
+    printf("flush(%ld) -> %d\n", ino, rv);
+    fuse_reply_err(req, -rv);
 }
 
-// Actually read data
-int
-nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// implements: man 2 statfs; df and stat -f
+void
+nufs_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-    int rv = storage_read(path, buf, size, offset);
-    printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
-    return rv;
+    struct statvfs st;
+
+    storage_op_begin();
+    int rv = storage_statfs(&st);
+    storage_op_done();
+    printf("statfs(%ld) -> %d\n", ino, rv);
+
+    if (rv < 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_statfs(req, &st);
 }
 
-// Actually write data
-int
-nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Extended operations. lsattr and chattr +c/-c work through the file
+// flags, of which only FS_COMPR_FL means anything here; NUFS_IOC_CLONE
+// shares another file's pages instead of copying them (FICLONE never
+// gets here: the kernel turns it away itself for want of a
+// remap_file_range); NUFS_IOC_DEFRAG starts a defragmentation pass and
+// returns, and the TIER ioctls pin a file or directory in or out of the
+// hot tier. The kernel copies in what an ioctl's number says it reads,
+// and out what it says it writes.
+void
+nufs_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void* arg, struct fuse_file_info* fi,
+           unsigned flags, const void* in_buf, size_t in_bufsz, size_t out_bufsz)
 {
-    int rv = storage_write(path, buf, size, offset);
-    printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
-    return rv;
+    int rv = -ENOTTY; // not one of ours
+    unsigned long attrs = 0;
+    int tier = 0;
+    const void* out = NULL;
+    size_t out_size = 0;
+
+    if ((unsigned int)cmd == FS_IOC_GETFLAGS) {
+        storage_op_begin();
+        rv = storage_get_flags(ino);
+        storage_op_done();
+        if (rv >= 0) {
+            attrs = (rv & INODE_COMPRESS) ? FS_COMPR_FL : 0;
+            out = &attrs;
+            out_size = min(out_bufsz, sizeof(attrs));
+            rv = 0;
+        }
+    }
+    else if ((unsigned int)cmd == FS_IOC_SETFLAGS && in_bufsz >= sizeof(unsigned int)) {
+        unsigned int want = *(const unsigned int*)in_buf;
+
+        storage_op_begin();
+        rv = storage_get_flags(ino);
+        if (rv >= 0)
+            rv = storage_set_flags(ino, (rv & ~INODE_COMPRESS) | ((want & FS_COMPR_FL) ? INODE_COMPRESS : 0));
+        storage_op_done();
+    }
+    else if ((unsigned int)cmd == NUFS_IOC_CLONE && in_bufsz >= sizeof(nufs_clone)) {
+        const nufs_clone* clone = in_buf;
+        size_t len = clone->src_length ? clone->src_length : SIZE_MAX / 2;
+
+        storage_op_begin();
+        rv = clone->src_ino > INT_MAX ? -EBADF
+           : storage_clone_range(clone->src_ino, clone->src_offset, ino, clone->dest_offset, len);
+        storage_op_done();
+        rv = rv < 0 ? rv : 0;
+    }
+    else if ((unsigned int)cmd == NUFS_IOC_SNAPSHOT) {
+        storage_op_begin();
+        rv = storage_snapshot();
+        storage_op_done();
+    }
+    else if ((unsigned int)cmd == NUFS_IOC_SNAPSHOT_DROP) {
+        storage_op_begin();
+        rv = storage_drop_snapshot();
+        storage_op_done();
+    }
+    else if ((unsigned int)cmd == NUFS_IOC_GET_TIER) {
+        storage_op_begin();
+        rv = storage_get_flags(ino);
+        storage_op_done();
+        if (rv >= 0) {
+            tier = (rv & INODE_HOT) ? HOT_ALWAYS : (rv & INODE_COLD) ? HOT_NEVER : HOT_AUTO;
+            out = &tier;
+            out_size = sizeof(tier);
+            rv = 0;
+        }
+    }
+    else if ((unsigned int)cmd == NUFS_IOC_SET_TIER && in_bufsz >= sizeof(int)) {
+        tier = *(const int*)in_buf;
+        int want = tier == HOT_ALWAYS ? INODE_HOT : tier == HOT_NEVER ? INODE_COLD : 0;
+
+        rv = tier < HOT_AUTO || tier > HOT_NEVER ? -EINVAL : 0;
+        if (rv == 0) {
+            storage_op_begin();
+            rv = storage_get_flags(ino);
+            if (rv >= 0)
+                rv = storage_set_flags(ino, (rv & ~(INODE_HOT | INODE_COLD)) | want);
+            storage_op_done();
+        }
+    }
+    else if ((unsigned int)cmd == NUFS_IOC_DEFRAG) {
+        storage_op_begin();
+        rv = storage_defrag();
+        storage_op_done();
+    }
+
+    printf("ioctl(%ld, %d, ...) -> %d\n", ino, cmd, rv);
+    if (rv < 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_ioctl(req, 0, out, out_size);
+
+    // a clone changes the file's data behind the kernel's back
+    if (rv == 0 && (unsigned int)cmd == NUFS_IOC_CLONE)
+        nufs_invalidate(ino, NULL, 0);
 }
 
-// Update the timestamps on a file or directory.
-int
-nufs_utimens(const char* path, const struct timespec ts[2])
+// called once the filesystem is mounted, after we've daemonized
+void
+nufs_init(void* userdata, struct fuse_conn_info* conn)
 {
-    int rv = storage_set_time(path, ts);
-    printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
-           path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
-	return rv;
+    // writes come whole instead of a page at a time; max_readahead stays
+    // at what the kernel offers, which is as far as it'll go
+    if (conn->capable & FUSE_CAP_BIG_WRITES)
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    conn->max_write = NUFS_MAX_WRITE;
+
+    // mlocks aren't inherited by fork, so this waits until fuse_daemonize
+    // is done with
+    if (mount_opts.prefault) {
+        storage_op_begin();
+        storage_prefault();
+        storage_op_done();
+    }
+
+    storage_start_flusher();
+    storage_start_scrubber();
+    nufs_start_inval();
+    printf("init() -> max_write %u, max_readahead %u, ttl %d\n",
+           conn->max_write, conn->max_readahead, mount_opts.ttl);
 }
 
-// Extended operations
-int
-nufs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
-           unsigned int flags, void* data)
+// called on unmount
+void
+nufs_destroy(void* userdata)
 {
-    int rv = -1;
-    printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
-    return rv;
+    nufs_stop_inval();
+    storage_free();
+    printf("destroy()\n");
 }
 
 void
-nufs_init_ops(struct fuse_operations* ops)
+nufs_init_ops(struct fuse_lowlevel_ops* ops)
 {
-    memset(ops, 0, sizeof(struct fuse_operations));
-    ops->access   = nufs_access;
+    memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+    ops->lookup   = nufs_lookup;
+    ops->forget   = nufs_forget;
     ops->getattr  = nufs_getattr;
+    ops->setattr  = nufs_setattr;
     ops->readdir  = nufs_readdir;
     ops->mknod    = nufs_mknod;
     ops->mkdir    = nufs_mkdir;
@@ -271,24 +731,151 @@ nufs_init_ops(struct fuse_operations* ops)
 	ops->readlink = nufs_readlink;
     ops->rmdir    = nufs_rmdir;
     ops->rename   = nufs_rename;
-    ops->chmod    = nufs_chmod;
-    ops->truncate = nufs_truncate;
     ops->open	  = nufs_open;
+    ops->release  = nufs_release;
     ops->read     = nufs_read;
     ops->write    = nufs_write;
-    ops->utimens  = nufs_utimens;
+    ops->fsync    = nufs_fsync;
+    ops->fsyncdir = nufs_fsync;
+    ops->flush    = nufs_flush;
+    ops->statfs   = nufs_statfs;
     ops->ioctl    = nufs_ioctl;
+    ops->init     = nufs_init;
+    ops->destroy  = nufs_destroy;
+};
+
+struct fuse_lowlevel_ops nufs_ops;
+
+// nufs specific mount options, e.g. -o prefault,access=seq
+static const struct fuse_opt nufs_opt_spec[] = {
+	{ "prefault",     offsetof(nufs_opts, prefault),  1 },
+	{ "access=%s",    offsetof(nufs_opts, access),    0 },
+	{ "backend=%s",   offsetof(nufs_opts, backend),   0 },
+	{ "cache=%d",     offsetof(nufs_opts, cache),     0 },
+	{ "grow=%s",      offsetof(nufs_opts, grow),      0 },
+	{ "max_pages=%d", offsetof(nufs_opts, max_pages), 0 },
+	{ "window=%d",    offsetof(nufs_opts, window),    0 },
+	{ "windows=%d",   offsetof(nufs_opts, windows),   0 },
+	{ "journal=%d",   offsetof(nufs_opts, journal),   0 },
+	{ "journal_batch=%d", offsetof(nufs_opts, journal_batch), 0 },
+	{ "durability=%s", offsetof(nufs_opts, durability), 0 },
+	{ "commit=%d",    offsetof(nufs_opts, commit_ms), 0 },
+	{ "writeback=%d", offsetof(nufs_opts, writeback_ms), 0 },
+	{ "dirty_ratio=%d", offsetof(nufs_opts, dirty_ratio), 0 },
+	{ "dirty_expire=%d", offsetof(nufs_opts, dirty_expire), 0 },
+	{ "delalloc=%d",  offsetof(nufs_opts, delalloc),  0 },
+	{ "write_buffer=%d", offsetof(nufs_opts, write_buffer), 0 },
+	{ "readahead=%d", offsetof(nufs_opts, readahead), 0 },
+	{ "checksum=%s",  offsetof(nufs_opts, checksum),  0 },
+	{ "scrub=%d",     offsetof(nufs_opts, scrub),     0 },
+	{ "compress=%s",  offsetof(nufs_opts, compress),  0 },
+	{ "dedup=%d",     offsetof(nufs_opts, dedup),     0 },
+	{ "snapshot",     offsetof(nufs_opts, snapshot),  1 },
+	{ "tail=%d",      offsetof(nufs_opts, tail),      0 },
+	{ "group=%d",     offsetof(nufs_opts, group),     0 },
+	{ "defrag=%d",    offsetof(nufs_opts, defrag),    0 },
+	{ "hot=%d",       offsetof(nufs_opts, hot),       0 },
+	{ "ttl=%d",       offsetof(nufs_opts, ttl),       0 },
+	FUSE_OPT_END
 };
 
-struct fuse_operations nufs_ops;
+int
+nufs_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs)
+{
+	static int nonopts = 0;
+
+	// first non-option is the mount point, the second is the disk image
+	if (key == FUSE_OPT_KEY_NONOPT) {
+		nonopts += 1;
+		if (nonopts == 2) {
+			mount_opts.image = strdup(arg);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int
+nufs_tool(int argc, char *argv[])
+{
+	// nufs export IMAGE SINCE OUTFILE [snapshot]: the pages changed after
+	// generation SINCE (0 for all of them), of an unmounted image or of
+	// the snapshot of a mounted one. nufs apply IMAGE INFILE: puts them in
+	// a copy. They go through files because we log to stdout.
+	int rv = -EINVAL;
+
+	if (argc >= 5 && streq(argv[1], "export")) {
+		int snapshot = argc > 5 && streq(argv[5], "snapshot");
+		if (snapshot)
+			mount_opts.snapshot = 1;
+
+		int fd = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+			return -errno;
+
+		rv = cbt_export(argv[2], atoi(argv[3]), snapshot, fd);
+		if (fsync(fd) == -1 && rv >= 0)
+			rv = -errno;
+
+		close(fd);
+	}
+	else if (argc >= 4 && streq(argv[1], "apply")) {
+		int fd = open(argv[3], O_RDONLY);
+		if (fd == -1)
+			return -errno;
+
+		rv = cbt_apply(argv[2], fd);
+		close(fd);
+	}
+
+	return rv;
+}
 
 int
 main(int argc, char *argv[])
 {
-    assert(argc > 2 && argc < 6);
+	if (argc > 1 && (streq(argv[1], "export") || streq(argv[1], "apply"))) {
+		int rv = nufs_tool(argc, argv);
+		if (rv < 0) {
+			printf("%s %s: %s\n", argv[0], argv[1], strerror(-rv));
+			return 1;
+		}
+
+		// the generation, for the next export's SINCE
+		fprintf(stderr, "%d\n", rv);
+		return 0;
+	}
+
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+	int rv = fuse_opt_parse(&args, &mount_opts, nufs_opt_spec, nufs_opt_proc);
+	if (rv == -1 || !mount_opts.image) {
+		printf("usage: %s [options] mountpoint image\n", argv[0]);
+		printf("       %s export image since outfile [snapshot]\n", argv[0]);
+		printf("       %s apply image infile\n", argv[0]);
+		return -1;
+	}
+
+	if (globals_opts_check() == -1) {
+		fuse_opt_free_args(&args);
+		return -1;
+	}
+
+	// the kernel turns away anything that would change a snapshot
+	if (mount_opts.snapshot)
+		fuse_opt_add_arg(&args, "-oro");
+
+	char* mountpoint = NULL;
+	int multithreaded = 0;
+	int foreground = 0;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1 || !mountpoint) {
+		fuse_opt_free_args(&args);
+		return -1;
+	}
 
 	if (num_mounts == 0)
-    	storage_init(argv[--argc]);
+    	storage_init(mount_opts.image);
 
 	num_mounts += 1;
 
@@ -299,6 +886,30 @@ main(int argc, char *argv[])
 	}
 
     nufs_init_ops(&nufs_ops);
-    return fuse_main(argc, argv, &nufs_ops, NULL);
-}
 
+	// the session answers requests off the channel until it's unmounted
+	// or signalled; init and destroy are called from inside it
+	rv = -1;
+	struct fuse_chan* ch = fuse_mount(mountpoint, &args);
+	nufs_chan = ch;
+	if (ch) {
+		struct fuse_session* se = fuse_lowlevel_new(&args, &nufs_ops, sizeof(nufs_ops), NULL);
+		if (se && fuse_set_signal_handlers(se) != -1) {
+			fuse_session_add_chan(se, ch);
+			if (fuse_daemonize(foreground) != -1)
+				rv = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+
+		if (se)
+			fuse_session_destroy(se);
+
+		fuse_unmount(mountpoint, ch);
+	}
+
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return rv == -1 ? 1 : 0;
+}
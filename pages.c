@@ -10,35 +10,152 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <alloca.h>
+#include <sys/resource.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 
 #include "pages.h"
+#include "backend.h"
+#include "cache.h"
+#include "journal.h"
+#include "csum.h"
+#include "refs.h"
+#include "dedup.h"
+#include "snap.h"
+#include "cbt.h"
+#include "delalloc.h"
 #include "bitmap.h"
 #include "util.h"
 
 #include "globals.h"
 
 
-extern const int PAGE_COUNT;
+extern int PAGE_COUNT;
 extern const int PAGE_SIZE;
 extern const int NUFS_SIZE;
+extern const int BITMAP_SIZE;
 
 extern int   pages_fd;
 extern void* pages_base;
+extern backend* pages_backend;
+
+extern nufs_opts mount_opts;
+
+// fault counters at mount time, and number of mlocked pages
+static struct rusage pages_ru;
+static int pages_locked = 0;
+
+// madvise hint for the data region, reapplied when the image grows
+static int pages_advice = MADV_NORMAL;
+static int pages_huge = 0; // access=huge took
+
+// there's no free page below this one
+static int pages_low = 1;
+
+// pages clear in the bitmap, kept up to date by pages_bitmap_put
+static int pages_nfree = 0;
+
+// pages written since they last went out to disk, for the flusher
+static void* pages_dirty_bm = NULL;
+static int   pages_dirty_bits = 0;
+static int   pages_dirty_count = 0;
+static long  pages_dirty_since = 0; // now_ms() when the oldest was dirtied
+
+static long pages_ra_runs = 0;
+static long pages_ra_pages = 0;
+
+// where the scrubber picks up, and a buffer it reads pages into
+static int   pages_scrub_next = 0;
+static void* pages_scrub_buf = NULL;
+static long  pages_scrubbed = 0;
+static long  pages_scrub_bad = 0;
+
+static long pages_wb_rounds = 0;
+static long pages_wb_runs = 0;
+static long pages_wb_pages = 0;
+
+// allocation groups of -o group pages; an inode's pages go in the group
+// of its goal (see inode_goal) if there's room there
+static int* pages_group_free = NULL; // pages clear in the bitmap, by group
+static int* pages_group_low = NULL;  // no free page below this in the group
+static int  pages_group_rotor = 0;   // where the last spread out directory went
+static int  pages_goal = -1;         // a page in the group to try first
+
+static long pages_group_hits = 0;
+static long pages_group_spills = 0;
+
+// page 0 as an image from before the superblock had it, until
+// init_inode_gvars has moved the inodes the superblock now covers
+static void* pages_legacy = NULL;
+
+// a page list is a chain of index pages: PLIST_ENTRIES page numbers,
+// then the number of the next index page
+#define PLIST_ENTRIES ((int)(PAGE_SIZE / sizeof(int)) - 1)
+
+backend*
+backend_lookup(const char* name)
+{
+	backend* backends[] = {
+		&mmap_backend, &pread_backend, &direct_backend, &uring_backend,
+		&window_backend
+	};
+
+	for (int ii = 0; ii < sizeof(backends) / sizeof(backend*); ++ii) {
+		if (streq(name, backends[ii]->name))
+			return backends[ii];
+	}
+
+	return NULL;
+}
 
 void
 pages_init(const char* path)
 {
+	getrusage(RUSAGE_SELF, &pages_ru);
+
+	pages_backend = backend_lookup(mount_opts.backend);
+	if (!pages_backend) {
+		printf("pages_init: unknown backend '%s', using mmap\n", mount_opts.backend);
+		pages_backend = &mmap_backend;
+	}
+
+	// a grown image keeps its size
+	struct stat st;
+	PAGE_COUNT = NUFS_SIZE / PAGE_SIZE;
+	if (stat(path, &st) == 0 && st.st_size / PAGE_SIZE > PAGE_COUNT)
+		PAGE_COUNT = st.st_size / PAGE_SIZE;
+
+	// a snapshot is read through the cache, never through a mapping
+	if (mount_opts.snapshot && pages_backend->map)
+		pages_backend = &pread_backend;
+
 	// Initialize memory
-    pages_fd = open(path, O_CREAT | O_RDWR, 0644);
-    assert(pages_fd != -1);
+	int rv = pages_backend->open(path, PAGE_COUNT);
+	if (rv < 0) {
+		printf("pages_init: %s backend failed: %s\n", pages_backend->name, strerror(-rv));
+		assert(rv == 0);
+	}
 
-    int rv = ftruncate(pages_fd, NUFS_SIZE);
-    assert(rv == 0);
+	if (mount_opts.snapshot) {
+		pages_backend = snap_view(pages_backend);
+		assert(pages_backend);
+	}
 
-	// get start of memory region
-    pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
-    assert(pages_base != MAP_FAILED);
+	// sized for the largest the image can grow to
+	pages_dirty_bits = PAGE_COUNT > mount_opts.max_pages ? PAGE_COUNT : mount_opts.max_pages;
+	pages_dirty_bm = calloc(pages_dirty_bits / 8 + 2, 1);
+
+	// finish whatever metadata was committed before we went down; the
+	// journal of a snapshot's image is the live mount's
+	if (!mount_opts.snapshot)
+		journal_replay();
+
+	// backends that don't map the image go through the page cache
+	if (!pages_backend->map)
+		cache_init(mount_opts.cache);
 
 	// Reset Memory
 	//memset(pages_base, 0, NUFS_SIZE);
@@ -50,11 +167,155 @@ pages_init(const char* path)
 		return;
 	}
 
+	// inode_base points into page 0, so it can never be evicted
+	if (!pages_backend->map)
+		cache_set_sticky(0);
+
     // mark page 0 as taken
-    void* pbm = pages_base;
+    void* pbm = get_pages_bitmap();
 	bitmap_put(pbm, 0, 1);
+
+	superblock* sb = get_superblock();
+	if (sb->magic != NUFS_MAGIC) {
+		pages_legacy = malloc(PAGE_SIZE);
+		memcpy(pages_legacy, pages_get_page(0), PAGE_SIZE);
+
+		memset(sb, 0, sizeof(superblock));
+		sb->magic = NUFS_MAGIC;
+		sb->version = 1;
+		sb->page_count = PAGE_COUNT;
+		sb->inode_count = 0; // set by init_inode_gvars
+		sb->ilist = -1;
+		sb->journal = 0;
+		sb->journal_pages = 0;
+		sb->csum = 0;
+		sb->snap = 0;
+		sb->cbt = 0;
+		sb->gen = 0;
+	}
+	else if (sb->page_count > PAGE_COUNT) {
+		rv = pages_backend->resize(sb->page_count);
+		assert(rv == 0);
+		PAGE_COUNT = sb->page_count;
+	}
+	else {
+		sb->page_count = PAGE_COUNT;
+	}
+
+	pages_advise(mount_opts.access);
+
+	// sized for the largest the image can grow to
+	if (mount_opts.group > 0) {
+		int groups = (max(PAGE_COUNT, mount_opts.max_pages) + mount_opts.group - 1) / mount_opts.group;
+		pages_group_free = calloc(groups, sizeof(int));
+		pages_group_low = calloc(groups, sizeof(int));
+		for (int gg = 0; gg < groups; ++gg)
+			pages_group_low[gg] = max(1, gg * mount_opts.group);
+	}
+
+	pages_goal = -1;
+
+	for (int ii = 1; ii < PAGE_COUNT; ++ii) {
+		if (!pages_bitmap_get(ii)) {
+			pages_nfree += 1;
+			if (pages_group_free)
+				pages_group_free[ii / mount_opts.group] += 1;
+		}
+	}
+
+	csum_init();
+	journal_init();
+	cbt_init();
+	snap_init();
 }
 
+void
+pages_advise(const char* access)
+{
+	if (streq(access, "seq"))
+		pages_advice = MADV_SEQUENTIAL;
+	else if (streq(access, "random"))
+		pages_advice = MADV_RANDOM;
+	else if (streq(access, "huge")) {
+		// only tmpfs backs a shared file mapping with huge pages; on a
+		// disk filesystem madvise takes the hint and does nothing
+		struct statfs fs;
+		if (pages_backend->map && fstatfs(pages_fd, &fs) == 0 && fs.f_type == TMPFS_MAGIC) {
+			pages_advice = MADV_HUGEPAGE;
+			pages_huge = 1;
+		}
+		else
+			printf("pages_advise: huge pages need a mapped image on tmpfs\n");
+	}
+	else if (!streq(access, "normal"))
+		printf("pages_advise: unknown access hint '%s'\n", access);
+
+	// only the data region; page 0 is left to pages_prefault
+	pages_backend->advise(1, PAGE_COUNT - 1, pages_advice);
+}
+
+void
+pages_prefault(int pnum)
+{
+	if (pnum < 0 || pnum >= PAGE_COUNT)
+		return;
+
+	pages_backend->advise(pnum, 1, MADV_WILLNEED);
+	void* page = pages_get_page(pnum);
+
+	if (!pages_backend->map)
+		cache_set_sticky(pnum);
+
+	// mlock faults the page in; without CAP_IPC_LOCK it may hit RLIMIT_MEMLOCK
+	if (mlock(page, PAGE_SIZE) == -1) {
+		printf("pages_prefault(%d): mlock failed: %s\n", pnum, strerror(errno));
+		return;
+	}
+
+	pages_locked += 1;
+}
+
+static long
+pages_huge_kb()
+{
+	// how much of tmpfs is mapped in huge pages here, which is the image
+	FILE* smaps = fopen("/proc/self/smaps", "r");
+	if (!smaps)
+		return 0;
+
+	char line[256];
+	long total = 0;
+	long kb;
+	while (fgets(line, sizeof(line), smaps))
+		if (sscanf(line, "ShmemPmdMapped: %ld kB", &kb) == 1)
+			total += kb;
+
+	fclose(smaps);
+	return total;
+}
+
+void
+pages_print_stats()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("========PAGE STATS=======\n");
+	printf("backend     : %s\n", pages_backend->name);
+	printf("minor faults: %ld\n", ru.ru_minflt - pages_ru.ru_minflt);
+	printf("major faults: %ld\n", ru.ru_majflt - pages_ru.ru_majflt);
+	printf("locked pages: %d\n", pages_locked);
+	if (streq(mount_opts.access, "huge"))
+		printf("huge pages  : %s, %ld kB\n", pages_huge ? "on" : "off", pages_huge_kb());
+	printf("readahead   : %ld (%ld pages)\n", pages_ra_runs, pages_ra_pages);
+	printf("writebacks  : %ld (%ld runs, %ld pages)\n", pages_wb_rounds, pages_wb_runs, pages_wb_pages);
+	printf("scrubbed    : %ld (%ld bad)\n", pages_scrubbed, pages_scrub_bad);
+	if (pages_group_free)
+		printf("groups      : %d of %d pages, %ld in place, %ld spilled\n",
+		       (PAGE_COUNT + mount_opts.group - 1) / mount_opts.group, mount_opts.group,
+		       pages_group_hits, pages_group_spills);
+	printf("\n");
+}
 
 void
 pages_free()
@@ -65,12 +326,34 @@ pages_free()
 		return;
 	}
 
-    int rv = munmap(pages_base, NUFS_SIZE);
-    assert(rv == 0);
+	pages_print_stats();
+	journal_free();
+	cbt_free();
+	csum_free();
+	snap_free();
+
+	if (!pages_backend->map)
+		cache_free();
+
+	pages_backend->close();
+
+	free(pages_dirty_bm);
+	pages_dirty_bm = NULL;
+	pages_dirty_count = 0;
+
+	free(pages_scrub_buf);
+	pages_scrub_buf = NULL;
+
+	free(pages_group_free);
+	free(pages_group_low);
+	pages_group_free = NULL;
+	pages_group_low = NULL;
+
+	pages_drop_legacy();
 }
 
-void*
-pages_get_page(int pnum)
+static void*
+pages_get(int pnum, int verify)
 {
 	int err = globals_pinit_check();
 	if (err == -1) {
@@ -78,7 +361,333 @@ pages_get_page(int pnum)
 		return (void*)(-1);
 	}
 
-    return pages_base + PAGE_SIZE * pnum;
+	if (pnum < 0 || pnum >= PAGE_COUNT)
+		return NULL;
+
+	// a page is checked against its checksum as it comes in from disk
+	if (pages_backend->map) {
+		void* page = pages_backend->map(pnum);
+		if (verify)
+			csum_check_once(pnum, page);
+
+		return page;
+	}
+
+	// pinned until pages_put_page or the end of the op
+	int loaded = 0;
+	void* page = cache_get(pnum, &loaded);
+	if (loaded && verify)
+		csum_check(pnum, page);
+
+	return page;
+}
+
+void*
+pages_get_page(int pnum)
+{
+	// metadata the snapshot has is copied before it can change
+	snap_preserve(pnum);
+	return pages_get(pnum, 1);
+}
+
+void*
+pages_get_data(int pnum)
+{
+	// file contents; only checked with -o checksum=all
+	return pages_get(pnum, csum_verify_data());
+}
+
+void
+pages_put_page(int pnum)
+{
+	if (pnum < 0 || pnum >= PAGE_COUNT)
+		return;
+
+	if (!pages_backend->map)
+		cache_put(pnum);
+	else if (pages_backend->unmap)
+		pages_backend->unmap(pnum);
+}
+
+static void
+pages_track_dirty(int pnum)
+{
+	if (pnum >= pages_dirty_bits || bitmap_get(pages_dirty_bm, pnum))
+		return;
+
+	if (pages_dirty_count == 0)
+		pages_dirty_since = now_ms();
+
+	bitmap_put(pages_dirty_bm, pnum, 1);
+	pages_dirty_count += 1;
+}
+
+void
+pages_mark_dirty(int pnum)
+{
+	if (pnum < 0 || pnum >= PAGE_COUNT)
+		return;
+
+	if (!pages_backend->map)
+		cache_mark_dirty(pnum);
+
+	pages_track_dirty(pnum);
+	cbt_mark(pnum);
+
+	// metadata goes through the journal before it goes home
+	journal_touch(pnum);
+}
+
+void
+pages_mark_data(int pnum)
+{
+	// file contents aren't journaled
+	if (pnum < 0 || pnum >= PAGE_COUNT)
+		return;
+
+	if (!pages_backend->map)
+		cache_mark_dirty(pnum);
+
+	pages_track_dirty(pnum);
+	cbt_mark(pnum);
+}
+
+int
+pages_flush(int writeback)
+{
+	// page 0 is the bitmap and inode table, which nearly every op touches
+	pages_mark_dirty(0);
+
+	journal_op_done();
+
+	// otherwise dirty cache pages wait for the flusher or eviction
+	if (pages_backend->map || !writeback)
+		return 0;
+
+	return cache_flush();
+}
+
+int
+pages_dirty_percent()
+{
+	// of what the backend keeps in memory: the cache, or the whole image
+	int resident = pages_backend->map ? PAGE_COUNT : mount_opts.cache;
+	return resident > 0 ? (int)(100L * pages_dirty_count / resident) : 0;
+}
+
+long
+pages_dirty_age()
+{
+	return pages_dirty_count > 0 ? now_ms() - pages_dirty_since : 0;
+}
+
+static int
+pages_dirty_take(int** runs)
+{
+	// pages held for the journal are still only in the cache; they stay
+	int nruns = 0;
+	int cap = 0;
+	int kept = 0;
+
+	for (int byte = 0; byte <= pages_dirty_bits / 8 && pages_dirty_count > kept; ++byte) {
+		if (((unsigned char*)pages_dirty_bm)[byte] == 0)
+			continue;
+
+		for (int pnum = byte * 8; pnum < byte * 8 + 8 && pnum < pages_dirty_bits; ++pnum) {
+			if (!bitmap_get(pages_dirty_bm, pnum))
+				continue;
+
+			if (!pages_backend->map && cache_is_dirty(pnum)) {
+				kept += 1;
+				continue;
+			}
+
+			bitmap_put(pages_dirty_bm, pnum, 0);
+			pages_dirty_count -= 1;
+
+			// the cache sums pages as it writes them; mapped pages are
+			// summed here, as they're going out
+			if (pages_backend->map && csum_enabled()) {
+				csum_update(pnum, pages_backend->map(pnum));
+				pages_put_page(pnum);
+			}
+
+			if (!runs)
+				continue;
+
+			// runs are (first page, count) pairs, in page order
+			if (nruns > 0 && (*runs)[2 * nruns - 2] + (*runs)[2 * nruns - 1] == pnum) {
+				(*runs)[2 * nruns - 1] += 1;
+				continue;
+			}
+
+			if (nruns == cap) {
+				cap = cap ? 2 * cap : 64;
+				*runs = realloc(*runs, 2 * cap * sizeof(int));
+			}
+
+			(*runs)[2 * nruns] = pnum;
+			(*runs)[2 * nruns + 1] = 1;
+			nruns += 1;
+		}
+	}
+
+	if (pages_dirty_count > 0)
+		pages_dirty_since = now_ms();
+
+	return nruns;
+}
+
+int
+pages_writeback_collect(int** runs)
+{
+	// the cache writes its dirty pages to the kernel in one sorted batch;
+	// then they, and pages dirtied through a mapping, only need to go out
+	*runs = NULL;
+	if (!pages_backend->map)
+		cache_flush();
+
+	return pages_dirty_take(runs);
+}
+
+int
+pages_writeback_runs(const int* runs, int count)
+{
+	// no storage_lock here; the backend only starts the i/o on its file
+	for (int ii = 0; ii < count; ++ii) {
+		int rv = pages_backend->writeback(runs[2 * ii], runs[2 * ii + 1]);
+		if (rv < 0) {
+			printf("pages_writeback_runs: %s\n", strerror(-rv));
+			return rv;
+		}
+
+		pages_wb_runs += 1;
+		pages_wb_pages += runs[2 * ii + 1];
+	}
+
+	pages_wb_rounds += 1;
+	return 0;
+}
+
+static int
+pnum_cmp(const void* aa, const void* bb)
+{
+	return *(int*)aa - *(int*)bb;
+}
+
+int
+pages_sync_list(int* pnums, int count)
+{
+	// dirty pages in the cache haven't reached the backend yet, and once
+	// they have, one sync of the file is as cheap as it gets
+	if (!pages_backend->map) {
+		cache_flush();
+		return count > 0 ? pages_backend->sync() : 0;
+	}
+
+	// mapped pages sync by range, a run of neighbouring pages at a time
+	qsort(pnums, count, sizeof(int), pnum_cmp);
+
+	int ii = 0;
+	while (ii < count) {
+		int run = 1;
+		while (ii + run < count && pnums[ii + run] == pnums[ii] + run)
+			run += 1;
+
+		if (pnums[ii] >= 0 && pnums[ii] + run <= PAGE_COUNT) {
+			int rv = pages_backend->sync_range(pnums[ii], run);
+			if (rv < 0)
+				return rv;
+		}
+
+		ii += run;
+	}
+
+	return 0;
+}
+
+void
+pages_readahead(const int* pnums, int count)
+{
+	// pnums are in file order; each run of neighbouring pages is one
+	// hint, and the backend starts reading it in without waiting
+	int ii = 0;
+	while (ii < count) {
+		int run = 1;
+		while (ii + run < count && pnums[ii + run] == pnums[ii] + run)
+			run += 1;
+
+		if (pnums[ii] > 0 && pnums[ii] + run <= PAGE_COUNT) {
+			pages_backend->advise(pnums[ii], run, MADV_WILLNEED);
+			pages_ra_runs += 1;
+			pages_ra_pages += run;
+		}
+
+		ii += run;
+	}
+}
+
+int
+pages_sync_all()
+{
+	// data first, so committed metadata never points at pages not yet written
+	if (!pages_backend->map)
+		cache_flush();
+
+	int rv = pages_backend->sync();
+	if (rv < 0)
+		return rv;
+
+	// everything the flusher was waiting on is on disk now
+	pages_dirty_take(NULL);
+
+	return journal_commit();
+}
+
+int
+pages_scrub(int count)
+{
+	// checks the next count pages in the image against their checksums,
+	// as they are on disk; returns how many were bad
+	if (!csum_enabled())
+		return 0;
+
+	if (!pages_scrub_buf) {
+		int rv = posix_memalign(&pages_scrub_buf, PAGE_SIZE, PAGE_SIZE);
+		assert(rv == 0);
+	}
+
+	int bad = 0;
+	for (int ii = 0; ii < count; ++ii) {
+		int pnum = pages_scrub_next;
+		pages_scrub_next = (pnum + 1) % PAGE_COUNT;
+
+		if (pnum > 0 && !pages_bitmap_get(pnum))
+			continue;
+
+		// written through a mapping since it was last summed
+		if (pnum < pages_dirty_bits && bitmap_get(pages_dirty_bm, pnum))
+			continue;
+
+		if (pages_backend->read(pnum, pages_scrub_buf) < 0)
+			continue;
+
+		pages_scrubbed += 1;
+		if (csum_check(pnum, pages_scrub_buf) < 0)
+			bad += 1;
+	}
+
+	pages_scrub_bad += bad;
+	return bad;
+}
+
+void
+pages_release()
+{
+	if (!pages_backend->map)
+		cache_release();
+	else if (pages_backend->release)
+		pages_backend->release();
 }
 
 void*
@@ -87,26 +696,553 @@ get_pages_bitmap()
 	return pages_get_page(0);
 }
 
+void*
+pages_get_legacy()
+{
+	return pages_legacy;
+}
+
+void
+pages_drop_legacy()
+{
+	free(pages_legacy);
+	pages_legacy = NULL;
+}
+
+superblock*
+get_superblock()
+{
+	return (superblock*)(pages_get_page(0) + PAGE_SIZE - sizeof(superblock));
+}
+
+// Page 0 has the bits for the first BITMAP_SIZE * 8 pages. Past those,
+// the first page of every run of PAGE_SIZE * 8 pages is that run's bitmap.
+int
+pages_bitmap_page(int pnum, int* bit)
+{
+	int base = BITMAP_SIZE * 8;
+	int per = PAGE_SIZE * 8;
+
+	if (pnum < base) {
+		*bit = pnum;
+		return 0;
+	}
+
+	*bit = (pnum - base) % per;
+	return base + ((pnum - base) / per) * per;
+}
+
+int
+pages_bitmap_get(int pnum)
+{
+	int bit;
+	int bpnum = pages_bitmap_page(pnum, &bit);
+
+	int vv = bitmap_get(pages_get_page(bpnum), bit);
+	pages_put_page(bpnum);
+	return vv;
+}
+
+void
+pages_bitmap_put(int pnum, int vv)
+{
+	int bit;
+	int bpnum = pages_bitmap_page(pnum, &bit);
+
+	void* bm = pages_get_page(bpnum);
+	if (bitmap_get(bm, bit) != vv) {
+		pages_nfree += vv ? -1 : 1;
+
+		if (pages_group_free) {
+			int gg = pnum / mount_opts.group;
+			pages_group_free[gg] += vv ? -1 : 1;
+			if (!vv && pnum < pages_group_low[gg])
+				pages_group_low[gg] = pnum;
+		}
+	}
+
+	bitmap_put(bm, bit, vv);
+	pages_mark_dirty(bpnum);
+	pages_put_page(bpnum);
+}
+
+int
+pages_free_count()
+{
+	return pages_nfree;
+}
+
+int
+pages_grow()
+{
+	int old = PAGE_COUNT;
+	int count = PAGE_COUNT;
+
+	if (streq(mount_opts.grow, "off"))
+		return -1;
+	else if (streq(mount_opts.grow, "double"))
+		count = 2 * PAGE_COUNT;
+	else // a page count; globals_opts_check turned away anything else
+		count = PAGE_COUNT + atoi(mount_opts.grow);
+
+	if (count > mount_opts.max_pages)
+		count = mount_opts.max_pages;
+
+	if (count <= PAGE_COUNT) {
+		printf("pages_grow: image is at max_pages (%d)\n", PAGE_COUNT);
+		return -1;
+	}
+
+	int rv = pages_backend->resize(count);
+	if (rv < 0) {
+		printf("pages_grow: resize to %d pages failed: %s\n", count, strerror(-rv));
+		return -1;
+	}
+
+	PAGE_COUNT = count;
+	get_superblock()->page_count = count;
+	pages_nfree += count - old;
+
+	for (int pnum = old; pnum < count && pages_group_free; ++pnum)
+		pages_group_free[pnum / mount_opts.group] += 1;
+
+	// every new run past page 0's bitmap begins with its own bitmap page
+	int base = BITMAP_SIZE * 8;
+	int per = PAGE_SIZE * 8;
+	int bpnum = base;
+	if (old > base)
+		bpnum = base + ((old - base + per - 1) / per) * per;
+
+	for (; bpnum < count; bpnum += per) {
+		void* bm = pages_get_page(bpnum);
+		memset(bm, 0, PAGE_SIZE);
+		bitmap_put(bm, 0, 1);
+		pages_mark_dirty(bpnum);
+		pages_nfree -= 1;
+
+		if (pages_group_free)
+			pages_group_free[bpnum / mount_opts.group] -= 1;
+	}
+
+	pages_backend->advise(old, count - old, pages_advice);
+
+	printf("+ pages_grow() %d -> %d pages\n", old, count);
+	return 0;
+}
+
+void
+pages_set_goal(int pnum)
+{
+	// -1 for lowest free first
+	pages_goal = pnum;
+}
+
+int
+pages_in_goal(int pnum)
+{
+	// in the goal's group, or there's no goal to be in
+	if (!pages_group_free || pages_goal < 0)
+		return 1;
+
+	return pnum / mount_opts.group == pages_goal / mount_opts.group;
+}
+
+int
+pages_pick_group(int near)
+{
+	// Orlov, more or less, for a new directory: it goes in its parent's
+	// group (near's) while that has a quarter of its pages free. A
+	// top-level directory (near is -1), or one whose parent's group is
+	// filling up, goes in the group with the most free pages, the next
+	// one round on a tie so they spread out. Returns the group's first
+	// page, -1 without groups.
+	if (!pages_group_free)
+		return -1;
+
+	int size = mount_opts.group;
+	int groups = (PAGE_COUNT + size - 1) / size;
+
+	if (near >= 0 && near / size < groups && pages_group_free[near / size] >= size / 4)
+		return (near / size) * size;
+
+	int best = -1;
+	for (int nn = 1; nn <= groups; ++nn) {
+		int gg = (pages_group_rotor + nn) % groups;
+		if (best == -1 || pages_group_free[gg] > pages_group_free[best])
+			best = gg;
+	}
+
+	pages_group_rotor = best;
+	return best * size;
+}
+
+static int
+pages_alloc_near()
+{
+	// the goal's group first, then the ones after it; -1 leaves it to
+	// alloc_page, which checkpoints the journal or grows the image
+	int size = mount_opts.group;
+	int groups = (PAGE_COUNT + size - 1) / size;
+	int first = pages_goal / size;
+
+	for (int nn = 0; nn < groups; ++nn) {
+		int gg = (first + nn) % groups;
+		if (pages_group_free[gg] == 0)
+			continue;
+
+		int end = min((gg + 1) * size, PAGE_COUNT);
+		int skipped = -1;
+
+		for (int ii = pages_group_low[gg]; ii < end; ++ii) {
+			if (pages_bitmap_get(ii))
+				continue;
+
+			if (journal_pending(ii)) {
+				if (skipped == -1)
+					skipped = ii;
+				continue;
+			}
+
+			pages_bitmap_put(ii, 1);
+			pages_group_low[gg] = skipped == -1 ? ii + 1 : skipped;
+
+			if (nn == 0)
+				pages_group_hits += 1;
+			else
+				pages_group_spills += 1;
+
+			printf("+ alloc_page() -> %d, group %d\n", ii, gg);
+			return ii;
+		}
+
+		pages_group_low[gg] = skipped == -1 ? end : skipped;
+	}
+
+	return -1;
+}
+
+static int
+pages_keep_reserved(int count)
+{
+	// the pages delalloc has promised to buffered writes aren't ours to
+	// hand out; grow the image rather than take one
+	while (pages_nfree - delalloc_pending() < count) {
+		if (pages_grow() == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
 int
 alloc_page()
 {
-	void* pbm = get_pages_bitmap();
+	int checkpointed = 0;
 
-	for (int ii = 1; ii < PAGE_COUNT; ++ii) {
-		if (!bitmap_get(pbm, ii)) {
-			bitmap_put(pbm, ii, 1);
+	if (pages_keep_reserved(1) == -1)
+		return -1;
+
+	if (pages_group_free && pages_goal >= 0) {
+		int pnum = pages_alloc_near();
+		if (pnum != -1)
+			return pnum;
+	}
+
+	while (1) {
+		// freed metadata whose old image is still in the journal is skipped;
+		// replay could write that image over whatever the page holds next
+		int skipped = -1;
+
+		for (int ii = pages_low; ii < PAGE_COUNT; ++ii) {
+			if (pages_bitmap_get(ii))
+				continue;
+
+			if (journal_pending(ii)) {
+				if (skipped == -1)
+					skipped = ii;
+				continue;
+			}
+
+			pages_bitmap_put(ii, 1);
+			pages_low = skipped == -1 ? ii + 1 : skipped;
 			printf("+ alloc_page() -> %d\n", ii);
 			return ii;
 		}
+
+		pages_low = skipped == -1 ? PAGE_COUNT : skipped;
+
+		// a checkpoint frees up everything that's only held by old transactions
+		if (skipped != -1 && !checkpointed) {
+			journal_checkpoint();
+			checkpointed = 1;
+			continue;
+		}
+
+		// out of pages; grow the image and look again past the old end
+		if (pages_grow() == -1)
+			return -1;
 	}
+}
 
-	return -1;
+static int
+pages_find_run(int from, int to, int want, int* len_out, int* first_free)
+{
+	// the first free run of want pages in [from, to), or failing that the
+	// longest one; pages still in the journal are skipped, as in alloc_page
+	int best = -1;
+	int best_len = 0;
+	int start = -1;
+	int len = 0;
+	*first_free = -1;
+
+	for (int ii = from; ii < to && best_len < want; ++ii) {
+		int used = pages_bitmap_get(ii);
+		if (!used && *first_free == -1)
+			*first_free = ii;
+
+		if (used || journal_pending(ii)) {
+			len = 0;
+			continue;
+		}
+
+		if (len == 0)
+			start = ii;
+
+		len += 1;
+		if (len > best_len) {
+			best = start;
+			best_len = len;
+		}
+	}
+
+	*len_out = best_len;
+	return best;
+}
+
+int
+pages_alloc_extent(int want, int* got)
+{
+	// in the goal's group if it has room, else anywhere
+	int best = -1;
+	int best_len = 0;
+	int first_free = -1;
+
+	if (pages_group_free && pages_goal >= 0 && pages_goal < PAGE_COUNT) {
+		int gg = pages_goal / mount_opts.group;
+		int end = min((gg + 1) * mount_opts.group, PAGE_COUNT);
+
+		best = pages_find_run(pages_group_low[gg], end, want, &best_len, &first_free);
+		if (best_len > 0) {
+			pages_group_low[gg] = first_free == best ? best + best_len : first_free;
+			pages_group_hits += 1;
+			goto extent_found;
+		}
+	}
+
+	best = pages_find_run(pages_low, PAGE_COUNT, want, &best_len, &first_free);
+	if (best_len == 0) {
+		// alloc_page knows to checkpoint the journal or grow the image
+		int pnum = alloc_page();
+		*got = pnum == -1 ? 0 : 1;
+		return pnum;
+	}
+
+	pages_low = first_free == best ? best + best_len : first_free;
+
+extent_found:
+	for (int ii = best; ii < best + best_len; ++ii)
+		pages_bitmap_put(ii, 1);
+
+	*got = best_len;
+	printf("+ pages_alloc_extent(%d) -> %d x %d\n", want, best, best_len);
+	return best;
+}
+
+int
+pages_alloc_run(int count)
+{
+	while (1) {
+		int run = 0;
+		for (int ii = 1; ii < PAGE_COUNT; ++ii) {
+			if (pages_bitmap_get(ii)) {
+				run = 0;
+				continue;
+			}
+
+			run += 1;
+			if (run == count) {
+				int first = ii - count + 1;
+				for (int jj = first; jj <= ii; ++jj)
+					pages_bitmap_put(jj, 1);
+
+				printf("+ pages_alloc_run(%d) -> %d\n", count, first);
+				return first;
+			}
+		}
+
+		if (pages_grow() == -1)
+			return -1;
+	}
+}
+
+int
+pages_alloc_fit(int want, int from, int to)
+{
+	// the first free run of want pages in [from, to), or -1; the image
+	// isn't grown for it, nor are delalloc's pages taken
+	if (pages_nfree - delalloc_pending() < want)
+		return -1;
+
+	int len;
+	int first_free;
+	int first = pages_find_run(max(from, 1), min(to, PAGE_COUNT), want, &len, &first_free);
+	if (len < want)
+		return -1;
+
+	for (int ii = first; ii < first + want; ++ii)
+		pages_bitmap_put(ii, 1);
+
+	printf("+ pages_alloc_fit(%d, %d, %d) -> %d\n", want, from, to, first);
+	return first;
+}
+
+void
+pages_claim(int pnum)
+{
+	// something in the image points at it, whatever the bitmap says
+	if (pnum > 0 && pnum < PAGE_COUNT && !pages_bitmap_get(pnum))
+		pages_bitmap_put(pnum, 1);
 }
 
 void
 free_page(int pnum)
 {
 	printf("+ free_page(%d)\n", pnum);
-	void* pbm = get_pages_bitmap();
-	bitmap_put(pbm, pnum, 0);
+
+	if (pnum <= 0 || pnum >= PAGE_COUNT)
+		return;
+
+	// still someone else's
+	if (refs_put(pnum) > 0)
+		return;
+
+	// or the snapshot's; nothing new may share it
+	if (snap_hold(pnum)) {
+		dedup_forget(pnum);
+		return;
+	}
+
+	pages_bitmap_put(pnum, 0);
+	csum_forget(pnum);
+	dedup_forget(pnum);
+
+	if (pnum < pages_low)
+		pages_low = pnum;
+}
+
+static int
+pages_list_new()
+{
+	int pnum = alloc_page();
+	if (pnum == -1)
+		return -1;
+
+	// every entry, including the next link, starts out as -1
+	memset(pages_get_page(pnum), 0xff, PAGE_SIZE);
+	pages_mark_dirty(pnum);
+	pages_put_page(pnum);
+	return pnum;
+}
+
+int
+pages_list_get(int head, int idx)
+{
+	int ipnum = head;
+
+	while (ipnum != -1 && idx >= PLIST_ENTRIES) {
+		int* ents = (int*)pages_get_page(ipnum);
+		int next = ents[PLIST_ENTRIES];
+		pages_put_page(ipnum);
+
+		ipnum = next;
+		idx -= PLIST_ENTRIES;
+	}
+
+	if (ipnum == -1)
+		return -1;
+
+	int* ents = (int*)pages_get_page(ipnum);
+	int pnum = ents[idx];
+	pages_put_page(ipnum);
+	return pnum;
+}
+
+int
+pages_list_append(int* head, int count, int pnum)
+{
+	// count is the number of entries already in the list
+	if (*head == -1) {
+		*head = pages_list_new();
+		if (*head == -1)
+			return -1;
+	}
+
+	int ipnum = *head;
+	int* ents = (int*)pages_get_page(ipnum);
+
+	while (count >= PLIST_ENTRIES) {
+		if (ents[PLIST_ENTRIES] == -1) {
+			int next = pages_list_new();
+			if (next == -1) {
+				pages_put_page(ipnum);
+				return -1;
+			}
+
+			ents[PLIST_ENTRIES] = next;
+			pages_mark_dirty(ipnum);
+		}
+
+		// done with this index page once we have the next one's number
+		int next = ents[PLIST_ENTRIES];
+		pages_put_page(ipnum);
+
+		ipnum = next;
+		ents = (int*)pages_get_page(ipnum);
+		count -= PLIST_ENTRIES;
+	}
+
+	ents[count] = pnum;
+	pages_mark_dirty(ipnum);
+	pages_put_page(ipnum);
+	return 0;
+}
+
+int
+pages_list_load(backend* disk, int head, int* pnums, int max)
+{
+	// reads up to max entries straight from disk, for when the image
+	// isn't mounted; returns how many there were
+	void* buf = NULL;
+	int rv = posix_memalign(&buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+
+	int count = 0;
+	int ipnum = head;
+	while (ipnum > 0 && ipnum < PAGE_COUNT && count < max) {
+		if (disk->read(ipnum, buf) < 0)
+			break;
+
+		int* ents = (int*)buf;
+		int ii = 0;
+		while (ii < PLIST_ENTRIES && ents[ii] != -1 && count < max)
+			pnums[count++] = ents[ii++];
+
+		if (ii < PLIST_ENTRIES)
+			break;
+
+		ipnum = ents[PLIST_ENTRIES];
+	}
+
+	free(buf);
+	return count;
 }
@@ -3,11 +3,64 @@
 
 #include <stdio.h>
 
+#include "backend.h"
+
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+
+// Kept in the last bytes of page 0, after the page bitmap and inode table.
+typedef struct superblock {
+	int magic;
+	int version;
+	int page_count;  // pages in the image
+	int inode_count; // inodes in page 0 plus the extension pages
+	int ilist;       // page list of extension inode pages, -1 if none
+	int journal;     // first page of the journal, 0 if none
+	int journal_pages;
+	int csum;        // page list of the checksum table, 0 if none
+	int snap;        // header page of the snapshot, 0 if none
+	int cbt;         // page list of the changed page table, 0 if none
+	int gen;         // generation changes are stamped with
+	int reserved[21];
+} superblock;
+
 void pages_init(const char* path);
 void pages_free();
+void pages_advise(const char* access);
+void pages_prefault(int pnum);
+void pages_print_stats();
 void* pages_get_page(int pnum);
+void* pages_get_data(int pnum);
+void pages_put_page(int pnum);
+void pages_mark_dirty(int pnum);
+void pages_mark_data(int pnum);
+int pages_flush(int writeback);
+int pages_dirty_percent();
+long pages_dirty_age();
+int pages_writeback_collect(int** runs);
+int pages_writeback_runs(const int* runs, int count);
+int pages_sync_list(int* pnums, int count);
+int pages_sync_all();
+void pages_readahead(const int* pnums, int count);
+int pages_scrub(int count);
+void pages_release();
 void* get_pages_bitmap();
+int pages_bitmap_get(int pnum);
+superblock* get_superblock();
+void* pages_get_legacy();
+void pages_drop_legacy();
+int pages_grow();
+void pages_set_goal(int pnum);
+int pages_in_goal(int pnum);
+int pages_pick_group(int near);
 int alloc_page();
+int pages_alloc_extent(int want, int* got);
+int pages_alloc_run(int count);
+int pages_alloc_fit(int want, int from, int to);
+int pages_free_count();
+void pages_claim(int pnum);
 void free_page(int pnum);
+int pages_list_get(int head, int idx);
+int pages_list_append(int* head, int count, int pnum);
+int pages_list_load(backend* disk, int head, int* pnums, int max);
 
 #endif
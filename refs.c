@@ -0,0 +1,143 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "refs.h"
+#include "inode.h"
+#include "util.h"
+
+#include "globals.h"
+
+extern int INODE_COUNT;
+
+#define REFS_BUCKETS 4096
+
+typedef struct ref_entry {
+	int pnum;
+	int refs; // owners past the first
+	struct ref_entry* next;
+} ref_entry;
+
+static ref_entry** refs_table = NULL;
+static int refs_pages = 0;
+
+static long refs_added = 0;
+static long refs_dropped = 0;
+
+static ref_entry**
+refs_find(int pnum)
+{
+	ref_entry** pp = &refs_table[(unsigned)pnum % REFS_BUCKETS];
+	while (*pp && (*pp)->pnum != pnum)
+		pp = &(*pp)->next;
+
+	return pp;
+}
+
+void
+refs_init()
+{
+	refs_table = calloc(REFS_BUCKETS, sizeof(ref_entry*));
+	refs_pages = 0;
+
+	// every pointer past a page's first is a reference; the stream
+	// pages of compressed clusters are pointers like any other
+	for (int inum = 1; inum < INODE_COUNT; ++inum) {
+		inode* node = peek_inode(inum);
+		if (node->mode == 0)
+			continue;
+
+		for (int fpn = 0; fpn < bytes_to_pages(node->size); ++fpn) {
+			int pnum = inode_get_pnum(node, fpn);
+			if (pnum > 0)
+				refs_get(pnum);
+		}
+	}
+
+	// that counted each page's first owner too
+	for (int bb = 0; bb < REFS_BUCKETS; ++bb) {
+		ref_entry** pp = &refs_table[bb];
+		while (*pp) {
+			ref_entry* ee = *pp;
+			ee->refs -= 1;
+			if (ee->refs == 0) {
+				*pp = ee->next;
+				free(ee);
+				refs_pages -= 1;
+			}
+			else {
+				pp = &ee->next;
+			}
+		}
+	}
+
+	refs_added = 0;
+	printf("+ refs_init() -> %d shared pages\n", refs_pages);
+}
+
+void
+refs_free()
+{
+	printf("=======REFS STATS========\n");
+	printf("shared      : %d pages\n", refs_pages);
+	printf("added       : %ld\n", refs_added);
+	printf("dropped     : %ld\n", refs_dropped);
+	printf("\n");
+
+	for (int bb = 0; bb < REFS_BUCKETS; ++bb) {
+		while (refs_table[bb]) {
+			ref_entry* ee = refs_table[bb];
+			refs_table[bb] = ee->next;
+			free(ee);
+		}
+	}
+
+	free(refs_table);
+	refs_table = NULL;
+}
+
+void
+refs_get(int pnum)
+{
+	// one more pointer to a page already in use
+	ref_entry** pp = refs_find(pnum);
+	if (!*pp) {
+		*pp = calloc(1, sizeof(ref_entry));
+		(*pp)->pnum = pnum;
+		refs_pages += 1;
+	}
+
+	(*pp)->refs += 1;
+	refs_added += 1;
+}
+
+int
+refs_put(int pnum)
+{
+	// drops a pointer; returns the owners left, 0 if the page is free now
+	if (!refs_table)
+		return 0;
+
+	ref_entry** pp = refs_find(pnum);
+	if (!*pp)
+		return 0;
+
+	ref_entry* ee = *pp;
+	ee->refs -= 1;
+	refs_dropped += 1;
+
+	int left = ee->refs + 1;
+	if (ee->refs == 0) {
+		*pp = ee->next;
+		free(ee);
+		refs_pages -= 1;
+	}
+
+	return left;
+}
+
+int
+refs_shared(int pnum)
+{
+	return refs_table && pnum > 0 && *refs_find(pnum) != NULL;
+}
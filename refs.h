@@ -0,0 +1,15 @@
+#ifndef REFS_H
+#define REFS_H
+
+// Reference counts of pages shared by more than one block pointer. Most
+// pages have one owner and no entry; the page bitmap says they're in use
+// and free_page lets them go. A shared page is only freed once its last
+// owner drops it, and is copied before it's written (see storage_write).
+// The counts aren't saved: they're taken from the inodes at mount.
+void refs_init();
+void refs_free();
+void refs_get(int pnum);
+int  refs_put(int pnum);
+int  refs_shared(int pnum);
+
+#endif
@@ -1,15 +1,14 @@
 #ifndef SLIST_H
 #define SLIST_H
 
+// Lists live in the request's arena (see arena.h); they're gone once the
+// request is done, and are never freed on their own.
 typedef struct slist {
     char* data;
-    int   refs;
     struct slist* next;
 } slist;
 
 slist* s_cons(const char* text, slist* rest);
-void   s_free(slist* xs);
 slist* s_split(const char* text, char delim);
 
 #endif
-
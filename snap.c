@@ -0,0 +1,579 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "snap.h"
+#include "pages.h"
+#include "backend.h"
+#include "bitmap.h"
+#include "csum.h"
+#include "journal.h"
+#include "util.h"
+
+#include "globals.h"
+
+extern int PAGE_COUNT;
+extern const int PAGE_SIZE;
+
+extern backend* pages_backend;
+
+extern nufs_opts mount_opts;
+
+// (page, copy) pairs in a pair page
+#define SNAP_PAIRS ((int)(PAGE_SIZE / (2 * sizeof(int))))
+
+// page numbers the header has room for
+#define SNAP_LIST ((int)((PAGE_SIZE - sizeof(snap_header)) / sizeof(int)))
+
+static int   snap_head = 0; // header page, 0 if there's no snapshot
+static int   snap_live = 0; // frozen pages are being copied and held
+static int   snap_pages = 0;
+static int   snap_bm_pages = 0;
+static void* snap_frozen_bm = NULL;
+static void* snap_held_bm = NULL;
+static int*  snap_copy = NULL; // each frozen page's copy, 0 for none yet
+static int   snap_copies = 0;
+static long  snap_taken = 0;
+
+// the disk under a snapshot mount, and pages read around the cache
+static backend* snap_disk = NULL;
+static void*    snap_buf = NULL;
+static void*    snap_pair_buf = NULL;
+
+static long snap_copied = 0;
+static long snap_held = 0;
+static long snap_refreshes = 0;
+
+static void
+snap_alloc(int pages, int bm_pages)
+{
+	snap_pages = pages;
+	snap_bm_pages = bm_pages;
+	snap_frozen_bm = calloc(bm_pages, PAGE_SIZE);
+	snap_held_bm = calloc(bm_pages, PAGE_SIZE);
+	snap_copy = calloc(pages, sizeof(int));
+	snap_copies = 0;
+}
+
+static void
+snap_release()
+{
+	free(snap_frozen_bm);
+	free(snap_held_bm);
+	free(snap_copy);
+
+	snap_frozen_bm = NULL;
+	snap_held_bm = NULL;
+	snap_copy = NULL;
+	snap_head = 0;
+	snap_live = 0;
+	snap_pages = 0;
+	snap_copies = 0;
+}
+
+static void
+snap_load_pairs(const snap_header* hdr)
+{
+	// pairs written since we last looked, straight from the disk
+	while (snap_copies < hdr->copies) {
+		int pp = snap_copies / SNAP_PAIRS;
+		if (snap_disk->read(hdr->list[2 * snap_bm_pages + pp], snap_pair_buf) < 0)
+			return;
+
+		int* pairs = snap_pair_buf;
+		int end = min(hdr->copies, (pp + 1) * SNAP_PAIRS);
+		for (; snap_copies < end; ++snap_copies) {
+			int kk = snap_copies % SNAP_PAIRS;
+			if (pairs[2 * kk] >= 0 && pairs[2 * kk] < snap_pages)
+				snap_copy[pairs[2 * kk]] = pairs[2 * kk + 1];
+		}
+	}
+}
+
+static snap_header*
+snap_load(int head)
+{
+	// the header, bitmaps and pairs, as they are on disk; NULL if the
+	// header isn't one
+	if (snap_disk->read(head, snap_buf) < 0)
+		return NULL;
+
+	snap_header* hdr = snap_buf;
+	if (hdr->magic != SNAP_MAGIC)
+		return NULL;
+
+	snap_alloc(hdr->pages, hdr->bm_pages);
+	snap_head = head;
+	snap_taken = hdr->taken;
+
+	// through an aligned buffer, for the direct backend
+	for (int ii = 0; ii < 2 * snap_bm_pages; ++ii) {
+		void* bm = ii < snap_bm_pages ? snap_frozen_bm : snap_held_bm;
+		if (snap_disk->read(hdr->list[ii], snap_pair_buf) == 0)
+			memcpy(bm + (ii % snap_bm_pages) * PAGE_SIZE, snap_pair_buf, PAGE_SIZE);
+	}
+
+	snap_load_pairs(hdr);
+	return hdr;
+}
+
+static void
+snap_bufs()
+{
+	// the direct backend wants its buffers aligned
+	int rv = posix_memalign(&snap_buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+	rv = posix_memalign(&snap_pair_buf, PAGE_SIZE, PAGE_SIZE);
+	assert(rv == 0);
+}
+
+void
+snap_init()
+{
+	superblock* sb = get_superblock();
+	if (mount_opts.snapshot || sb->snap <= 0)
+		return;
+
+	snap_disk = pages_backend;
+	snap_bufs();
+
+	snap_header* hdr = snap_load(sb->snap);
+	if (!hdr) {
+		printf("snap_init: bad snapshot header at page %d\n", sb->snap);
+		return;
+	}
+
+	// a copy and its pair go to disk ahead of the op that made them, so
+	// the bitmap may not have them yet if that op was lost
+	pages_claim(snap_head);
+	for (int ii = 0; ii < SNAP_LIST && hdr->list[ii] > 0; ++ii)
+		pages_claim(hdr->list[ii]);
+
+	for (int pnum = 0; pnum < snap_pages; ++pnum) {
+		if (snap_copy[pnum] > 0)
+			pages_claim(snap_copy[pnum]);
+	}
+
+	snap_live = !hdr->broken;
+	printf("+ snap_init() -> %d pages frozen, %d copied%s\n",
+	       snap_pages, snap_copies, hdr->broken ? ", broken" : "");
+}
+
+void
+snap_free()
+{
+	if (snap_head > 0) {
+		printf("======SNAPSHOT STATS=====\n");
+		printf("taken   : %s", ctime(&snap_taken));
+		printf("pages   : %d, %d copied\n", snap_pages, snap_copies);
+		printf("copied  : %ld this mount\n", snap_copied);
+		printf("held    : %ld this mount\n", snap_held);
+		if (mount_opts.snapshot)
+			printf("rereads : %ld\n", snap_refreshes);
+		printf("\n");
+	}
+
+	snap_release();
+
+	free(snap_buf);
+	free(snap_pair_buf);
+	snap_buf = NULL;
+	snap_pair_buf = NULL;
+}
+
+static void
+snap_write_through(int pnum, void* page)
+{
+	// a snapshot mount reads it as soon as it's written; the journal
+	// commit of the op that made it syncs it along with everything else
+	pages_mark_dirty(pnum);
+	if (!pages_backend->map) {
+		pages_backend->write(pnum, page);
+		csum_update(pnum, page);
+	}
+}
+
+int
+snap_take()
+{
+	if (snap_head > 0)
+		return -EEXIST;
+
+	int pages = PAGE_COUNT;
+	int bm_pages = (pages / 8 + PAGE_SIZE) / PAGE_SIZE;
+	if (2 * bm_pages + (pages + SNAP_PAIRS - 1) / SNAP_PAIRS > SNAP_LIST)
+		return -EFBIG;
+
+	// pages we never copy are read from home, so everything goes there
+	int rv = pages_sync_all();
+	if (rv == 0)
+		rv = journal_checkpoint();
+	if (rv < 0)
+		return rv;
+
+	snap_disk = pages_backend;
+	snap_bufs();
+	snap_alloc(pages, bm_pages);
+
+	// what's in use now is frozen; page 0 is copied right away, as it
+	// was before any of the snapshot's own pages were taken
+	for (int pnum = 0; pnum < pages; ++pnum) {
+		if (pnum == 0 || pages_bitmap_get(pnum))
+			bitmap_put(snap_frozen_bm, pnum, 1);
+	}
+	memcpy(snap_pair_buf, pages_get_page(0), PAGE_SIZE);
+
+	int want = 3 + 2 * bm_pages;
+	int* pnums = malloc(want * sizeof(int));
+	int got = 0;
+	while (got < want && (pnums[got] = alloc_page()) != -1)
+		got += 1;
+
+	if (got < want) {
+		for (int ii = 0; ii < got; ++ii)
+			free_page(pnums[ii]);
+
+		free(pnums);
+		snap_free();
+		return -ENOSPC;
+	}
+
+	// header, bitmaps, the first pair page, then page 0's copy
+	int head = pnums[0];
+	int copy0 = pnums[want - 1];
+
+	snap_header* hdr = pages_get_page(head);
+	memset(hdr, 0, PAGE_SIZE);
+	hdr->magic = SNAP_MAGIC;
+	hdr->pages = pages;
+	hdr->bm_pages = bm_pages;
+	hdr->copies = 1;
+	hdr->taken = time(NULL);
+	for (int ii = 0; ii < 2 * bm_pages + 1; ++ii)
+		hdr->list[ii] = pnums[1 + ii];
+
+	for (int ii = 0; ii < bm_pages; ++ii) {
+		void* frozen = pages_get_page(hdr->list[ii]);
+		memcpy(frozen, snap_frozen_bm + ii * PAGE_SIZE, PAGE_SIZE);
+		snap_write_through(hdr->list[ii], frozen);
+
+		void* held = pages_get_page(hdr->list[bm_pages + ii]);
+		memset(held, 0, PAGE_SIZE);
+		snap_write_through(hdr->list[bm_pages + ii], held);
+	}
+
+	void* copy = pages_get_page(copy0);
+	memcpy(copy, snap_pair_buf, PAGE_SIZE);
+	snap_write_through(copy0, copy);
+
+	int* pairs = pages_get_page(hdr->list[2 * bm_pages]);
+	memset(pairs, 0xff, PAGE_SIZE);
+	pairs[0] = 0;
+	pairs[1] = copy0;
+	snap_write_through(hdr->list[2 * bm_pages], pairs);
+
+	snap_write_through(head, hdr);
+	free(pnums);
+
+	snap_head = head;
+	snap_taken = hdr->taken;
+	snap_copy[0] = copy0;
+	snap_copies = 1;
+	snap_live = 1;
+
+	// a snapshot mount finds it through the superblock at home
+	get_superblock()->snap = head;
+	pages_mark_dirty(0);
+
+	rv = pages_sync_all();
+	if (rv == 0)
+		rv = journal_checkpoint();
+
+	printf("+ snap_take() -> header %d, %d pages frozen\n", head, pages);
+	return rv;
+}
+
+static void
+snap_break()
+{
+	// nothing it says can be trusted from here on; it's dropped as usual
+	snap_header* hdr = pages_get_page(snap_head);
+	hdr->broken = 1;
+	snap_write_through(snap_head, hdr);
+	snap_live = 0;
+
+	printf("snap_break: out of pages, snapshot is no longer usable\n");
+}
+
+static int
+snap_pair_page()
+{
+	// room for the next pair; taking a page can add pairs of its own
+	snap_header* hdr = pages_get_page(snap_head);
+	while (hdr->list[2 * snap_bm_pages + snap_copies / SNAP_PAIRS] <= 0) {
+		int pp = alloc_page();
+		if (pp == -1)
+			return -1;
+
+		int slot = 2 * snap_bm_pages + snap_copies / SNAP_PAIRS;
+		if (hdr->list[slot] > 0) {
+			free_page(pp);
+			continue;
+		}
+
+		memset(pages_get_page(pp), 0xff, PAGE_SIZE);
+		hdr->list[slot] = pp;
+	}
+
+	return 0;
+}
+
+void
+snap_preserve(int pnum)
+{
+	if (!snap_live || pnum <= 0 || pnum >= snap_pages || snap_copy[pnum] != 0 ||
+	    !bitmap_get(snap_frozen_bm, pnum))
+		return;
+
+	// taking pages below may come back here for one of the bitmap's, or
+	// for this very page, so it's copied first, as it is now
+	snap_copy[pnum] = -1;
+	void* pre = malloc(PAGE_SIZE);
+	memcpy(pre, pages_get_page(pnum), PAGE_SIZE);
+
+	int copy = alloc_page();
+	if (copy == -1 || snap_pair_page() < 0) {
+		if (copy != -1)
+			free_page(copy);
+
+		free(pre);
+		snap_copy[pnum] = 0;
+		snap_break();
+		return;
+	}
+
+	// the copy, then its pair, then the count that makes it visible
+	void* page = pages_get_page(copy);
+	memcpy(page, pre, PAGE_SIZE);
+	free(pre);
+	snap_write_through(copy, page);
+
+	snap_header* hdr = pages_get_page(snap_head);
+	int slot = 2 * snap_bm_pages + snap_copies / SNAP_PAIRS;
+	int* pairs = pages_get_page(hdr->list[slot]);
+	pairs[2 * (snap_copies % SNAP_PAIRS)] = pnum;
+	pairs[2 * (snap_copies % SNAP_PAIRS) + 1] = copy;
+	snap_write_through(hdr->list[slot], pairs);
+
+	snap_copies += 1;
+	hdr->copies = snap_copies;
+	snap_write_through(snap_head, hdr);
+
+	snap_copy[pnum] = copy;
+	snap_copied += 1;
+}
+
+int
+snap_frozen(int pnum)
+{
+	// read from where it is by the snapshot, so it mustn't change
+	return snap_live && pnum > 0 && pnum < snap_pages && snap_copy[pnum] == 0 &&
+	       bitmap_get(snap_frozen_bm, pnum);
+}
+
+int
+snap_hold(int pnum)
+{
+	// a frozen page stays in use until the snapshot's dropped
+	if (!snap_frozen(pnum))
+		return 0;
+
+	int per_page = PAGE_SIZE * 8;
+	int bpnum = ((snap_header*)pages_get_page(snap_head))->list[snap_bm_pages + pnum / per_page];
+
+	void* held = pages_get_page(bpnum);
+	bitmap_put(held, pnum % per_page, 1);
+	pages_mark_dirty(bpnum);
+
+	bitmap_put(snap_held_bm, pnum, 1);
+	snap_held += 1;
+	return 1;
+}
+
+int
+snap_drop()
+{
+	if (snap_head <= 0)
+		return -ENOENT;
+
+	snap_live = 0;
+
+	// what only the snapshot had is free now, and so are the copies
+	for (int pnum = 0; pnum < snap_pages; ++pnum) {
+		if (bitmap_get(snap_held_bm, pnum))
+			free_page(pnum);
+
+		if (snap_copy[pnum] > 0)
+			free_page(snap_copy[pnum]);
+	}
+
+	snap_header* hdr = pages_get_page(snap_head);
+	for (int ii = 0; ii < SNAP_LIST && hdr->list[ii] > 0; ++ii)
+		free_page(hdr->list[ii]);
+
+	// a snapshot mount still reading it notices it's gone
+	hdr->magic = 0;
+	snap_write_through(snap_head, hdr);
+	free_page(snap_head);
+
+	get_superblock()->snap = 0;
+	pages_mark_dirty(0);
+
+	printf("+ snap_drop() -> %d pages frozen, %d copied\n", snap_pages, snap_copies);
+	snap_release();
+	return 0;
+}
+
+// A snapshot mount reads through the real backend, and writes nothing:
+// what the rest of nufs writes anyway (atimes, the root it sets up) is
+// thrown away.
+
+static int
+snap_view_refresh()
+{
+	// -1 if it's been dropped or broken under us
+	snap_refreshes += 1;
+	if (snap_disk->read(snap_head, snap_buf) < 0)
+		return -1;
+
+	snap_header* hdr = snap_buf;
+	if (hdr->magic != SNAP_MAGIC || hdr->broken)
+		return -1;
+
+	snap_load_pairs(hdr);
+	return 0;
+}
+
+static int
+snap_view_read(int pnum, void* buf)
+{
+	if (pnum < snap_pages && snap_copy[pnum] > 0)
+		return snap_disk->read(snap_copy[pnum], buf);
+
+	int rv = snap_disk->read(pnum, buf);
+	if (rv < 0 || pnum >= snap_pages || !bitmap_get(snap_frozen_bm, pnum))
+		return rv;
+
+	// the live mount may have copied it since, and then changed it; the
+	// pair is on disk before the change is
+	if (snap_view_refresh() < 0) {
+		printf("snap_view_read: snapshot is gone\n");
+		return -EIO;
+	}
+
+	if (snap_copy[pnum] > 0)
+		return snap_disk->read(snap_copy[pnum], buf);
+
+	return rv;
+}
+
+static int
+snap_view_open(const char* path, int pages)
+{
+	return 0;
+}
+
+static int
+snap_view_resize(int pages)
+{
+	return 0;
+}
+
+static void
+snap_view_close()
+{
+	snap_disk->close();
+}
+
+static int
+snap_view_write(int pnum, const void* buf)
+{
+	return 0;
+}
+
+static int
+snap_view_write_batch(int count, const int* pnums, void* const* bufs)
+{
+	return 0;
+}
+
+static int
+snap_view_sync()
+{
+	return 0;
+}
+
+static int
+snap_view_sync_range(int pnum, int count)
+{
+	return 0;
+}
+
+static void
+snap_view_advise(int pnum, int count, int advice)
+{
+	snap_disk->advise(pnum, count, advice);
+}
+
+static backend snap_view_backend = {
+	.name        = "snapshot",
+	.open        = snap_view_open,
+	.resize      = snap_view_resize,
+	.close       = snap_view_close,
+	.map         = NULL,
+	.unmap       = NULL,
+	.release     = NULL,
+	.read        = snap_view_read,
+	.write       = snap_view_write,
+	.write_batch = snap_view_write_batch,
+	.sync        = snap_view_sync,
+	.sync_range  = snap_view_sync_range,
+	.writeback   = snap_view_sync_range,
+	.advise      = snap_view_advise,
+};
+
+backend*
+snap_view(backend* disk)
+{
+	// the live superblock says where the snapshot is; the one it shows
+	// is its copy of page 0
+	snap_disk = disk;
+	snap_bufs();
+
+	if (disk->read(0, snap_buf) < 0)
+		return NULL;
+
+	superblock* sb = (superblock*)(snap_buf + PAGE_SIZE - sizeof(superblock));
+	if (sb->magic != NUFS_MAGIC || sb->snap <= 0) {
+		printf("snap_view: there's no snapshot\n");
+		return NULL;
+	}
+
+	snap_header* hdr = snap_load(sb->snap);
+	if (!hdr || hdr->broken) {
+		printf("snap_view: snapshot at page %d can't be read\n", sb->snap);
+		return NULL;
+	}
+
+	// nothing's written, so there's nothing to journal or sum
+	mount_opts.journal = 0;
+	mount_opts.checksum = "off";
+	mount_opts.dedup = 0;
+
+	printf("+ snap_view() -> %d pages frozen, %d copied\n", snap_pages, snap_copies);
+	return &snap_view_backend;
+}
@@ -0,0 +1,45 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <sys/ioctl.h>
+
+#include "backend.h"
+
+#define SNAP_MAGIC 0x50414e53 // "SNAP", the snapshot's header page
+
+// ioctls on any file in the mount
+#define NUFS_IOC_SNAPSHOT      _IO('N', 1) // take a snapshot of the image
+#define NUFS_IOC_SNAPSHOT_DROP _IO('N', 2) // and let it go
+
+// A snapshot of the whole image, by shadow paging. Taking one freezes the
+// pages in use at that moment; nothing is copied. From then on a frozen
+// metadata page is copied to a page of its own the first time it's
+// touched, before it can change, and frozen file data is never written
+// in place (see storage_write) or freed until the snapshot is dropped.
+// Mounting with -o snapshot reads page 0 and every page that was copied
+// from its copy, and everything else from where it always was.
+//
+// The superblock points at the header page, which lists the pages of the
+// frozen and held bitmaps and of the (page, copy) pairs. Copies and pairs
+// are written through as they're made, so a snapshot mounted next to the
+// live filesystem sees a page's copy before it sees the page change.
+typedef struct snap_header {
+	int  magic;
+	int  pages;    // pages in the image when it was taken
+	int  bm_pages; // pages in each of the frozen and held bitmaps
+	int  copies;   // pairs so far
+	int  broken;   // we ran out of room for a copy; it can't be mounted
+	long taken;    // time() it was taken
+	int  list[];   // frozen bitmap, held bitmap, then pair pages
+} snap_header;
+
+void snap_init();
+void snap_free();
+backend* snap_view(backend* inner);
+int  snap_take();
+int  snap_drop();
+int  snap_frozen(int pnum);
+void snap_preserve(int pnum);
+int  snap_hold(int pnum);
+
+#endif
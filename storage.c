@@ -12,29 +12,105 @@
 #include <libgen.h>
 #include <bsd/string.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "storage.h"
 #include "slist.h"
+#include "arena.h"
 #include "util.h"
 #include "pages.h"
 #include "inode.h"
 #include "directory.h"
+#include "journal.h"
+#include "delalloc.h"
+#include "copy.h"
+#include "csum.h"
+#include "compress.h"
+#include "refs.h"
+#include "dedup.h"
+#include "snap.h"
+#include "cbt.h"
+#include "tail.h"
+#include "defrag.h"
+#include "hot.h"
 
 #include "globals.h"
 
 extern const int PAGE_SIZE;
+extern int INODE_COUNT;
 
 extern const int default_file_mode;
 
+extern nufs_opts mount_opts;
+
+// one op at a time; the flusher takes it too
+static pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  storage_flusher_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       storage_flusher;
+static int             storage_flusher_on = 0;
+static pthread_cond_t  storage_scrubber_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       storage_scrubber;
+static int             storage_scrubber_on = 0;
+static pthread_cond_t  storage_defragger_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       storage_defragger;
+static int             storage_defragger_on = 0;  // a pass is running
+static int             storage_defragger_ran = 0; // there's a thread to join
+
+// pages the scrubber checks each time it takes storage_lock
+#define STORAGE_SCRUB_BATCH 32
+
+// pages the defragmenter moves each time it takes storage_lock; a file
+// bigger than this moves all at once
+#define STORAGE_DEFRAG_BATCH 64
+
+// writes this big or bigger go around the cpu cache
+#define STORAGE_STREAM_BYTES (64 * 1024)
+
+// open files with buffered writes
+static storage_file* storage_pending = NULL;
+
+// by inum, how many times the kernel has been handed the inode and not
+// yet forgotten it; an inode that's unlinked stays until this is 0
+static unsigned long* storage_lookups = NULL;
+static int            storage_nlookups = 0;
+
+static int storage_commit_files(storage_file* except);
+static void storage_op_finish();
+
+static void
+storage_free_orphans()
+{
+	// inodes that were unlinked while the kernel still had them, from a
+	// mount that ended before it forgot them; a snapshot is left as it was
+	for (int inum = 2; inum < INODE_COUNT && !mount_opts.snapshot; ++inum) {
+		inode* node = peek_inode(inum);
+		if (node->refs == 0 && node->mode != 0)
+			free_inode(inum);
+	}
+
+	free(storage_lookups);
+	storage_lookups = NULL;
+	storage_nlookups = 0;
+}
+
 void
 storage_init(const char* path)
 {
+	copy_init();
+	compress_init();
+
 	// Initialize disk image
     pages_init(path);
+	delalloc_init();
+	dedup_init();
 
 	// Initialize Block 0 Layout
 	init_inode_gvars();
+	refs_init();
+	tail_init();
+	hot_init();
 
 	// Initialize Node for Block 0
 	inode* node = get_inode(0);
@@ -49,18 +125,609 @@ storage_init(const char* path)
 
 	// Set up Root
 	directory_init();
+	storage_free_orphans();
+}
+
+void
+storage_free()
+{
+	if (storage_scrubber_on) {
+		pthread_mutex_lock(&storage_lock);
+		storage_scrubber_on = 0;
+		pthread_cond_signal(&storage_scrubber_cond);
+		pthread_mutex_unlock(&storage_lock);
+
+		pthread_join(storage_scrubber, NULL);
+	}
+
+	if (storage_defragger_ran) {
+		pthread_mutex_lock(&storage_lock);
+		storage_defragger_on = 0;
+		pthread_cond_signal(&storage_defragger_cond);
+		pthread_mutex_unlock(&storage_lock);
+
+		pthread_join(storage_defragger, NULL);
+		storage_defragger_ran = 0;
+	}
+
+	if (storage_flusher_on) {
+		pthread_mutex_lock(&storage_lock);
+		storage_flusher_on = 0;
+		pthread_cond_signal(&storage_flusher_cond);
+		pthread_mutex_unlock(&storage_lock);
+
+		pthread_join(storage_flusher, NULL);
+	}
+
+	storage_commit_files(NULL);
+	storage_free_orphans();
+	delalloc_flush();
+	delalloc_free();
+	compress_free();
+	dedup_free();
+	refs_free();
+	tail_free();
+	hot_free();
+	defrag_free();
+	pages_free();
+	arena_free();
+}
+
+static int
+storage_batched()
+{
+	return streq(mount_opts.durability, "batched") && mount_opts.commit_ms > 0;
+}
+
+static void
+storage_flusher_writeback()
+{
+	storage_commit_files(NULL);
+	delalloc_flush_cold();
+
+	int* runs = NULL;
+	int count = pages_writeback_collect(&runs);
+
+	// starting the i/o can block on a busy disk; ops go on meanwhile
+	pthread_mutex_unlock(&storage_lock);
+	pages_writeback_runs(runs, count);
+	pthread_mutex_lock(&storage_lock);
+
+	free(runs);
+}
+
+static void*
+storage_flusher_main(void* arg)
+{
+	long committed = now_ms();
+
+	int interval = mount_opts.writeback_ms;
+	if (storage_batched() && (interval <= 0 || mount_opts.commit_ms < interval))
+		interval = mount_opts.commit_ms;
+
+	pthread_mutex_lock(&storage_lock);
+
+	while (storage_flusher_on) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval / 1000;
+		ts.tv_nsec += (interval % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		// waiting gives up storage_lock, so ops run in between; an op
+		// that pushes us past dirty_ratio wakes us early
+		pthread_cond_timedwait(&storage_flusher_cond, &storage_lock, &ts);
+		if (!storage_flusher_on)
+			break;
+
+		// batched durability: everything is on disk within commit_ms,
+		// but for the hot tier, which waits for fsync
+		if (storage_batched() && now_ms() - committed >= mount_opts.commit_ms) {
+			storage_commit_files(NULL);
+			delalloc_flush_cold();
+
+			int rv = pages_sync_all();
+			if (rv < 0)
+				printf("storage_flusher: sync failed: %s\n", strerror(-rv));
+
+			committed = now_ms();
+		}
+		else if (mount_opts.writeback_ms > 0 &&
+		         (storage_pending || pages_dirty_percent() >= mount_opts.dirty_ratio ||
+		          pages_dirty_age() >= mount_opts.dirty_expire)) {
+			storage_flusher_writeback();
+		}
+
+		pages_release();
+		arena_reset();
+	}
+
+	pthread_mutex_unlock(&storage_lock);
+	arena_free();
+	return NULL;
+}
+
+void
+storage_start_flusher()
+{
+	// small steady writebacks instead of the kernel's big periodic ones,
+	// and the batched durability commits
+	if (mount_opts.writeback_ms <= 0 && !storage_batched())
+		return;
+
+	storage_flusher_on = 1;
+	int rv = pthread_create(&storage_flusher, NULL, storage_flusher_main, NULL);
+	if (rv != 0) {
+		printf("storage_start_flusher: %s\n", strerror(rv));
+		storage_flusher_on = 0;
+	}
+}
+
+static void*
+storage_scrubber_main(void* arg)
+{
+	// a batch at a time, spaced out to mount_opts.scrub pages a second
+	int interval = STORAGE_SCRUB_BATCH * 1000 / mount_opts.scrub;
+	if (interval < 1)
+		interval = 1;
+
+	pthread_mutex_lock(&storage_lock);
+
+	while (storage_scrubber_on) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval / 1000;
+		ts.tv_nsec += (interval % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&storage_scrubber_cond, &storage_lock, &ts);
+		if (!storage_scrubber_on)
+			break;
+
+		pages_scrub(STORAGE_SCRUB_BATCH);
+		pages_release();
+	}
+
+	pthread_mutex_unlock(&storage_lock);
+	return NULL;
+}
+
+void
+storage_start_scrubber()
+{
+	// pages nobody reads are checked too, a few at a time
+	if (mount_opts.scrub <= 0 || !csum_enabled())
+		return;
+
+	storage_scrubber_on = 1;
+	int rv = pthread_create(&storage_scrubber, NULL, storage_scrubber_main, NULL);
+	if (rv != 0) {
+		printf("storage_start_scrubber: %s\n", strerror(rv));
+		storage_scrubber_on = 0;
+	}
+}
+
+static void*
+storage_defragger_main(void* arg)
+{
+	// a batch at a time, then a rest as long as moving it at
+	// mount_opts.defrag pages a second should have taken
+	int moved = 0;
+
+	pthread_mutex_lock(&storage_lock);
+
+	while (storage_defragger_on) {
+		long interval = moved * 1000L / mount_opts.defrag;
+		if (interval > 0) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += interval / 1000;
+			ts.tv_nsec += (interval % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec += 1;
+				ts.tv_nsec -= 1000000000L;
+			}
+
+			pthread_cond_timedwait(&storage_defragger_cond, &storage_lock, &ts);
+			if (!storage_defragger_on)
+				break;
+		}
+
+		// the batch is an op of its own
+		storage_commit_files(NULL);
+		moved = defrag_step(STORAGE_DEFRAG_BATCH);
+		if (moved < 0)
+			storage_defragger_on = 0;
+
+		storage_op_finish();
+	}
+
+	pthread_mutex_unlock(&storage_lock);
+	arena_free();
+	return NULL;
+}
+
+int
+storage_defrag()
+{
+	// starts a pass in the background; one at a time
+	if (mount_opts.snapshot)
+		return -EROFS;
+
+	if (mount_opts.defrag <= 0)
+		return -EOPNOTSUPP;
+
+	if (storage_defragger_on)
+		return -EALREADY;
+
+	// the last pass's thread let go of storage_lock for good, so it's
+	// done or as good as
+	if (storage_defragger_ran) {
+		pthread_join(storage_defragger, NULL);
+		storage_defragger_ran = 0;
+	}
+
+	defrag_start();
+
+	storage_defragger_on = 1;
+	int rv = pthread_create(&storage_defragger, NULL, storage_defragger_main, NULL);
+	if (rv != 0) {
+		printf("storage_defrag: %s\n", strerror(rv));
+		storage_defragger_on = 0;
+		return -rv;
+	}
+
+	storage_defragger_ran = 1;
+	return 0;
+}
+
+void
+storage_op_begin()
+{
+	pthread_mutex_lock(&storage_lock);
+
+	// buffered writes land before anything else looks at the files
+	storage_commit_files(NULL);
+}
+
+static void
+storage_op_finish()
+{
+	int writeback = !storage_flusher_on || mount_opts.writeback_ms <= 0;
+	int strict = streq(mount_opts.durability, "strict");
+
+	// delayed pages wait for the flusher, unless there's too many of them;
+	// the hot tier's are only counted against -o hot
+	if (strict)
+		delalloc_flush();
+	else if (writeback || delalloc_pending() - delalloc_held() >= mount_opts.delalloc)
+		delalloc_flush_cold();
+
+	// commit to the journal if the batch is full; what the op dirtied is
+	// written back here only when there's no flusher to do it
+	pages_flush(writeback);
+
+	if (storage_flusher_on && mount_opts.writeback_ms > 0 &&
+	    pages_dirty_percent() >= mount_opts.dirty_ratio)
+		pthread_cond_signal(&storage_flusher_cond);
+
+	// strict durability: nothing returns before it's on disk
+	if (strict)
+		pages_sync_all();
+
+	pages_release();
+	arena_reset();
+}
+
+void
+storage_op_done()
+{
+	storage_op_finish();
+	pthread_mutex_unlock(&storage_lock);
+}
+
+int
+storage_fsync(int inum, int datasync)
+{
+	if (streq(mount_opts.durability, "unsafe"))
+		return 0;
+
+	inode* node = get_inode(inum);
+	printf("+ storage_fsync(%d, %d)\n", inum, datasync);
+
+	// the file's delayed pages need a home before they can be synced
+	if (delalloc_flush_inode(inum) < 0)
+		return -ENOSPC;
+
+	// just the file's own pages. Holes and the DELALLOC, COMPRESSED and
+	// TAIL pointers aren't pages; a compressed cluster's stream is in the
+	// pointers after its first, and a packed tail's fragment page is
+	// metadata, which the journal commit below takes care of.
+	int pages = bytes_to_pages(node->size);
+	int count = 0;
+	int* pnums = pages > 0 ? malloc(pages * sizeof(int)) : NULL;
+	for (int fpn = 0; fpn < pages; ++fpn) {
+		int pnum = inode_get_pnum(node, fpn);
+		if (pnum > 0)
+			pnums[count++] = pnum;
+	}
+
+	int rv = count > 0 ? pages_sync_list(pnums, count) : 0;
+	free(pnums);
+	if (rv < 0)
+		return -EIO;
+
+	// fdatasync still needs the size and block pointers, and here those are
+	// the same metadata fsync needs; the journal makes them durable cheaply
+	rv = journal_commit();
+	if (rv == 0 && !journal_enabled())
+		rv = pages_sync_all();
+
+	return rv < 0 ? -EIO : 0;
+}
+
+static int
+storage_file_commit(storage_file* file)
+{
+	if (file->len == 0)
+		return 0;
+
+	int rv = storage_write(file->inum, file->buf, file->len, file->off);
+	if (rv < 0 && file->err == 0)
+		file->err = rv;
+
+	file->len = 0;
+
+	storage_file** pp = &storage_pending;
+	while (*pp != file)
+		pp = &(*pp)->next;
+
+	*pp = file->next;
+	file->next = NULL;
+	return 1;
+}
+
+static int
+storage_commit_files(storage_file* except)
+{
+	int count = 0;
+
+	storage_file* file = storage_pending;
+	while (file) {
+		storage_file* next = file->next;
+		if (file != except)
+			count += storage_file_commit(file);
+
+		file = next;
+	}
+
+	return count;
+}
+
+storage_file*
+storage_open(int inum)
+{
+	storage_file* file = calloc(1, sizeof(storage_file));
+	file->inum = inum;
+	return file;
+}
+
+int
+storage_release(storage_file* file)
+{
+	storage_file_commit(file);
+	int rv = file->err;
+
+	free(file->buf);
+	free(file);
+	return rv;
+}
+
+int
+storage_file_error(storage_file* file)
+{
+	int rv = file->err;
+	file->err = 0;
+	return rv;
+}
+
+static void
+storage_readahead(storage_file* file, off_t offset, size_t size)
+{
+	// a read that picks up where the last one ended, or one at the start
+	// of the file, is a stream
+	int seq = offset == file->ra_next || offset == 0;
+	file->ra_next = offset + size;
+
+	if (!seq || mount_opts.readahead <= 0) {
+		file->ra_pages = 0;
+		file->ra_end = 0;
+		return;
+	}
+
+	inode* node = get_inode(file->inum);
+	int next = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+	int eof = bytes_to_pages(node->size);
+
+	// start small, and issue the next window once the reader is
+	// halfway into the last one, twice as large each time
+	if (file->ra_pages == 0) {
+		file->ra_pages = 4;
+		file->ra_end = next;
+	}
+	else if (file->ra_end - next > file->ra_pages / 2) {
+		return;
+	}
+	else if (file->ra_pages < mount_opts.readahead) {
+		file->ra_pages = min(2 * file->ra_pages, mount_opts.readahead);
+	}
+
+	int from = max(file->ra_end, next);
+	int to = min(next + file->ra_pages, eof);
+	if (from >= to)
+		return;
+
+	int* pnums = malloc((to - from) * sizeof(int));
+	for (int fpn = from; fpn < to; ++fpn)
+		pnums[fpn - from] = inode_get_pnum(node, fpn);
+
+	pages_readahead(pnums, to - from);
+	free(pnums);
+
+	file->ra_end = to;
+}
+
+int
+storage_file_read(storage_file* file, char* buf, size_t size, off_t offset)
+{
+	int rv = storage_read(file->inum, buf, size, offset);
+	if (rv > 0)
+		storage_readahead(file, offset, rv);
+
+	return rv;
+}
+
+int
+storage_file_write(storage_file* file, const char* buf, size_t size, off_t offset)
+{
+	size_t cap = (size_t)mount_opts.write_buffer * PAGE_SIZE;
+	if (streq(mount_opts.durability, "strict"))
+		cap = 0;
+
+	pthread_mutex_lock(&storage_lock);
+
+	// another file's writes could overlap these; they go first
+	int touched = storage_commit_files(file);
+
+	int rv = storage_file_error(file);
+	if (rv < 0)
+		goto write_done;
+
+	if (cap == 0) {
+		rv = storage_write(file->inum, buf, size, offset);
+		touched = 1;
+		goto write_done;
+	}
+
+	// the buffer ends on a page boundary, so commits are whole pages
+	size_t room = cap - file->off % PAGE_SIZE;
+	if (file->len > 0 && (offset != file->off + (off_t)file->len || file->len + size > room))
+		touched += storage_file_commit(file);
+
+	if (file->len == 0) {
+		file->off = offset;
+		room = cap - offset % PAGE_SIZE;
+	}
+
+	if (size > room - file->len) {
+		rv = storage_write(file->inum, buf, size, offset);
+		touched = 1;
+		goto write_done;
+	}
+
+	if (file->len == 0) {
+		if (!file->buf)
+			file->buf = malloc(cap);
+
+		file->next = storage_pending;
+		storage_pending = file;
+	}
+
+	memcpy(file->buf + file->len, buf, size);
+	file->len += size;
+	rv = size;
+
+	if (file->len == room)
+		touched += storage_file_commit(file);
+
+write_done:
+	// if storage was touched this was an op like any other
+	if (touched)
+		storage_op_done();
+	else
+		pthread_mutex_unlock(&storage_lock);
+
+	return rv;
+}
+
+void
+storage_prefault()
+{
+	// page 0 holds the page bitmap and inode table; directory pages are
+	// metadata too, and are pinned alongside it
+	pages_prefault(0);
+
+	for (int inum = 1; inum < INODE_COUNT; ++inum) {
+		inode* node = get_inode(inum);
+		if (node->refs == 0 || !S_ISDIR(node->mode))
+			continue;
+
+		if (node->iptr != -1)
+			pages_prefault(node->iptr);
+
+		for (int fpn = 0; fpn < bytes_to_pages(node->size); ++fpn)
+			pages_prefault(inode_get_pnum(node, fpn));
+	}
+}
+
+int
+storage_lookup(int p_inum, const char* name)
+{
+	inode* p_node = peek_inode(p_inum);
+	if (!p_node || p_node->mode == 0)
+		return -ENOENT;
+
+	if (!S_ISDIR(p_node->mode))
+		return -ENOTDIR;
+
+	int inum = directory_lookup(get_inode(p_inum), name);
+	printf("+ storage_lookup(%d, %s) -> %d\n", p_inum, name, inum);
+	return inum;
+}
+
+void
+storage_hold(int inum)
+{
+	if (inum >= storage_nlookups) {
+		int count = max(inum + 1, max(2 * storage_nlookups, 64));
+		storage_lookups = realloc(storage_lookups, count * sizeof(unsigned long));
+		for (int ii = storage_nlookups; ii < count; ++ii)
+			storage_lookups[ii] = 0;
+
+		storage_nlookups = count;
+	}
+
+	storage_lookups[inum] += 1;
+}
+
+void
+storage_forget(int inum, unsigned long count)
+{
+	if (inum >= storage_nlookups)
+		return;
+
+	storage_lookups[inum] = count < storage_lookups[inum] ? storage_lookups[inum] - count : 0;
+
+	inode* node = peek_inode(inum);
+	if (storage_lookups[inum] == 0 && node && node->refs == 0 && node->mode != 0)
+		free_inode(inum);
 }
 
 int
-storage_stat(const char* path, struct stat* st)
+storage_stat(int inum, struct stat* st)
 {
-    printf("+ storage_stat(%s)\n", path);
-    int inum = tree_lookup(path);
-    if (inum < 0)
+    inode* node = peek_inode(inum);
+    if (!node || node->mode == 0)
         return -ENOENT;
 
-    inode* node = get_inode(inum);
-    printf("+ storage_stat(%s); inode %d\n", path, inum);
+    node = get_inode(inum);
+    printf("+ storage_stat(%d)\n", inum);
     print_inode(node);
 
 	node->acc = (long)time(NULL);
@@ -71,19 +738,55 @@ storage_stat(const char* path, struct stat* st)
     st->st_size   = node->size;
 	st->st_ino    = inum;
     st->st_nlink  = node->refs;
-	st->st_blocks = node->size == 0 ? 0 : (node->size - 1) / PAGE_SIZE + 1;
+
+	// holes take no space, a compressed cluster only its stream's pages,
+	// a packed tail only its slot; st_blocks is in 512 byte units
+	int pages = 0;
+	for (int fpn = 0; fpn < bytes_to_pages(node->size); ++fpn) {
+		int pnum = inode_get_pnum(node, fpn);
+		if (pnum > 0 || pnum == DELALLOC_PNUM)
+			pages += 1;
+	}
+
+	st->st_blocks = pages * (PAGE_SIZE / 512);
+	if (tail_packed(node))
+		st->st_blocks = (node->size + 511) / 512;
     return 0;
 }
 
 int
-storage_read(const char* path, char* buf, size_t size, off_t offset)
+storage_statfs(struct statvfs* st)
 {
-    int inum = tree_lookup(path);
-    if (inum < 0)
-        return inum;
+	// pages and inodes; a delayed page is as good as taken
+	superblock* sb = get_superblock();
+
+	int ifree = 0;
+	for (int inum = 0; inum < sb->inode_count; ++inum) {
+		inode* node = peek_inode(inum);
+		if (node && node->mode == 0)
+			ifree += 1;
+	}
+
+	memset(st, 0, sizeof(struct statvfs));
+	st->f_bsize   = PAGE_SIZE;
+	st->f_frsize  = PAGE_SIZE;
+	st->f_blocks  = sb->page_count;
+	st->f_bfree   = max(pages_free_count() - delalloc_pending(), 0);
+	st->f_bavail  = st->f_bfree;
+	st->f_files   = sb->inode_count;
+	st->f_ffree   = ifree;
+	st->f_favail  = ifree;
+	st->f_namemax = sizeof(((dirent*)0)->name) - 1;
+
+	printf("+ storage_statfs() -> %ld of %ld pages free\n", st->f_bfree, st->f_blocks);
+	return 0;
+}
 
+int
+storage_read(int inum, char* buf, size_t size, off_t offset)
+{
     inode* node = get_inode(inum);
-    printf("+ storage_read(%s); inode %d\n", path, inum);
+    printf("+ storage_read(%d)\n", inum);
     print_inode(node);
 
 	node->acc = (long)time(NULL);
@@ -95,7 +798,7 @@ storage_read(const char* path, char* buf, size_t size, off_t offset)
         size = node->size - offset;
 
 	// Zero-Indexed
-	int start_idx = (offset - 1) / PAGE_SIZE;
+	int start_idx = offset / PAGE_SIZE;
 	int end_idx = (size + offset - 1) / PAGE_SIZE;
 
 	int* ipgs = (int*)pages_get_page(node->iptr);
@@ -113,7 +816,38 @@ storage_read(const char* path, char* buf, size_t size, off_t offset)
 		else
 			blk = ipgs[i - 2];
 
-		data = pages_get_page(blk);
+		if (compress_packed(node, i)) {
+			const char* cl = compress_get(node, inum, i / COMPRESS_CLUSTER);
+			if (!cl) {
+				printf("storage_read: page %d of inode %d is corrupt\n", i, inum);
+				return -EIO;
+			}
+
+			// the pointer is one of the stream's pages, not this page's
+			data = (void*)cl + (i % COMPRESS_CLUSTER) * PAGE_SIZE;
+			blk = -1;
+		}
+		else if (blk == TAIL_PNUM) {
+			data = (void*)tail_get(node);
+			if (!data) {
+				printf("storage_read: inode %d is corrupt\n", inum);
+				return -EIO;
+			}
+
+			blk = -1;
+		}
+		else if (blk == DELALLOC_PNUM)
+			data = delalloc_peek(inum, i); // NULL if lost in a crash
+		else if (blk == -1)
+			data = NULL; // a hole
+		else
+			data = pages_get_data(blk);
+
+		if (data && csum_bad(blk)) {
+			printf("storage_read: page %d of inode %d is corrupt\n", i, inum);
+			pages_put_page(blk);
+			return -EIO;
+		}
 
 		if (i == start_idx && i == end_idx) {
 			sz = size;
@@ -132,7 +866,14 @@ storage_read(const char* path, char* buf, size_t size, off_t offset)
 			data_off = 0;
 		}
 
-		memcpy((void*)buf + total_read, data + data_off, sz);
+		if (!data)
+			memset((void*)buf + total_read, 0, sz);
+		else if (sz == PAGE_SIZE)
+			copy_page((void*)buf + total_read, data);
+		else
+			memcpy((void*)buf + total_read, data + data_off, sz);
+
+		pages_put_page(blk);
 		total_read += sz;
 	}
 
@@ -144,38 +885,92 @@ storage_read(const char* path, char* buf, size_t size, off_t offset)
     return size;
 }
 
-int
-storage_write(const char* path, const char* buf, size_t size, off_t offset)
+static int
+storage_fill_hole(inode* node, int inum, int fpn, int shared)
 {
-	int* ipgs = NULL;
-	void* data = NULL;
+	// a page of the file's own for a hole, or for a page it shares; it
+	// starts as zeros or a copy of the shared page, for whatever part of
+	// it the write doesn't cover. It only gets a home in the image when
+	// it's flushed if we can wait.
+	int pnum = DELALLOC_PNUM;
+	void* data;
+
+	if (delalloc_enabled()) {
+		if (delalloc_reserve(1) < 0)
+			return -1;
+
+		data = delalloc_get(inum, fpn);
+	}
+	else {
+		pnum = alloc_page();
+		if (pnum == -1)
+			return -1;
+
+		data = pages_get_data(pnum);
+	}
 
-    int trv = storage_truncate(path, offset + size);
-    if (trv < 0)
-        return trv;
+	if (shared == -1)
+		memset(data, 0, PAGE_SIZE);
+	else {
+		copy_page(data, pages_get_data(shared));
+		pages_put_page(shared);
+		free_page(shared);
+	}
+
+	if (pnum != DELALLOC_PNUM) {
+		pages_mark_data(pnum);
+		pages_put_page(pnum);
+	}
 
-    int inum = tree_lookup(path);
-    if (inum < 0)
-        return inum;
+	inode_set_pnum(node, fpn, pnum);
+	return pnum;
+}
+
+static int
+storage_write_pages(int inum, const char* buf, size_t size, off_t offset)
+{
+	int* ipgs = NULL;
+	void* data = NULL;
 
     inode* node = get_inode(inum);
-	printf(" + storage_write(%s); inode %d\n", path, inum);
+	printf(" + storage_write(%d)\n", inum);
 	print_inode(node);
 
 	node->acc = (long)time(NULL);
 	node->mod = (long)time(NULL);
 
-    if (offset >= node->size)
-        return 0;
+	if (size == 0)
+		return 0;
 
-    if (offset + size >= node->size)
-        grow_inode(node, offset + size);
+	// a hot file's pages that are in the image come back to memory as
+	// they're written, while the hot tier has room
+	hot_touch(inum);
+	int hot = hot_wanted(node, inum) && delalloc_held() < mount_opts.hot;
+
+	// a packed tail changes in a page of its own
+	if (tail_packed(node)) {
+		int rv = tail_unpack(node, inum);
+		if (rv < 0)
+			return rv;
+	}
+
+	// new pages of a file start as holes; the loop below gives the ones
+	// that get data a page
+	if (offset + size > node->size) {
+		int rv = S_ISREG(node->mode) ? grow_inode_sparse(node, offset + size)
+		                             : grow_inode(node, offset + size);
+		if (rv < 0)
+			return rv;
+	}
 
 	// Zero-Indexed
-	int start_idx = (offset - 1) / PAGE_SIZE;
+	int start_idx = offset / PAGE_SIZE;
 	int end_idx = (offset + size - 1) / PAGE_SIZE;
 	assert(0 <= start_idx && start_idx <= end_idx);
 
+	// a big write won't be read back soon; keep it out of the cpu cache
+	int stream = size >= STORAGE_STREAM_BYTES;
+
 	int blk = -1;
 	size_t sz = 0;
 	size_t total_write = 0;
@@ -183,6 +978,15 @@ storage_write(const char* path, const char* buf, size_t size, off_t offset)
 
 	for (int i = start_idx; i <= end_idx; i++) {
 
+		// a compressed cluster is written a page at a time again
+		if (compress_packed(node, i)) {
+			int rv = compress_unpack(node, inum, i / COMPRESS_CLUSTER);
+			if (rv < 0) {
+				printf("storage_write: can't unpack page %d of inode %d\n", i, inum);
+				return total_write > 0 ? total_write : rv;
+			}
+		}
+
 		if (i == 0 || i == 1)
 			blk = node->ptrs[i];
 		else {
@@ -190,8 +994,6 @@ storage_write(const char* path, const char* buf, size_t size, off_t offset)
 			blk = ipgs[i - 2];
 		}
 
-		data = pages_get_page(blk);
-
 		if (i == start_idx && i == end_idx) {
 			sz = size;
 			data_off = offset - start_idx * PAGE_SIZE;
@@ -209,7 +1011,50 @@ storage_write(const char* path, const char* buf, size_t size, off_t offset)
 			data_off = 0;
 		}
 
-		memcpy(data + data_off, (void*)buf + total_write, sz);
+		const void* src = (void*)buf + total_write;
+
+		// a whole page of zeros is a hole; delayed pages are checked when
+		// they're placed
+		if (sz == PAGE_SIZE && blk != DELALLOC_PNUM && S_ISREG(node->mode) && page_is_zero(src)) {
+			if (blk != -1) {
+				free_page(blk);
+				inode_set_pnum(node, i, -1);
+			}
+
+			total_write += sz;
+			continue;
+		}
+
+		// a write never lands on a page another pointer, or the
+		// snapshot, still has
+		if (blk == -1 || refs_shared(blk) || snap_frozen(blk) || (hot && blk > 0)) {
+			blk = storage_fill_hole(node, inum, i, blk);
+			if (blk == -1) {
+				printf("storage_write: out of pages at page %d of inode %d\n", i, inum);
+				return total_write > 0 ? total_write : -ENOSPC;
+			}
+		}
+
+		// a delayed page lost in a crash is owed a page again
+		if (blk == DELALLOC_PNUM && !delalloc_peek(inum, i) && delalloc_reserve(1) < 0) {
+			printf("storage_write: out of pages at page %d of inode %d\n", i, inum);
+			return total_write > 0 ? total_write : -ENOSPC;
+		}
+
+		if (blk == DELALLOC_PNUM)
+			data = delalloc_get(inum, i);
+		else
+			data = pages_get_data(blk);
+
+		if (sz == PAGE_SIZE && stream)
+			copy_page_stream(data, src);
+		else if (sz == PAGE_SIZE)
+			copy_page(data, src);
+		else
+			memcpy(data + data_off, src, sz);
+
+		pages_mark_data(blk);
+		pages_put_page(blk);
 		total_write += sz;
 	}
 
@@ -222,37 +1067,208 @@ storage_write(const char* path, const char* buf, size_t size, off_t offset)
 }
 
 int
-storage_truncate(const char *path, off_t size)
+storage_write(int inum, const char* buf, size_t size, off_t offset)
 {
-    int inum = tree_lookup(path);
-    if (inum < 0)
-        return inum;
+	// the file's new pages go near its others
+	pages_set_goal(inode_goal(inum));
+	int rv = storage_write_pages(inum, buf, size, offset);
+	pages_set_goal(-1);
+	return rv;
+}
 
+static int
+storage_truncate_pages(int inum, off_t size)
+{
     inode* node = get_inode(inum);
-    grow_inode(node, size);
 
+	if (tail_packed(node) && size != node->size) {
+		int rv = tail_unpack(node, inum);
+		if (rv < 0)
+			return rv;
+	}
+
+	// a cluster the new end cuts through can't stay compressed
+	int last = bytes_to_pages(size) - 1;
+	if (size < node->size && size % (COMPRESS_CLUSTER * PAGE_SIZE) != 0 && compress_packed(node, last)) {
+		int rv = compress_unpack(node, inum, last / COMPRESS_CLUSTER);
+		if (rv < 0)
+			return rv;
+	}
+
+    int rv = S_ISREG(node->mode) ? grow_inode_sparse(node, size) : grow_inode(node, size);
+	if (rv < 0)
+		return rv;
+
+	delalloc_drop(inum, bytes_to_pages(size));
+	compress_drop(inum, bytes_to_pages(size) / COMPRESS_CLUSTER);
     return 0;
 }
 
 int
-storage_mknod(const char* path, int mode)
+storage_truncate(int inum, off_t size)
+{
+	pages_set_goal(inode_goal(inum));
+	int rv = storage_truncate_pages(inum, size);
+	pages_set_goal(-1);
+	return rv;
+}
+
+static int
+storage_copy_bytes(int src, off_t off, int dst, off_t doff, size_t len)
+{
+	// the part of a clone that can't share pages
+	char* buf = malloc(PAGE_SIZE);
+	size_t done = 0;
+
+	while (done < len) {
+		size_t sz = min(len - done, PAGE_SIZE);
+
+		int rv = storage_read(src, buf, sz, off + done);
+		if (rv >= 0 && rv != sz)
+			rv = -EIO;
+		if (rv >= 0)
+			rv = storage_write(dst, buf, sz, doff + done);
+
+		if (rv < 0) {
+			free(buf);
+			return rv;
+		}
+
+		done += sz;
+	}
+
+	free(buf);
+	return 0;
+}
+
+static void
+storage_share_page(inode* snode, int sfpn, inode* dnode, int dfpn)
 {
-	char* dir_path = alloca(strlen(path) + 1);
-	strlcpy(dir_path, path, strlen(path) + 1);
+	int pnum = inode_get_pnum(snode, sfpn);
+	if (pnum > 0)
+		refs_get(pnum);
 
-	char* name = dir_path + strlen(path) + 1;
+	int old = inode_get_pnum(dnode, dfpn);
+	inode_set_pnum(dnode, dfpn, pnum);
+	free_page(old);
+}
 
-	while (name[0] != '/')
-		name--;
+static int
+storage_share_pages(inode* snode, int src, int sfpn, inode* dnode, int dst, int dfpn, int count)
+{
+	// delayed pages have nothing to share yet
+	int rv = delalloc_flush_inode(src);
+	if (rv == 0)
+		rv = delalloc_flush_inode(dst);
+	if (rv < 0)
+		return rv;
+
+	if (tail_packed(dnode)) {
+		rv = tail_unpack(dnode, dst);
+		if (rv < 0)
+			return rv;
+	}
 
-	name[0] = '\0';
-	name++;
+	if ((dfpn + count) * PAGE_SIZE > dnode->size) {
+		rv = grow_inode_sparse(dnode, (dfpn + count) * PAGE_SIZE);
+		if (rv < 0)
+			return rv;
+	}
 
-	int p_inum = tree_lookup(dir_path);
-	if (p_inum == -ENOENT) {
-		printf("storage_mknod: parent directory not found\n");
-		return -ENOENT;
+	int ii = 0;
+	while (ii < count) {
+		int sp = sfpn + ii;
+		int dp = dfpn + ii;
+		int whole = sp % COMPRESS_CLUSTER == 0 && dp % COMPRESS_CLUSTER == 0
+		            && count - ii >= COMPRESS_CLUSTER;
+
+		// a compressed cluster goes over as it is if it all does, and a
+		// compressed cluster this covers is let go; anything else that's
+		// compressed is copied
+		if (compress_packed(snode, sp) && whole) {
+			for (int jj = 0; jj < COMPRESS_CLUSTER; ++jj)
+				storage_share_page(snode, sp + jj, dnode, dp + jj);
+
+			ii += COMPRESS_CLUSTER;
+			continue;
+		}
+
+		if (compress_packed(dnode, dp) && dp % COMPRESS_CLUSTER == 0 && count - ii >= COMPRESS_CLUSTER) {
+			for (int jj = 0; jj < COMPRESS_CLUSTER; ++jj) {
+				free_page(inode_get_pnum(dnode, dp + jj));
+				inode_set_pnum(dnode, dp + jj, -1);
+			}
+		}
+
+		if (compress_packed(snode, sp) || compress_packed(dnode, dp)
+		    || inode_get_pnum(snode, sp) == DELALLOC_PNUM) {
+			rv = storage_copy_bytes(src, (off_t)sp * PAGE_SIZE, dst, (off_t)dp * PAGE_SIZE, PAGE_SIZE);
+			if (rv < 0)
+				return rv;
+		}
+		else {
+			storage_share_page(snode, sp, dnode, dp);
+		}
+
+		ii += 1;
 	}
+
+	compress_drop(dst, dfpn / COMPRESS_CLUSTER);
+	return 0;
+}
+
+int
+storage_clone_range(int src, off_t off, int dst, off_t doff, size_t len)
+{
+	// dst gets src's bytes without new pages where they line up: whole
+	// pages are shared until one side writes them. Returns the bytes
+	// cloned, fewer than len past the end of src. The caller names src by
+	// number, so it has to be one the kernel has open or has looked up.
+	if (src < 0 || src >= storage_nlookups || storage_lookups[src] == 0)
+		return -EBADF;
+
+	inode* snode = get_inode(src);
+	inode* dnode = get_inode(dst);
+	if (!S_ISREG(snode->mode) || !S_ISREG(dnode->mode))
+		return -EINVAL;
+
+	if (off >= snode->size)
+		return 0;
+	if (off + len > snode->size)
+		len = snode->size - off;
+
+	if (src == dst && off < doff + len && doff < off + len)
+		return -EINVAL;
+
+	// pages can only be shared if the two offsets are the same distance
+	// into a page; around them, bytes are copied
+	size_t head = len;
+	if (off % PAGE_SIZE == doff % PAGE_SIZE)
+		head = min(len, (PAGE_SIZE - off % PAGE_SIZE) % PAGE_SIZE);
+
+	int pages = (len - head) / PAGE_SIZE;
+	size_t tail = len - head - (size_t)pages * PAGE_SIZE;
+
+	printf("+ storage_clone_range(%d@%ld, %d@%ld, %ld) -> %ld + %d pages + %ld\n",
+	       src, off, dst, doff, len, head, pages, tail);
+
+	int rv = storage_copy_bytes(src, off, dst, doff, head);
+	if (rv == 0 && pages > 0)
+		rv = storage_share_pages(snode, src, (off + head) / PAGE_SIZE,
+		                         dnode, dst, (doff + head) / PAGE_SIZE, pages);
+	if (rv == 0)
+		rv = storage_copy_bytes(src, off + len - tail, dst, doff + len - tail, tail);
+	if (rv < 0)
+		return rv;
+
+	dnode->mod = (long)time(NULL);
+	return len;
+}
+
+int
+storage_mknod(int p_inum, const char* name, int mode)
+{
+	// the new inode's number, or -errno
 	inode* p_node = get_inode(p_inum);
 
     if (directory_lookup(p_node, name) != -ENOENT) {
@@ -261,9 +1277,25 @@ storage_mknod(const char* path, int mode)
     }
 
     int inum = alloc_inode();
+	if (inum < 0) {
+		printf("mknod fail: out of inodes\n");
+		return -ENOSPC;
+	}
+
     inode* node = get_inode(inum);
     node->mode = mode;
     node->size = 0;
+	node->flags = p_node->flags & (INODE_COMPRESS | INODE_HOT | INODE_COLD);
+	hot_touch(p_inum);
+	hot_inherit(p_inum, inum);
+
+	// a file's pages go in its directory's group; a new directory is
+	// put in one of its own if its parent's is filling up, or if it's
+	// at the top of the tree
+	if (S_ISDIR(mode))
+		inode_set_goal(inum, pages_pick_group(p_inum == 1 ? -1 : inode_goal(p_inum)));
+	else
+		inode_set_goal(inum, inode_goal(p_inum));
 	if (S_ISDIR(mode))
 		node->refs = 2;
 	else if (S_ISREG(mode))
@@ -274,89 +1306,189 @@ storage_mknod(const char* path, int mode)
 	node->acc = -1;
 	node->mod = -1;
 
-    printf("+ mknod create %s in %s [%04o] - #%d\n", name, dir_path, mode, inum);
+    printf("+ mknod create %s in %d [%04o] - #%d\n", name, p_inum, mode, inum);
 
-    int rv = directory_put(dir_path, name, inum);
-	
-	return rv;
+    int rv = directory_put(p_inum, name, inum);
+	if (rv < 0) {
+		free_inode(inum);
+		return rv;
+	}
+
+	return inum;
 }
 
 slist*
-storage_list(const char* path)
+storage_list(int inum)
 {
-	int inum = tree_lookup(path);
 	inode* dd = get_inode(inum);
     return directory_list(dd);
 }
 
 int
-storage_unlink(const char* path)
+storage_unlink(int p_inum, const char* name)
 {
-	int inum = tree_lookup(path);
+	int inum = directory_lookup(get_inode(p_inum), name);
+	if (inum < 0)
+		return inum;
+
 	inode* node = get_inode(inum);
+	if (S_ISDIR(node->mode) && node->size > 0) {
+		printf("storage_unlink: Cannot delete a nonempty directory\n");
+		return -ENOTEMPTY;
+	}
+
+	int rv = directory_delete(p_inum, name);
+	if (rv < 0)
+		return rv;
+
+	// it's still open, or about to be, while the kernel knows it
 	node->refs -= 1;
-	if (node->refs == 0)
+	if (node->refs == 0 && (inum >= storage_nlookups || storage_lookups[inum] == 0))
 		free_inode(inum);
-    return directory_delete(path);
+
+    return 0;
 }
 
 int
-storage_link(const char* from, const char* to)
+storage_link(int inum, int p_inum, const char* name)
 {
-	int rv = 0;
-	int inum = tree_lookup(from);
-
-	int plen = strlen(to);
-	char* dir_path = alloca(plen + 1);
-	strlcpy(dir_path, to, plen + 1);
-
-	char* name = dir_path + plen + 1;
+	if (directory_lookup(get_inode(p_inum), name) != -ENOENT)
+		return -EEXIST;
 
-	while (name[0] != '/')
-		name--;
-
-	name[0] = '\0';
-	name++;
-	
-	rv = directory_put(dir_path, name, inum);
+	int rv = directory_put(p_inum, name, inum);
+	if (rv < 0)
+		return rv;
 
 	inode* node = get_inode(inum);
 	node->refs += 1;
 
-    return rv;
+    return 0;
+}
+
+static int
+storage_in_tree(int dir, int inum)
+{
+	// whether inum is dir or somewhere under it; directories have no
+	// other links, so there's no loop to go around
+	if (dir == inum)
+		return 1;
+
+	inode* dd = get_inode(dir);
+	if (!S_ISDIR(dd->mode))
+		return 0;
+
+	// the names are in the request's arena
+	int found = 0;
+	for (slist* nn = directory_list(dd); nn && !found; nn = nn->next) {
+		int child = directory_lookup(dd, nn->data);
+		if (child > 0 && S_ISDIR(peek_inode(child)->mode))
+			found = storage_in_tree(child, inum);
+	}
+
+	return found;
 }
 
 int
-storage_rename(const char* from, const char* to)
+storage_rename(int p_inum, const char* name, int np_inum, const char* newname)
 {
-	int inum = tree_lookup(from);
-	directory_delete(from);
+	int inum = directory_lookup(get_inode(p_inum), name);
+	if (inum < 0)
+		return inum;
 
-	int plen = strlen(to);
-	char* dir_path = alloca(plen + 1);
-	strlcpy(dir_path, to, plen + 1);
+	// a directory can't be moved under itself
+	int is_dir = S_ISDIR(get_inode(inum)->mode);
+	if (is_dir && storage_in_tree(inum, np_inum))
+		return -EINVAL;
 
-	char* name = dir_path + plen + 1;
+	// whatever had the new name is replaced, if it's the same kind of
+	// file; storage_unlink turns away a directory that isn't empty
+	int old = directory_lookup(get_inode(np_inum), newname);
+	if (old == inum)
+		return 0;
 
-	while (name[0] != '/')
-		name--;
+	if (old >= 0 && S_ISDIR(get_inode(old)->mode) != is_dir)
+		return is_dir ? -ENOTDIR : -EISDIR;
 
-	name[0] = '\0';
-	name++;
+	int rv = old < 0 ? 0 : storage_unlink(np_inum, newname);
+	if (rv == 0)
+		rv = directory_put(np_inum, newname, inum);
+	if (rv < 0)
+		return rv;
 
-	directory_put(dir_path, name, inum);
+	directory_delete(p_inum, name);
 
     return 0;
 }
 
 int
-storage_set_time(const char* path, const struct timespec ts[2])
+storage_set_time(int inum, const struct timespec ts[2])
 {
-	int inum = tree_lookup(path);
+	// as utimensat: UTIME_NOW for now, UTIME_OMIT to leave it be
 	inode* node = get_inode(inum);
 
-	node->acc = ts[0].tv_sec;
-	node->mod = ts[1].tv_sec;
+	if (ts[0].tv_nsec != UTIME_OMIT)
+		node->acc = ts[0].tv_nsec == UTIME_NOW ? (long)time(NULL) : ts[0].tv_sec;
+	if (ts[1].tv_nsec != UTIME_OMIT)
+		node->mod = ts[1].tv_nsec == UTIME_NOW ? (long)time(NULL) : ts[1].tv_sec;
 
     return 0;
 }
+
+int
+storage_chmod(int inum, int mode)
+{
+	// the permission bits; what kind of file it is doesn't change
+	inode* node = get_inode(inum);
+	node->mode = (node->mode & S_IFMT) | (mode & ~S_IFMT);
+	return 0;
+}
+
+int
+storage_get_flags(int inum)
+{
+	return get_inode(inum)->flags;
+}
+
+int
+storage_set_flags(int inum, int flags)
+{
+	// only new writes see INODE_COMPRESS change; what's in the file
+	// stays as it was stored until it's rewritten
+	inode* node = get_inode(inum);
+	node->flags = flags;
+	printf("+ storage_set_flags(%d) -> %#x\n", inum, flags);
+	return 0;
+}
+
+int
+storage_snapshot()
+{
+	if (mount_opts.snapshot)
+		return -EROFS;
+
+	// it's a snapshot of the image, so what's still buffered goes there,
+	// and the changed page table is saved with it for exports to use
+	storage_commit_files(NULL);
+	int rv = delalloc_flush();
+	if (rv == 0)
+		rv = cbt_save();
+	if (rv == 0)
+		rv = snap_take();
+
+	// whatever changes from here on isn't in it
+	cbt_next();
+
+	printf("+ storage_snapshot() -> %d\n", rv);
+	return rv;
+}
+
+int
+storage_drop_snapshot()
+{
+	if (mount_opts.snapshot)
+		return -EROFS;
+
+	int rv = snap_drop();
+	printf("+ storage_drop_snapshot() -> %d\n", rv);
+	return rv;
+}
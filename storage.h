@@ -2,22 +2,83 @@
 #define NUFS_STORAGE_H
 
 #include <unistd.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <time.h>
 
 #include "slist.h"
 
+// Files are named by inode number; the kernel looks a name up in its
+// directory once and uses the number from then on. It's told about an
+// inode by storage_lookup, storage_mknod and storage_link, each of which
+// the caller answers with storage_hold, and storage_forget is how many
+// of those it's let go of. A file that's unlinked while the kernel still
+// has it is kept until it's forgotten, or until the next mount.
+
+// ioctl on the file being cloned into. The kernel only hands an ioctl
+// the inode it was made on, and a descriptor number means nothing outside
+// the process that has it, so the source is named by its st_ino, which is
+// its inode number here: fstat the source descriptor for it.
+typedef struct nufs_clone {
+	uint64_t src_ino;
+	uint64_t src_offset;
+	uint64_t src_length;  // 0 for everything from src_offset on
+	uint64_t dest_offset;
+} nufs_clone;
+
+#define NUFS_IOC_CLONE _IOW('N', 6, nufs_clone)
+
+// An open file, kept in fi->fh. Small sequential writes collect in buf
+// and reach storage_write together, as whole pages once it fills, or
+// when any other op comes along.
+typedef struct storage_file {
+	int    inum;
+	char*  buf;
+	off_t  off; // file offset of buf[0]
+	size_t len;
+	int    err; // from a commit nobody was waiting on
+	struct storage_file* next; // on the pending list while len > 0
+	off_t  ra_next;  // where a sequential reader reads next
+	int    ra_end;   // file page readahead has been issued up to
+	int    ra_pages; // readahead window, grows while the stream lasts
+} storage_file;
+
 void   storage_init(const char* path);
-int    storage_stat(const char* path, struct stat* st);
-int    storage_read(const char* path, char* buf, size_t size, off_t offset);
-int    storage_write(const char* path, const char* buf, size_t size, off_t offset);
-int    storage_truncate(const char *path, off_t size);
-int    storage_mknod(const char* path, int mode); 
-int    storage_unlink(const char* path);
-int    storage_link(const char *from, const char *to);
-int    storage_rename(const char *from, const char *to);
-int    storage_set_time(const char* path, const struct timespec ts[2]);
-slist* storage_list(const char* path);
+void   storage_free();
+void   storage_start_flusher();
+void   storage_start_scrubber();
+int    storage_defrag();
+void   storage_op_begin();
+void   storage_op_done();
+int    storage_lookup(int p_inum, const char* name);
+void   storage_hold(int inum);
+void   storage_forget(int inum, unsigned long count);
+int    storage_fsync(int inum, int datasync);
+storage_file* storage_open(int inum);
+int    storage_release(storage_file* file);
+int    storage_file_write(storage_file* file, const char* buf, size_t size, off_t offset);
+int    storage_file_error(storage_file* file);
+int    storage_file_read(storage_file* file, char* buf, size_t size, off_t offset);
+void   storage_prefault();
+int    storage_stat(int inum, struct stat* st);
+int    storage_statfs(struct statvfs* st);
+int    storage_read(int inum, char* buf, size_t size, off_t offset);
+int    storage_write(int inum, const char* buf, size_t size, off_t offset);
+int    storage_truncate(int inum, off_t size);
+int    storage_clone_range(int src, off_t off, int dst, off_t doff, size_t len);
+int    storage_mknod(int p_inum, const char* name, int mode);
+int    storage_unlink(int p_inum, const char* name);
+int    storage_link(int inum, int p_inum, const char* name);
+int    storage_rename(int p_inum, const char* name, int np_inum, const char* newname);
+int    storage_set_time(int inum, const struct timespec ts[2]);
+int    storage_chmod(int inum, int mode);
+int    storage_get_flags(int inum);
+int    storage_set_flags(int inum, int flags);
+int    storage_snapshot();
+int    storage_drop_snapshot();
+slist* storage_list(int inum);
 
 #endif
@@ -0,0 +1,311 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "tail.h"
+#include "pages.h"
+#include "inode.h"
+#include "delalloc.h"
+#include "copy.h"
+#include "csum.h"
+#include "util.h"
+
+#include "globals.h"
+
+extern int PAGE_COUNT;
+extern const int PAGE_SIZE;
+extern int INODE_COUNT;
+
+extern nufs_opts mount_opts;
+
+// fragment pages with room that a new tail tries before taking a page
+#define TAIL_ROOM 64
+
+static uint64_t* tail_used = NULL; // by page number, a bit per unit in use
+static int       tail_bits = 0;
+static int       tail_room[TAIL_ROOM];
+static int       tail_nroom = 0;
+static int       tail_last = -1;   // where the last tail went
+static void*     tail_buf = NULL;  // a tail, padded out to a page
+
+static int  tail_pages = 0;
+static long tail_bytes = 0;
+static long tail_packs = 0;
+static long tail_unpacks = 0;
+static long tail_bad = 0;
+
+static int
+tail_units(int bytes)
+{
+	return (bytes + TAIL_UNIT - 1) / TAIL_UNIT;
+}
+
+static uint64_t
+tail_mask(int unit, int units)
+{
+	uint64_t ones = units >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << units) - 1;
+	return ones << unit;
+}
+
+static void
+tail_offer(int pnum)
+{
+	// it has room again; newer pages push out the oldest
+	for (int ii = 0; ii < tail_nroom; ++ii) {
+		if (tail_room[ii] == pnum)
+			return;
+	}
+
+	if (tail_nroom == TAIL_ROOM) {
+		memmove(tail_room, tail_room + 1, (TAIL_ROOM - 1) * sizeof(int));
+		tail_nroom -= 1;
+	}
+
+	tail_room[tail_nroom++] = pnum;
+}
+
+static void
+tail_withdraw(int pnum)
+{
+	if (tail_last == pnum)
+		tail_last = -1;
+
+	for (int ii = 0; ii < tail_nroom; ++ii) {
+		if (tail_room[ii] == pnum) {
+			tail_room[ii] = tail_room[--tail_nroom];
+			return;
+		}
+	}
+}
+
+static int
+tail_fit(int pnum, int units)
+{
+	// the first free run of units in the page, or -1; only pages in the
+	// group the file's going in will do
+	if (pnum <= 0 || pnum >= tail_bits || !pages_in_goal(pnum))
+		return -1;
+
+	int per = PAGE_SIZE / TAIL_UNIT;
+	for (int unit = 0; unit + units <= per; ++unit) {
+		if (!(tail_used[pnum] & tail_mask(unit, units)))
+			return unit;
+	}
+
+	return -1;
+}
+
+void
+tail_init()
+{
+	tail_buf = malloc(PAGE_SIZE);
+
+	// sized for the largest the image can grow to
+	tail_bits = PAGE_COUNT > mount_opts.max_pages ? PAGE_COUNT : mount_opts.max_pages;
+	tail_used = calloc(tail_bits, sizeof(uint64_t));
+	tail_nroom = 0;
+	tail_last = -1;
+	tail_pages = 0;
+	tail_bytes = 0;
+
+	for (int inum = 1; inum < INODE_COUNT; ++inum) {
+		inode* node = peek_inode(inum);
+		if (node->mode == 0 || !tail_packed(node))
+			continue;
+
+		int pnum = node->ptrs[1];
+		uint64_t mask = tail_mask(node->tail / TAIL_UNIT, tail_units(node->size));
+		if (pnum <= 0 || pnum >= tail_bits || node->tail % TAIL_UNIT != 0 ||
+		    node->tail + node->size > PAGE_SIZE || (tail_used[pnum] & mask)) {
+			printf("tail_init: inode %d's tail at %d+%d is bad\n", inum, pnum, node->tail);
+			tail_bad += 1;
+			continue;
+		}
+
+		if (tail_used[pnum] == 0)
+			tail_pages += 1;
+
+		tail_used[pnum] |= mask;
+		tail_bytes += node->size;
+	}
+
+	for (int pnum = 1; pnum < tail_bits && tail_nroom < TAIL_ROOM; ++pnum) {
+		if (tail_used[pnum] && ~tail_used[pnum])
+			tail_room[tail_nroom++] = pnum;
+	}
+
+	printf("+ tail_init() -> %d fragment pages, %ld bytes\n", tail_pages, tail_bytes);
+}
+
+void
+tail_free()
+{
+	printf("=======TAIL STATS========\n");
+	printf("packed  : %ld\n", tail_packs);
+	printf("unpacked: %ld\n", tail_unpacks);
+	printf("pages   : %d, %ld bytes of tails\n", tail_pages, tail_bytes);
+	printf("bad     : %ld\n", tail_bad);
+	printf("\n");
+
+	free(tail_used);
+	free(tail_buf);
+	tail_used = NULL;
+	tail_buf = NULL;
+}
+
+int
+tail_wanted(inode* node)
+{
+	return S_ISREG(node->mode) && node->size > 0 && node->size <= mount_opts.tail &&
+	       node->size < PAGE_SIZE;
+}
+
+int
+tail_packed(inode* node)
+{
+	return node->size < PAGE_SIZE && node->ptrs[0] == TAIL_PNUM;
+}
+
+int
+tail_pack(inode* node, int inum, const void* buf)
+{
+	// buf is the file's only page, delayed; returns 0 if it's in a
+	// fragment page now, -1 if it should go in as it is
+	int units = tail_units(node->size);
+
+	// next to the last one, so small files written together are read
+	// together; then anywhere there's room
+	int pnum = tail_last;
+	int unit = tail_fit(pnum, units);
+	for (int ii = tail_nroom - 1; ii >= 0 && unit == -1; --ii) {
+		pnum = tail_room[ii];
+		unit = tail_fit(pnum, units);
+	}
+
+	int fresh = unit == -1;
+	if (fresh) {
+		pnum = alloc_page();
+		if (pnum == -1 || pnum >= tail_bits) {
+			free_page(pnum);
+			return -1;
+		}
+
+		tail_pages += 1;
+		unit = 0;
+	}
+
+	char* page = pages_get_page(pnum);
+	if (fresh)
+		memset(page, 0, PAGE_SIZE);
+
+	memcpy(page + unit * TAIL_UNIT, buf, node->size);
+	memset(page + unit * TAIL_UNIT + node->size, 0, units * TAIL_UNIT - node->size);
+	pages_mark_dirty(pnum);
+	pages_put_page(pnum);
+
+	tail_used[pnum] |= tail_mask(unit, units);
+	if (~tail_used[pnum])
+		tail_last = pnum;
+	else
+		tail_withdraw(pnum);
+
+	node->ptrs[0] = TAIL_PNUM;
+	node->ptrs[1] = pnum;
+	node->tail = unit * TAIL_UNIT;
+
+	tail_bytes += node->size;
+	tail_packs += 1;
+	printf("+ tail_pack(%d) -> %d+%d\n", inum, pnum, node->tail);
+	return 0;
+}
+
+const char*
+tail_get(inode* node)
+{
+	// the file's data, zeros to the end of the page; NULL if it's corrupt
+	int pnum = node->ptrs[1];
+	if (pnum <= 0 || pnum >= PAGE_COUNT || node->tail < 0 || node->tail + node->size > PAGE_SIZE)
+		goto bad;
+
+	// it's metadata, so it's always checked
+	const char* page = pages_get_page(pnum);
+	if (csum_bad(pnum)) {
+		pages_put_page(pnum);
+		goto bad;
+	}
+
+	memcpy(tail_buf, page + node->tail, node->size);
+	memset(tail_buf + node->size, 0, PAGE_SIZE - node->size);
+	pages_put_page(pnum);
+	return tail_buf;
+
+bad:
+	printf("tail_get: tail at %d+%d is corrupt\n", pnum, node->tail);
+	tail_bad += 1;
+	return NULL;
+}
+
+int
+tail_unpack(inode* node, int inum)
+{
+	// back to a page of its own, before it changes; delayed if it can
+	// be, so it's packed again when it's placed
+	const char* data = tail_get(node);
+	if (!data)
+		return -EIO;
+
+	int pnum = DELALLOC_PNUM;
+	if (delalloc_enabled()) {
+		if (delalloc_reserve(1) < 0)
+			return -ENOSPC;
+
+		copy_page(delalloc_get(inum, 0), data);
+	}
+	else {
+		pnum = alloc_page();
+		if (pnum == -1)
+			return -ENOSPC;
+
+		copy_page(pages_get_data(pnum), data);
+		pages_mark_data(pnum);
+		pages_put_page(pnum);
+	}
+
+	tail_release(node);
+	node->ptrs[0] = pnum;
+
+	tail_unpacks += 1;
+	return 0;
+}
+
+void
+tail_release(inode* node)
+{
+	// the slot is let go, and the fragment page with it if that was
+	// the last one in it
+	if (!tail_packed(node))
+		return;
+
+	int pnum = node->ptrs[1];
+	if (pnum > 0 && pnum < tail_bits) {
+		tail_used[pnum] &= ~tail_mask(node->tail / TAIL_UNIT, tail_units(node->size));
+		tail_bytes -= node->size;
+
+		if (tail_used[pnum] == 0) {
+			tail_withdraw(pnum);
+			free_page(pnum);
+			tail_pages -= 1;
+		}
+		else {
+			tail_offer(pnum);
+		}
+	}
+
+	node->ptrs[0] = -1;
+	node->ptrs[1] = -1;
+	node->tail = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef TAIL_H
+#define TAIL_H
+
+#include "inode.h"
+
+// block pointer of a file packed into a fragment page
+#define TAIL_PNUM -4
+
+#define TAIL_UNIT 64 // fragment pages are handed out in this many bytes
+
+// Tail packing. A regular file of no more than -o tail bytes keeps its
+// data in a slot of a fragment page it shares with other small files,
+// instead of in a page of its own. Its first pointer is TAIL_PNUM, its
+// second is the fragment page, node->tail is where the slot starts, and
+// the slot is as long as the file. Like compression, it happens when a
+// file's delayed page is placed, and a write to the file takes it back
+// out first. Fragment pages are metadata: they're journaled, and copied
+// for a snapshot before they change. What's used in them isn't stored;
+// it's worked out from the inodes at mount.
+void tail_init();
+void tail_free();
+int  tail_wanted(inode* node);
+int  tail_packed(inode* node);
+int  tail_pack(inode* node, int inum, const void* buf);
+const char* tail_get(inode* node);
+int  tail_unpack(inode* node, int inum);
+void tail_release(inode* node);
+
+#endif
@@ -2,16 +2,20 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 81;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts) = @_;
+    $opts = $opts ? "OPTS='-o $opts'" : "";
+    system("(make mount $opts 2>&1) >> test.log &");
     sleep 1;
 }
 
 sub unmount {
     system("(make unmount 2>&1) >> test.log");
+    # the image isn't all written out until the daemon's gone
+    system("while pgrep -x nufs > /dev/null; do sleep 0.1; done");
 }
 
 sub write_text {
@@ -41,6 +45,72 @@ sub read_text_slice {
     return $data;
 }
 
+sub free_pages {
+    my $free = `stat -f -c %f mnt`;
+    chomp $free;
+    return $free;
+}
+
+sub first_page {
+    # an inode's first page, from the unmounted image: page 0 has 92
+    # inodes after the bitmap, and the superblock's ilist the pages with
+    # the rest
+    my ($image, $inum) = @_;
+    my $at = 256 + 40 * $inum;
+    if ($inum >= 92) {
+        my $ilist = unpack("l", substr($image, 4096 - 128 + 16, 4));
+        my $page = unpack("l", substr($image, 4096 * $ilist + 4 * int(($inum - 92) / 102), 4));
+        $at = 4096 * $page + 40 * (($inum - 92) % 102);
+    }
+    return unpack("l", substr($image, $at + 12, 4));
+}
+
+# NUFS_IOC_CLONE, _IOW('N', 6, nufs_clone)
+my $NUFS_IOC_CLONE = (1 << 30) | (32 << 16) | (ord('N') << 8) | 6;
+
+sub clone_file {
+    my ($from, $to) = @_;
+    open my $src, "<", "mnt/$from" or return 0;
+    open my $dst, ">", "mnt/$to" or return 0;
+    # the source goes by its inode number
+    my $arg = pack("QQQQ", (stat $src)[1], 0, 0, 0);
+    my $rv = ioctl($dst, $NUFS_IOC_CLONE, $arg);
+    close $dst;
+    close $src;
+    return $rv;
+}
+
+sub write_baseline_image {
+    # page 0 as it was before the superblock: the page bitmap, then an
+    # inode table running from byte 256 to the end of the page
+    my ($path, $files) = @_;
+    my $img = "\0" x (256 * 4096);
+    my $dirent = sub { pack("Z48 l", @_) };
+    my $inode = sub { pack("c c s l l l l l q q", @_, 0, 0) };
+
+    # pages 0-2 are the bitmap and inodes and the root directory; the
+    # last file's data is in page 3
+    substr($img, 0, 1) = chr(0x0f);
+    my $last = $files + 1;
+    my $ents = "";
+    for my $inum (2..$last) {
+        my $size = $inum == $last ? 6 : 0;
+        my $ptr = $inum == $last ? 3 : -1;
+        substr($img, 256 + 40 * $inum, 40) = $inode->(1, 0, 0, 0100644, $size, $ptr, -1, -1);
+        # a directory page holds as many whole entries as fit
+        $ents .= "\0" x (4096 % 52) if length($ents) % 4096 == 4096 - 4096 % 52;
+        $ents .= $dirent->("f$inum", $inum);
+    }
+    substr($img, 256 + 40, 40) = $inode->(2, 0, 0, 040755, 52 * $files, 1, 2, -1);
+    substr($img, 4096, length($ents)) = $ents;
+    substr($img, 3 * 4096, 6) = "hello\n";
+
+    open my $fh, ">", $path or return;
+    binmode $fh;
+    print $fh $img;
+    close $fh;
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -187,4 +257,393 @@ mount();
 my $mm = `ls mnt/numbers | wc -l`;
 ok($mm == 46, "deleted 4 files");
 
+say "#           == Clone Tests ==";
+
+my $big0 = "=This string is fourty characters long.=" x 4096;
+write_text("160k.txt", $big0);
+# the first one puts the source's delayed pages in the image
+clone_file("160k.txt", "160k-a.txt");
+
+my $free0 = free_pages();
+ok(clone_file("160k.txt", "160k-b.txt"), "cloned a file");
+my $free1 = free_pages();
+say "# free pages $free0 -> $free1";
+ok($free0 - $free1 <= 1, "clone shares the source's pages");
+
+my $big1 = read_text("160k-b.txt");
+ok($big0 eq $big1, "Read back clone.");
+
+open my $fh, "+<", "mnt/160k-b.txt";
+print $fh "changed";
+close $fh;
+my $big2 = read_text("160k.txt");
+ok($big0 eq $big2, "Source unchanged after writing the clone.");
+
+say "#           == Export Tests ==";
+
+# a copy of the image as it is now, and the generation it's at
+unmount();
+system("cp data.nufs copy.nufs");
+my $gen = `./nufs export data.nufs 0 full.exp 2>&1 > /dev/null`;
+chomp $gen;
+ok($gen =~ /^\d+$/, "exported the whole image");
+
+mount();
+write_text("one.txt", "back again");
+write_text("40k.txt", "shorter now");
+system("rm -f mnt/numbers/1.num");
+system("mkdir mnt/exported");
+write_text("exported/new.txt", "new since the copy");
+system("rm -rf expect; cp -r mnt expect");
+unmount();
+
+system("./nufs export data.nufs $gen changes.exp > /dev/null");
+my $applied = system("./nufs apply copy.nufs changes.exp > /dev/null");
+ok($applied == 0, "applied the changes to the copy");
+$applied = system("./nufs apply copy.nufs changes.exp > /dev/null");
+ok($applied != 0, "refused to apply the changes a second time");
+
+system("mv data.nufs orig.nufs; mv copy.nufs data.nufs");
+mount();
+my $diff = `diff -r expect mnt 2>&1`;
+say "# $_" for split /\n/, $diff;
+ok($diff eq "", "copy matches the original after apply");
+system("rm -rf expect full.exp changes.exp orig.nufs");
+
+say "#           == Journal Tests ==";
+
+open my $jh, ">", "mnt/journal.txt";
+print $jh $msg0;
+$jh->flush;
+$jh->sync;
+close $jh;
+
+# the daemon dies without a checkpoint, so what fsync committed is only
+# sure to be home once the journal's been replayed
+system("pkill -9 -x nufs; sleep 0.5; fusermount -u mnt");
+mount();
+ok(read_text("journal.txt") eq $msg0, "fsynced file survives a crash");
+unmount();
+
+my @replays = `grep "journal_replay() ->" test.log`;
+ok(@replays && $replays[-1] =~ /-> [1-9]\d* transactions/, "journal replayed after the crash");
+
+# through the cache, the home pages are only written at a checkpoint;
+# an export after a crash has to get the rest from the journal
+mount("backend=pread");
+open $jh, ">", "mnt/exported.txt";
+print $jh $msg0;
+$jh->flush;
+$jh->sync;
+close $jh;
+system("pkill -9 -x nufs; sleep 0.5; fusermount -u mnt");
+
+system("rm -f copy.nufs; ./nufs export data.nufs 0 full.exp > /dev/null 2>&1");
+system("./nufs apply copy.nufs full.exp > /dev/null 2>&1");
+system("mv copy.nufs data.nufs; rm -f full.exp");
+mount();
+ok(read_text("exported.txt") eq $msg0, "export after a crash has what was in the journal");
+
+say "#           == Snapshot Tests ==";
+
+write_text("snap.txt", "before the snapshot");
+
+# NUFS_IOC_SNAPSHOT, _IO('N', 1)
+open my $sh, "<", "mnt/snap.txt";
+ok(ioctl($sh, 0x4e01, 0), "took a snapshot");
+close $sh;
+
+write_text("snap.txt", "after the snapshot");
+write_text("snap-new.txt", "after the snapshot");
+unmount();
+
+mount("snapshot");
+ok(read_text("snap.txt") eq "before the snapshot", "snapshot mount has the old contents");
+ok(!-e "mnt/snap-new.txt", "snapshot mount doesn't have what came after");
+ok(!open(my $rh, ">", "mnt/snap-x.txt"), "snapshot mount is read only");
+unmount();
+
+mount();
+ok(read_text("snap.txt") eq "after the snapshot", "live mount has the new contents");
+
+say "#           == Defrag Tests ==";
+
+# two files written a bit at a time and fsynced in turn end up in pages
+# between each other's
+open my $fa, ">", "mnt/frag.txt";
+open my $fb, ">", "mnt/pad.txt";
+my $frag0 = "";
+for my $ii (0..7) {
+    my $chunk = chr(ord('a') + $ii) x 8192;
+    $frag0 .= $chunk;
+    for my $fh ($fa, $fb) {
+        print $fh $chunk;
+        $fh->flush;
+        $fh->sync;
+    }
+}
+close $fa;
+close $fb;
+
+# NUFS_IOC_DEFRAG, _IO('N', 3)
+open my $dh, "<", "mnt/frag.txt";
+ok(ioctl($dh, 0x4e03, 0), "started a defrag pass");
+close $dh;
+
+sleep 2;
+my $frag1 = read_text("frag.txt");
+ok($frag0 eq $frag1, "Read back after defrag.");
+unmount();
+
+my @moved = `grep "^moved   :" test.log`;
+ok(@moved && $moved[-1] =~ /^moved   : [1-9]/, "defrag moved the fragmented files");
+mount();
+
+# and again, with the daemon killed while the pass is under way
+open $fa, ">", "mnt/frag2.txt";
+open $fb, ">", "mnt/pad2.txt";
+for my $ii (0..7) {
+    my $chunk = chr(ord('a') + $ii) x 8192;
+    for my $fh ($fa, $fb) {
+        print $fh $chunk;
+        $fh->flush;
+        $fh->sync;
+    }
+}
+close $fa;
+close $fb;
+
+open $dh, "<", "mnt/frag2.txt";
+ioctl($dh, 0x4e03, 0);
+close $dh;
+system("pkill -9 -x nufs; sleep 0.5; fusermount -u mnt");
+mount();
+my $frag2 = read_text("frag2.txt");
+ok($frag0 eq $frag2, "Read back after a crash during defrag.");
+my $pad2 = read_text("pad2.txt");
+ok($frag0 eq $pad2, "Read back the other file after a crash during defrag.");
+
+say "#           == Format Tests ==";
+unmount();
+
+my $rv = system("timeout 5 ./nufs -s -f -o grow=lots mnt bad.nufs >> test.log 2>&1");
+ok($rv >> 8 == 255, "refused to mount with a bad grow option");
+
+# the superblock covers what were inodes 92-95
+write_baseline_image("data.nufs", 94);
+mount();
+my @old = glob("mnt/f*");
+ok(@old == 94, "Listed every file of an old image.");
+ok(read_text("f95") eq "hello", "Read back a file from the old image's last inodes.");
+write_text("f96", "world");
+unmount();
+mount();
+ok(read_text("f95") eq "hello" && read_text("f96") eq "world", "Read back the old image after remount.");
+
+say "#           == Errno Tests ==";
+mkdir "mnt/top";
+mkdir "mnt/top/sub";
+ok(!rmdir("mnt/top") && $!{ENOTEMPTY}, "rmdir of a nonempty directory is ENOTEMPTY");
+ok(!rename("mnt/top", "mnt/top/sub/top") && $!{EINVAL}, "moving a directory under itself is EINVAL");
+write_text("plain.txt", "plain");
+ok(!rename("mnt/plain.txt", "mnt/top") && $!{EISDIR}, "moving a file onto a directory is EISDIR");
+
+open my $ph, "<", "mnt/plain.txt";
+ok(!ioctl($ph, 0x4e7f, 0) && $!{ENOTTY}, "an unknown ioctl is ENOTTY");
+close $ph;
+
+say "#           == Delalloc Tests ==";
+
+# new pages are held in memory until a flush gives them a home; a read
+# before then sees them there, and a remount sees where they went
+my $delayed = join("", map { chr(ord('a') + $_) x 4096 } 0..5);
+open my $dfh, ">", "mnt/delayed.txt";
+print $dfh $delayed;
+close $dfh;
+ok(read_text_slice("delayed.txt", length($delayed), 0) eq $delayed, "Read back delayed pages.");
+
+# a page past the end that's never been written reads as zeros
+open $dfh, "+<", "mnt/delayed.txt";
+seek $dfh, 8 * 4096, 0;
+print $dfh "end";
+close $dfh;
+ok(read_text_slice("delayed.txt", 4096, 6 * 4096) eq "\0" x 4096, "Read back a hole next to delayed pages.");
+
+unmount();
+my @placed = `grep "^placed  :" test.log`;
+ok(@placed && $placed[-1] =~ /^placed  : [1-9]/, "delayed pages were placed by unmount");
+mount();
+ok(read_text_slice("delayed.txt", length($delayed), 0) eq $delayed, "Read back delayed pages after remount.");
+
+say "#           == Write Buffer Tests ==";
+
+# small appends collect on the open file and go to storage together;
+# closing it commits what's left
+my $logpos = -s "test.log";
+open my $wfh, ">", "mnt/appends.txt";
+my $appended = "";
+for my $ii (0..199) {
+    my $line = sprintf("append %03d\n", $ii);
+    syswrite $wfh, $line;
+    $appended .= $line;
+}
+my $wino = (stat $wfh)[1];
+close $wfh;
+ok(read_text_slice("appends.txt", 4096, 0) eq $appended, "Read back buffered appends after close.");
+
+unmount();
+open my $log, "<", "test.log";
+seek $log, $logpos, 0;
+my @commits = grep { /^ \+ storage_write\($wino\)/ } <$log>;
+close $log;
+ok(@commits > 0 && @commits < 50, "200 appends went to storage in a few writes");
+mount();
+ok(read_text_slice("appends.txt", 4096, 0) eq $appended, "Read back buffered appends after remount.");
+
+say "#           == Scrub Tests ==";
+
+# a data page changed on disk behind our back; with every page summed,
+# the scrubber finds it and a read won't hand it out
+unmount();
+mount("checksum=all");
+my $scrubbed = "scrub me, " x 409 . "scrub!";
+open my $sfh, ">", "mnt/scrub.txt";
+print $sfh $scrubbed;
+close $sfh;
+unmount();
+
+open my $img, "+<", "data.nufs";
+binmode $img;
+my $image = do { local $/ = undef; <$img> };
+my $at = index($image, $scrubbed);
+ok($at > 0 && $at % 4096 == 0, "found the file's page in the image");
+seek $img, $at + 100, 0;
+print $img "X";
+close $img;
+
+mount("checksum=all,scrub=65536");
+sleep 2;
+ok(read_text("scrub.txt") eq "", "a corrupt page isn't read back");
+unlink "mnt/scrub.txt";
+unmount();
+
+my @scrubs = `grep "^scrubbed    :" test.log`;
+ok(@scrubs && $scrubs[-1] =~ /\([1-9]\d* bad\)/, "the scrubber found the corrupt page");
+mount();
+
+say "#           == Compress Tests ==";
+
+# text compresses well; what's read back is what was written, before
+# and after the clusters are packed, and after one's been rewritten
+unmount();
+mount("compress=all");
+my $text = join("", map { sprintf("line %05d: the quick brown fox\n", $_) } 0..9999);
+open my $cfh, ">", "mnt/text.txt";
+print $cfh $text;
+close $cfh;
+ok(read_text_slice("text.txt", length($text), 0) eq $text, "Read back a compressible file.");
+unmount();
+
+my @packs = `grep "^clusters    :" test.log`;
+ok(@packs && $packs[-1] =~ /^clusters    : [1-9]/, "the file was stored compressed");
+mount();
+ok(read_text_slice("text.txt", length($text), 0) eq $text, "Read back a compressed file after remount.");
+
+open $cfh, "+<", "mnt/text.txt";
+seek $cfh, 70000, 0;
+print $cfh "REWRITTEN";
+close $cfh;
+substr($text, 70000, 9) = "REWRITTEN";
+unmount();
+mount();
+ok(read_text_slice("text.txt", length($text), 0) eq $text, "Read back a compressed file after a write into it.");
+
+say "#           == Dedup Tests ==";
+
+# two files with the same pages share them; a write to one gets it its
+# own page and leaves the other as it was
+unmount();
+mount("dedup=1024");
+my $same = join("", map { chr(ord('A') + $_) x 4096 } 0..7);
+for my $name ("same1.txt", "same2.txt") {
+    open my $dfh, ">", "mnt/$name";
+    print $dfh $same;
+    close $dfh;
+}
+unmount();
+
+my @dups = `grep "^duplicates  :" test.log`;
+ok(@dups && $dups[-1] =~ /^duplicates  : [1-9]/, "the second file's pages were duplicates");
+mount("dedup=1024");
+
+open $dfh, "+<", "mnt/same2.txt";
+seek $dfh, 4096 + 10, 0;
+print $dfh "changed";
+close $dfh;
+my $changed = $same;
+substr($changed, 4096 + 10, 7) = "changed";
+unmount();
+mount();
+ok(read_text_slice("same1.txt", length($same), 0) eq $same, "Read back a deduped file after a write to its twin.");
+ok(read_text_slice("same2.txt", length($same), 0) eq $changed, "Read back the written twin.");
+
+say "#           == Tail Tests ==";
+
+# small files share fragment pages instead of taking one each
+my %tails = map { ("tail$_.txt" => join(" ", ("tail $_") x (20 * $_))) } 1..5;
+write_text($_, $tails{$_}) for keys %tails;
+unmount();
+
+my @frags = `grep "bytes of tails" test.log`;
+ok(@frags && $frags[-1] =~ /^pages   : [1-9]\d*, [1-9]\d* bytes/, "small files were tail packed");
+mount();
+ok(!grep({ read_text($_) ne $tails{$_} } keys %tails), "Read back tail packed files after remount.");
+
+say "#           == Group Tests ==";
+
+# a file's pages go in its directory's allocation group
+my %grouped;
+for my $dir ("group1", "group2") {
+    mkdir "mnt/$dir";
+    write_text("$dir/file.txt", "grouped " x 1024);
+    $grouped{$dir} = [(stat "mnt/$dir")[1], (stat "mnt/$dir/file.txt")[1]];
+}
+unmount();
+
+open my $gfh, "<", "data.nufs";
+binmode $gfh;
+my $gimage = do { local $/ = undef; <$gfh> };
+close $gfh;
+for my $dir (sort keys %grouped) {
+    my ($dpage, $fpage) = map { first_page($gimage, $_) } @{$grouped{$dir}};
+    ok($dpage > 0 && $fpage > 0 && int($dpage / 256) == int($fpage / 256),
+       "$dir/file.txt is in its directory's group ($dpage, $fpage)");
+}
+mount();
+
+say "#           == Hot Tier Tests ==";
+
+# a hot file's pages stay in memory past writeback; fsync and unmount
+# are what put them in the image
+unmount();
+mount("hot=256");
+
+# NUFS_IOC_SET_TIER, _IOW('N', 5, int), HOT_ALWAYS
+my $NUFS_IOC_SET_TIER = (1 << 30) | (4 << 16) | (ord('N') << 8) | 5;
+my $hot = join("", map { chr(ord('k') + $_) x 4096 } 0..3);
+open my $hfh, ">", "mnt/hot.txt";
+ok(ioctl($hfh, $NUFS_IOC_SET_TIER, pack("i", 1)), "put a file in the hot tier");
+print $hfh $hot;
+$hfh->flush;
+$hfh->sync;
+print $hfh "and after the fsync";
+close $hfh;
+$hot .= "and after the fsync";
+sleep 1;
+ok(read_text_slice("hot.txt", length($hot), 0) eq $hot, "Read back a hot file.");
+
+unmount();
+mount();
+ok(read_text_slice("hot.txt", length($hot), 0) eq $hot, "Read back a hot file after fsync and unmount.");
+
 unmount();
@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <string.h>
+#include <time.h>
 
 static int
 streq(const char* aa, const char* bb)
@@ -27,6 +28,14 @@ clamp(int x, int v0, int v1)
     return max(v0, min(x, v1));
 }
 
+static long
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
 static int
 bytes_to_pages(int bytes)
 {